@@ -1,75 +1,55 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "MIPSLite.h"
 #include "MIPSDataStructure.h"
+#include "MIPSTrace.h"
+#include "MIPSImage.h"
+#include "MIPSCheckpoint.h"
+#include "MIPSPipeTrace.h"
+#include "MIPSProfile.h"
+#include "MIPSAsm.h"
+#include "MIPSFuzz.h"
+
+// Ends the run with an error status. Errors are found deep inside the stage
+// functions, so this unwinds straight back to the API call that started them.
+void sim_fail(Simulator *sim, SimStatus status)
+{
+    sim->status = status;
+    longjmp(*sim->exit_jmp, 1);
+}
 
 const char *get_instruction_name(uint8_t opcode)
 {
-    switch (opcode)
-    {
-    case 0x00:
-        return "ADD";
-    case 0x01:
-        return "ADDI";
-    case 0x02:
-        return "SUB";
-    case 0x03:
-        return "SUBI";
-    case 0x04:
-        return "MUL";
-    case 0x05:
-        return "MULI";
-    case 0x06:
-        return "OR";
-    case 0x07:
-        return "ORI";
-    case 0x08:
-        return "AND";
-    case 0x09:
-        return "ANDI";
-    case 0x0A:
-        return "XOR";
-    case 0x0B:
-        return "XORI";
-    case 0x0C:
-        return "LDW";
-    case 0x0D:
-        return "STW";
-    case 0x0E:
-        return "BZ";
-    case 0x0F:
-        return "BEQ";
-    case 0x10:
-        return "JR";
-    case 0x11:
-        return "HALT";
-    default:
-        return "UNKNOWN";
-    }
+    const char *name = asm_opcodes[opcode & 0x3F].name;
+    return name != NULL ? name : "UNKNOWN";
 }
 
-char *get_decode_str(instruction raw)
+// Disassembles an instruction for the pipeline trace. The text is written
+// into a small per-thread ring of buffers rather than allocated, and stays valid
+// for the next DECODE_STR_SLOTS - 1 calls, enough for every stage printed by
+// print_pipeline().
+const char *get_decode_str(instruction raw)
 {
+    static _Thread_local char decode_str_ring[DECODE_STR_SLOTS][DECODE_STR_LEN];
+    static _Thread_local unsigned int next_slot = 0;
+
     uint32_t instr = raw.instruction;
     uint8_t opcode = (instr >> 26) & 0x3F; // Extract opcode (6 bits)
     uint8_t rs, rt, rd;
     int16_t imm;
-    char *decodedInst = malloc(100 * sizeof(char));
-    sprintf(decodedInst, "NULL");
-    // Define R-type opcodes explicitly
-    if (opcode == 0x00 || opcode == 0x02 || opcode == 0x04 || opcode == 0x06 ||
-        opcode == 0x08 || opcode == 0x0A) // R-type instruction opcodes
+    char *decodedInst = decode_str_ring[next_slot++ % DECODE_STR_SLOTS];
+    if (asm_opcodes[opcode].format == ASM_R) // R-type instruction opcodes
     {
         rs = (instr >> 21) & 0x1F; // Extract Rs (5 bits)
         rt = (instr >> 16) & 0x1F; // Extract Rt (5 bits)
         rd = (instr >> 11) & 0x1F; // Extract Rd (5 bits)
 
-        sprintf(decodedInst, "%s R%d, R%d, R%d", get_instruction_name(opcode), rd, rt, rs);
-        // Debug output
-        // printf("DEBUG: Decoded R-type Instruction: %s R%d, R%d, R%d\n",
-        //        get_instruction_name(opcode), r_i_type->rs, r_i_type->rt, r_i_type->rd);
-        // printf("DEBUG: Opcode: %4x, Rs: %4x, Rt: %4x, Rd: %4x\n", opcode, r_i_type->rs, r_i_type->rt, r_i_type->rd);
+        snprintf(decodedInst, DECODE_STR_LEN, "%s R%d, R%d, R%d", get_instruction_name(opcode), rd, rt, rs);
     }
     else // I-type instruction
     {
@@ -77,95 +57,103 @@ char *get_decode_str(instruction raw)
         rt = (instr >> 16) & 0x1F; // Extract Rt (5 bits)
         imm = instr & 0xFFFF;      // Extract Imm (16 bits)
 
-        // Sign-extend the immediate value
-        if (imm & 0x8000)
-            imm |= 0xFFFF0000;
-
-        sprintf(decodedInst, "%s R%d, R%d, %d", get_instruction_name(opcode), rt, rs, imm);
-        // Debug output
-        // printf("DEBUG: Decoded I-type Instruction: %s R%d, R%d, %d\n",
-        //        get_instruction_name(opcode), r_i_type->rs, r_i_type->rt, r_i_type->imm);
-        // printf("DEBUG: Opcode: %4x, Rs: %4x, Rt: %4x, Imm: %4x\n", opcode, r_i_type->rs, r_i_type->rt, r_i_type->imm);
+        snprintf(decodedInst, DECODE_STR_LEN, "%s R%d, R%d, %d", get_instruction_name(opcode), rt, rs, imm);
     }
     return decodedInst;
 }
 
-int file_read(const char *filename)
+// Loads a hex text image, an assembly source (.s, see MIPSAsm.h), or a binary
+// image (see MIPSImage.h) which is mapped into memory and may set its own
+// entry PC. Returns the number of words that the simulators may execute from
+// address 0.
+int file_read(Simulator *sim, const char *filename)
 {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL)
+    size_t size;
+    char *data = map_file(filename, &size);
+    if (data == NULL)
     {
-        printf("The file could not be opened.\n");
-        exit(EXIT_FAILURE);
+        fprintf(sim->out, "The file could not be opened.\n");
+        sim_fail(sim, SIM_ERR_LOAD);
     }
 
-    char line[1024];
-    int index = 0;
-
-    while (fgets(line, sizeof(line), file) != NULL && index < MEMORY_SIZE)
+    int index;
+    // Binary images start with IMAGE_MAGIC, which is not valid hex text
+    bool binary = size >= 4 && memcmp(data, IMAGE_MAGIC, 4) == 0;
+    if (binary)
     {
-        uint32_t word = (uint32_t)strtoul(line, NULL, 16);
-        memory[index++] = word;
+        index = image_load(&sim->memory, data, size, &sim->PC, sim->out);
+        if (index < 0)
+            unmap_file(data, size);
+        if (index == -1)
+            sim_fail(sim, SIM_ERR_LOAD);
+    }
+    else if (asm_is_source(filename))
+    {
+        index = asm_load(&sim->memory, data, size, filename, sim->out);
+        unmap_file(data, size);
+        if (index == -1)
+            sim_fail(sim, SIM_ERR_LOAD);
+    }
+    else
+    {
+        index = hex_image_load(&sim->memory, data, size);
+        unmap_file(data, size);
+    }
+    if (index == MEM_ERR_NOMEM)
+    {
+        fprintf(sim->out, "Error: Could not allocate a memory page.\n");
+        sim_fail(sim, SIM_ERR_NOMEM);
     }
-
-    fclose(file);
 
     if (index == 0)
     {
-        printf("Error: The file is empty. No instructions read.\n");
-        exit(EXIT_FAILURE);
+        fprintf(sim->out, "Error: The file is empty. No instructions read.\n");
+        sim_fail(sim, SIM_ERR_LOAD);
     }
 
-    printf("File Content Loaded. Number of instructions read: %d.\n", index);
+    TRACE(TRACE_SUMMARY, "%s. Number of instructions read: %d.\n", binary ? "Binary Image Loaded" : "File Content Loaded", index);
     return index;
 }
 
-void print_contents(int start, int end)
+void print_contents(Simulator *sim, int start, int end)
 {
-    printf("\n--- Loaded Memory Contents ---\n");
-    for (int i = start; i <= end && i < MEMORY_SIZE; i++)
+    fprintf(sim->out, "\n--- Loaded Memory Contents ---\n");
+    for (int i = start; i <= end && i < sim->memory.size / 4; i++)
     {
-        printf("0x%04X : 0x%08X : ", i * 4, memory[i]);
+        uint32_t word = mem_read(&sim->memory, i * 4);
+        fprintf(sim->out, "0x%04X : 0x%08X : ", i * 4, word);
         for (int b = 31; b >= 0; b--)
         {
-            printf("%d", (memory[i] >> b) & 1);
+            fprintf(sim->out, "%d", (word >> b) & 1);
             if (b % 4 == 0)
-                printf(" ");
+                fprintf(sim->out, " ");
         }
-        printf("\n");
+        fprintf(sim->out, "\n");
     }
-    printf("\n");
+    fprintf(sim->out, "\n");
 }
 
 // Fetch Stage: Fetches the instruction from memory
-instruction fetch()
+instruction fetch(Simulator *sim)
 {
     instruction fetched_instr;
-    fetched_instr.instruction = memory[PC / 4];
-    PC += 4; // Increment PC to point to the next instruction
+    fetched_instr.instruction = mem_read(&sim->memory, sim->PC);
+    sim->PC += 4; // Increment PC to point to the next instruction
     return fetched_instr;
 }
 
-// Decode Stage: Decodes the fetched instruction into R_type or I_type
-void decode(instruction fetched_instr, R_I_type *r_i_type)
+// Extracts the opcode/register/immediate fields of a raw instruction word
+void decode_fields(uint32_t instr, R_I_type *r_i_type)
 {
-    uint32_t instr = fetched_instr.instruction;
     uint8_t opcode = (instr >> 26) & 0x3F; // Extract opcode (6 bits)
 
-    // Define R-type opcodes explicitly
-    if (opcode == 0x00 || opcode == 0x02 || opcode == 0x04 || opcode == 0x06 ||
-        opcode == 0x08 || opcode == 0x0A) // R-type instruction opcodes
+    if (asm_opcodes[opcode].format == ASM_R) // R-type instruction opcodes
     {
         r_i_type->opcode = opcode;
         r_i_type->rs = (instr >> 21) & 0x1F; // Extract Rs (5 bits)
         r_i_type->rt = (instr >> 16) & 0x1F; // Extract Rt (5 bits)
         r_i_type->rd = (instr >> 11) & 0x1F; // Extract Rd (5 bits)
         r_i_type->R_or_I_type = true;        // true for R-Type
-
-        // Debug output
-        printf("DEBUG: Decoded R-type Instruction: %s R%d, R%d, R%d\n",
-               get_instruction_name(opcode), r_i_type->rd, r_i_type->rt, r_i_type->rs);
-        printf("DEBUG: Opcode: %4x, Rd: %4x, Rt: %4x, Rs: %4x\n", opcode, r_i_type->rd, r_i_type->rt, r_i_type->rs);
     }
     else // I-type instruction
     {
@@ -178,55 +166,383 @@ void decode(instruction fetched_instr, R_I_type *r_i_type)
         // Sign-extend the immediate value
         if (r_i_type->imm & 0x8000)
             r_i_type->imm |= 0xFFFF0000;
+    }
+}
+
+void print_decoded(Simulator *sim, R_I_type *r_i_type)
+{
+    if (!TRACE_ENABLED(TRACE_CYCLE))
+        return;
+
+    // Debug output
+    if (r_i_type->R_or_I_type)
+    {
+        fprintf(sim->out, "DEBUG: Decoded R-type Instruction: %s R%d, R%d, R%d\n",
+               get_instruction_name(r_i_type->opcode), r_i_type->rd, r_i_type->rt, r_i_type->rs);
+        fprintf(sim->out, "DEBUG: Opcode: %4x, Rd: %4x, Rt: %4x, Rs: %4x\n", r_i_type->opcode, r_i_type->rd, r_i_type->rt, r_i_type->rs);
+    }
+    else
+    {
+        fprintf(sim->out, "DEBUG: Decoded I-type Instruction: %s R%d, R%d, %d\n",
+               get_instruction_name(r_i_type->opcode), r_i_type->rt, r_i_type->rs, r_i_type->imm);
+        fprintf(sim->out, "DEBUG: Opcode: %4x, Rt: %4x, Rs: %4x, Imm: %4x\n", r_i_type->opcode, r_i_type->rt, r_i_type->rs, r_i_type->imm);
+    }
+}
+
+// Decode Stage: Decodes the fetched instruction into R_type or I_type
+void decode(Simulator *sim, instruction fetched_instr, R_I_type *r_i_type)
+{
+    decode_fields(fetched_instr.instruction, r_i_type);
+
+    // check if we have HALT
+    if (r_i_type->opcode == 0x11)
+    {
+        sim->halt_seen = true;
+    }
+
+    print_decoded(sim, r_i_type);
+}
+
+uint8_t get_handler(uint8_t opcode)
+{
+    if (opcode <= 0x0B)
+        return HANDLER_ALU;
+    switch (opcode)
+    {
+    case 0x0C: // LDW
+        return HANDLER_LOAD;
+    case 0x0D: // STW
+        return HANDLER_STORE;
+    case 0x0E: // BZ
+    case 0x0F: // BEQ
+        return HANDLER_BRANCH;
+    case 0x10: // JR
+        return HANDLER_JUMP;
+    case 0x11: // HALT
+        return HANDLER_HALT;
+    default:
+        return HANDLER_INVALID;
+    }
+}
+
+// Timing class of an opcode in the pipeline model, see SimPipelineConfig
+uint8_t get_opclass(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case 0x04: // MUL
+    case 0x05: // MULI
+        return SIM_OP_MUL;
+    case 0x0C: // LDW
+        return SIM_OP_LOAD;
+    case 0x0D: // STW
+        return SIM_OP_STORE;
+    case 0x0E: // BZ
+    case 0x0F: // BEQ
+    case 0x10: // JR
+        return SIM_OP_BRANCH;
+    default:
+        return SIM_OP_ALU;
+    }
+}
+
+// Names of the SimPredictor values, as taken by -pipe bp=
+static const char *predictor_names[SIM_NUM_PREDICTORS] = {"none", "static", "bimodal", "gshare"};
 
-        // check if we have HALT
-        if (opcode == 0x11)
+void predecode_word(Simulator *sim, int index)
+{
+    DecodedInstr *entry = &sim->decoded_text[index];
+    decode_fields(mem_read(&sim->memory, index * 4), &entry->r_i_type);
+    entry->handler = get_handler(entry->r_i_type.opcode);
+}
+
+// Decodes every loaded word once, so the functional simulator does not
+// re-extract the same fields each time a loop body executes
+void predecode_image(Simulator *sim, int words_read)
+{
+    free(sim->decoded_text);
+    sim->decoded_text = calloc(words_read + 1, sizeof(DecodedInstr));
+    if (sim->decoded_text == NULL)
+    {
+        fprintf(sim->out, "Error: Could not allocate the pre-decoded instruction table.\n");
+        sim_fail(sim, SIM_ERR_NOMEM);
+    }
+    sim->decoded_words = words_read;
+    for (int i = 0; i < words_read; i++)
+    {
+        predecode_word(sim, i);
+    }
+    // Falling off the end of the image stops the fast simulator without a
+    // bounds check on every sequential fetch
+    sim->decoded_text[words_read].r_i_type.opcode = OPCODE_END;
+    sim->decoded_text[words_read].handler = HANDLER_INVALID;
+}
+
+void count_instruction(uint8_t opcode, InstrCounts *counts)
+{
+    if (opcode <= 0x05) // ADD..MULI
+        counts->arithmetic++;
+    else if (opcode <= 0x0B) // OR..XORI
+        counts->logical++;
+    else if (opcode <= 0x0D) // LDW, STW
+        counts->memory++;
+    else if (opcode <= 0x11) // BZ, BEQ, JR, HALT
+        counts->control++;
+    else
+        return;
+    counts->total++;
+}
+
+// Drops every translated block; called when a store rewrites the image
+void flush_block_cache(Simulator *sim)
+{
+    if (sim->block_index == NULL)
+        return;
+    for (int i = 0; i < sim->decoded_words; i++)
+        sim->block_index[i] = -1;
+    sim->num_block_ops = 0;
+}
+
+void init_block_cache(Simulator *sim, int words_read)
+{
+    free(sim->block_index);
+    sim->block_index = malloc(words_read * sizeof(int32_t));
+    if (sim->block_index == NULL)
+    {
+        fprintf(sim->out, "Error: Could not allocate the block translation cache.\n");
+        sim_fail(sim, SIM_ERR_NOMEM);
+    }
+    flush_block_cache(sim);
+}
+
+// Self-modifying store into the loaded image: refresh the stale
+// pre-decoded entry and any translation built from it
+void invalidate_text_word(Simulator *sim, int index)
+{
+    predecode_word(sim, index);
+    flush_block_cache(sim);
+}
+
+uint8_t get_superinstruction(uint8_t first, uint8_t second)
+{
+    if (first == 0x0C && second == 0x00) // LDW + ADD
+        return UOP_LDW_ADD;
+    if (first == 0x01 && second == 0x0E) // ADDI + BZ
+        return UOP_ADDI_BZ;
+    if (first == 0x03 && second == 0x0E) // SUBI + BZ
+        return UOP_SUBI_BZ;
+    return 0;
+}
+
+BlockOp *new_block_op(Simulator *sim)
+{
+    if (sim->num_block_ops == sim->block_ops_cap)
+    {
+        sim->block_ops_cap = sim->block_ops_cap ? sim->block_ops_cap * 2 : 256;
+        sim->block_ops = realloc(sim->block_ops, sim->block_ops_cap * sizeof(BlockOp));
+        if (sim->block_ops == NULL)
+        {
+            fprintf(sim->out, "Error: Could not grow the block translation cache.\n");
+            sim_fail(sim, SIM_ERR_NOMEM);
+        }
+    }
+    return &sim->block_ops[sim->num_block_ops++];
+}
+
+// Translates the basic block starting at word 'start' and returns the index
+// of its first op. Blocks end at a control transfer, HALT, an unknown opcode,
+// the end of the image or after BLOCK_MAX_INSTRS instructions. Adjacent
+// pairs with a superinstruction are fused into one op.
+int translate_block(Simulator *sim, int start, int words_read)
+{
+    int first_op = sim->num_block_ops;
+    InstrCounts counts = {0};
+    BlockOp *op;
+
+    int i = start;
+    for (;;)
+    {
+        R_I_type *first = &sim->decoded_text[i].r_i_type;
+        op = new_block_op(sim);
+        op->op = first->opcode;
+        op->pc_off = (i - start) * 4;
+        op->a = *first;
+        if (first->opcode == OPCODE_END)
+            break;
+        count_instruction(first->opcode, &counts);
+        if (sim->decoded_text[i].handler >= HANDLER_BRANCH)
+            break;
+
+        uint8_t uop = i + 1 < words_read ? get_superinstruction(first->opcode, sim->decoded_text[i + 1].r_i_type.opcode) : 0;
+        if (uop)
+        {
+            op->op = uop;
+            op->pc_off += 4;
+            op->b = sim->decoded_text[i + 1].r_i_type;
+            count_instruction(op->b.opcode, &counts);
+            i += 2;
+            if (sim->decoded_text[i - 1].handler >= HANDLER_BRANCH)
+                break;
+        }
+        else
+        {
+            i++;
+        }
+
+        if (i - start >= BLOCK_MAX_INSTRS)
         {
-            halt_seen = true;
+            op = new_block_op(sim);
+            op->op = UOP_NEXT_BLOCK;
+            op->pc_off = (i - start) * 4;
+            break;
         }
+    }
+    op->counts = counts;
+    op->succ[0] = op->succ[1] = -1;
+
+    sim->block_index[start] = first_op;
+    return first_op;
+}
+
+// Counts the instructions of a partially executed block, from its first op
+// up to and including 'last'
+InstrCounts count_block_prefix(Simulator *sim, int first_op, BlockOp *last)
+{
+    InstrCounts counts = {0};
+    for (BlockOp *op = &sim->block_ops[first_op]; op <= last; op++)
+    {
+        count_instruction(op->a.opcode, &counts);
+        if (op->op >= UOP_LDW_ADD && op->op <= UOP_SUBI_BZ)
+            count_instruction(op->b.opcode, &counts);
+    }
+    return counts;
+}
+
+// Whole-program cycles and stalls at the CPI measured in the pipeline model:
+// over the samples of sim_run_sampled() if there are any, else over every
+// instruction that was not fast-forwarded. 'cpi_error' is the relative
+// half-width of the 95% confidence interval of the per-sample CPI.
+void sample_estimates(Simulator *sim, double *cycles, double *stalls, double *cpi_error)
+{
+    int64_t instructions = sim->total_instructions - sim->ff_instructions;
+    int64_t measured_cycles = sim->total_cycles;
+    int64_t measured_stalls = sim->total_stalls;
+    if (sim->num_samples > 0)
+    {
+        instructions = sim->sampled_instructions;
+        measured_cycles = sim->sampled_cycles;
+        measured_stalls = sim->sampled_stalls;
+    }
+    double scale = instructions > 0 ? (double)sim->total_instructions / instructions : 0;
+    *cycles = measured_cycles * scale;
+    *stalls = measured_stalls * scale;
 
-        // Debug output
-        printf("DEBUG: Decoded I-type Instruction: %s R%d, R%d, %d\n",
-               get_instruction_name(opcode), r_i_type->rt, r_i_type->rs, r_i_type->imm);
-        printf("DEBUG: Opcode: %4x, Rt: %4x, Rs: %4x, Imm: %4x\n", opcode, r_i_type->rt, r_i_type->rs, r_i_type->imm);
+    *cpi_error = 0;
+    int n = sim->num_samples;
+    if (n >= 2 && sim->sample_cpi_sum > 0)
+    {
+        double mean = sim->sample_cpi_sum / n;
+        double variance = (sim->sample_cpi_sq_sum - n * mean * mean) / (n - 1);
+        *cpi_error = variance > 0 ? 1.96 * sqrt(variance / n) / mean : 0;
     }
 }
 
-void halt_summary()
+// Cache lines of halt_summary(), nothing for a disabled cache
+void print_cache_summary(Simulator *sim, const char *name, Cache *c)
+{
+    if (c->num_sets == 0)
+        return;
+    fprintf(sim->out, "- %s: %u bytes, %d-way, %d-byte lines, %s", name, cache_lines(c) << c->line_bits, c->ways,
+            1 << c->line_bits, c->policy == SIM_CACHE_LRU ? "LRU" : "PLRU");
+    if (c->writes > 0)
+        fprintf(sim->out, ", %s", c->write_back ? "write-back" : "write-through");
+    fprintf(sim->out, "\n");
+    int64_t accesses = c->reads + c->writes;
+    fprintf(sim->out, "  |- Accesses: %lld (%lld reads, %lld writes), Hits: %lld (%.1f%%), Misses: %lld\n", (long long)accesses,
+            (long long)c->reads, (long long)c->writes, (long long)c->hits, accesses > 0 ? 100.0 * c->hits / accesses : 0,
+            (long long)c->misses);
+    fprintf(sim->out, "  |- Evictions: %lld, Write-backs: %lld, Stall Cycles: %lld\n", (long long)c->evictions,
+            (long long)c->writebacks, (long long)c->stall_cycles);
+}
+
+void halt_summary(Simulator *sim)
 {
-    printf("\n--- Simulation Summary ---\n");
-    printf("- Program Counter (PC): %d\n", PC);
-    if (mode == 1 || mode == 2)
+    fprintf(sim->out, "\n--- Simulation Summary ---\n");
+    fprintf(sim->out, "- Program Counter (PC): %d\n", sim->PC);
+    if (sim->mode == 1 || sim->mode == 2)
     {
-        printf("- Total Clock Cycles: %d\n", total_cycles);
-        printf("- Total Stalls: %d\n", total_stalls);
+        fprintf(sim->out, "- Total Clock Cycles: %lld\n", (long long)sim->total_cycles);
+        fprintf(sim->out, "- Total Stalls: %lld\n", (long long)sim->total_stalls);
+        if (sim->pipe.predictor != SIM_BP_NONE)
+        {
+            BranchPredictor *bp = &sim->predictor;
+            fprintf(sim->out, "- Branch Predictor: %s", predictor_names[sim->pipe.predictor]);
+            if (sim->pipe.predictor != SIM_BP_STATIC)
+                fprintf(sim->out, ", %d counters", 1 << sim->pipe.predictor_bits);
+            if (sim->pipe.predictor == SIM_BP_GSHARE)
+                fprintf(sim->out, ", %d history bits", sim->pipe.history_bits);
+            fprintf(sim->out, ", %d-entry BTB\n", 1 << sim->pipe.btb_bits);
+            fprintf(sim->out, "- Predicted Branches: %lld, Mispredicted: %lld (%.1f%% accuracy)\n", (long long)bp->branches,
+                    (long long)bp->mispredictions,
+                    bp->branches > 0 ? 100.0 * (bp->branches - bp->mispredictions) / bp->branches : 0);
+            fprintf(sim->out, "- Misprediction Penalty: %lld cycles\n", (long long)bp->penalty_cycles);
+        }
+        print_cache_summary(sim, "L1 I-Cache", &sim->icache);
+        print_cache_summary(sim, "L1 D-Cache", &sim->dcache);
+        if (sim->ff_instructions > 0 || sim->num_samples > 0)
+        {
+            double cycles, stalls, cpi_error;
+            sample_estimates(sim, &cycles, &stalls, &cpi_error);
+            fprintf(sim->out, "- Fast-forwarded Instructions: %lld\n", (long long)sim->ff_instructions);
+            if (sim->num_samples > 0)
+                fprintf(sim->out, "- Measured Instructions: %lld in %d samples\n", (long long)sim->sampled_instructions, sim->num_samples);
+            fprintf(sim->out, "- Estimated CPI: %.3f", sim->total_instructions > 0 ? cycles / sim->total_instructions : 0);
+            if (cpi_error > 0)
+                fprintf(sim->out, " (+/- %.1f%%, 95%% confidence)", cpi_error * 100);
+            fprintf(sim->out, "\n");
+            fprintf(sim->out, "- Estimated Total Clock Cycles: %.0f\n", cycles);
+            fprintf(sim->out, "- Estimated Total Stalls: %.0f\n", stalls);
+        }
     }
-    printf("- Total Instructions Executed: %d\n", total_instructions);
-    printf("  |- Arithmetic Instructions: %d\n", arithmetic_count);
-    printf("  |- Logical Instructions: %d\n", logical_count);
-    printf("  |- Memory Access Instructions: %d\n", memory_count);
-    printf("  |- Control Transfer Instructions: %d\n", control_count);
+    fprintf(sim->out, "- Total Instructions Executed: %lld\n", (long long)sim->total_instructions);
+    fprintf(sim->out, "  |- Arithmetic Instructions: %lld\n", (long long)sim->arithmetic_count);
+    fprintf(sim->out, "  |- Logical Instructions: %lld\n", (long long)sim->logical_count);
+    fprintf(sim->out, "  |- Memory Access Instructions: %lld\n", (long long)sim->memory_count);
+    fprintf(sim->out, "  |- Control Transfer Instructions: %lld\n", (long long)sim->control_count);
 
-    printf("\nFinal Register States (Modified only):\n");
+    fprintf(sim->out, "\nFinal Register States (Modified only):\n");
     for (int i = 0; i < 32; i += 4)
     {
         for (int j = i; j < i + 4; j++)
         {
-            if (modified_registers[j])
+            if (sim->modified_registers[j])
             {
-                printf("R%-2d: %5d\t", j, registers[j]);
+                fprintf(sim->out, "R%-2d: %5d\t", j, sim->registers[j]);
             }
         }
-        if (modified_registers[i] || modified_registers[i + 1] || modified_registers[i + 2] || modified_registers[i + 3])
-            printf("\n");
+        if (sim->modified_registers[i] || sim->modified_registers[i + 1] || sim->modified_registers[i + 2] || sim->modified_registers[i + 3])
+            fprintf(sim->out, "\n");
     }
 
-    printf("\nFinal Memory States (Modified only):\n");
-    for (int i = 0; i < MEMORY_SIZE / 4; i++)
+    fprintf(sim->out, "\nFinal Memory States (Modified only):\n");
+    // Walk the allocated pages in address order
+    for (uint32_t i = 0; i < MEM_L1_ENTRIES; i++)
     {
-        if (modified_memory[i])
+        if (sim->memory.l1[i] == NULL)
+            continue;
+        for (uint32_t j = 0; j < MEM_L2_ENTRIES; j++)
         {
-            printf("Memory[%d]: %d\n", i * 4, memory[i]);
+            MemPage *page = sim->memory.l1[i][j];
+            if (page == NULL)
+                continue;
+            uint32_t page_addr = ((i << MEM_L2_BITS) | j) << MEM_PAGE_BITS;
+            for (uint32_t w = 0; w < MEM_PAGE_WORDS; w++)
+            {
+                if (mem_page_modified(page, w))
+                {
+                    fprintf(sim->out, "Memory[%d]: %d\n", page_addr + w * 4, page->words[w]);
+                }
+            }
         }
     }
 
@@ -234,59 +550,57 @@ void halt_summary()
 }
 
 // Execute Stage: Executes the decoded R or I-type instruction
-int32_t execute_r_i_type(R_I_type *r_i_type, int32_t ALU_frwd, int32_t MEM_frwd)
+int32_t execute_r_i_type(Simulator *sim, R_I_type *r_i_type, int32_t ALU_frwd, int32_t MEM_frwd)
 {
     int32_t ALU_result = 0;
-    total_instructions++; // Increment total instructions counter
+    sim->total_instructions++; // Increment total instructions counter
 
-    if (mode == 1)
+    if (sim->pipe.forwarding == 0)
     {
-        for (int i = 0; i < PIPELINE_DEPTH; i++)
+        for (int i = 0; i < sim->pipe.depth; i++)
         {
-            for (int j = 0; j < 4; j++)
-            {
-                pipeline[i].frwd_flags[j] = false;
-            }
+            sim->pipeline[i].frwd_flags = 0;
         }
     }
 
     int32_t src1 = -1;
     int32_t src2 = -1;
+    PipelineStage *ex = &sim->pipeline[sim->pipe.stage_ex];
     // printf("frwd flags: 0: %b, 1: %b, 2: %b, 3: %b\n", pipeline[2].frwd_flags[0], pipeline[2].frwd_flags[1], pipeline[2].frwd_flags[2], pipeline[2].frwd_flags[3]);
     // printf("ALU_frwd = %d\n", ALU_frwd);
     // printf("MEM_frwd = %d\n", MEM_frwd);
-    if (pipeline[2].frwd_flags[0])
+    if (ex->frwd_flags & FRWD_BIT(0))
     {
         src1 = ALU_frwd;
-        pipeline[2].frwd_flags[0] = false;
+        ex->frwd_flags &= ~FRWD_BIT(0);
         // printf("[ALU_frwd] src1: %d\n", src1);
     }
-    else if (pipeline[2].frwd_flags[2])
+    else if (ex->frwd_flags & FRWD_BIT(2))
     {
         src1 = MEM_frwd;
-        pipeline[2].frwd_flags[2] = false;
+        ex->frwd_flags &= ~FRWD_BIT(2);
         // printf("[MEM_frwd] src1: %d\n", src1);
     }
     else
     {
-        src1 = registers[r_i_type->rs];
+        src1 = sim->registers[r_i_type->rs];
         // printf("reg[R%d] src1: %d\n", r_i_type->rs, src1);
     }
-    if (pipeline[2].frwd_flags[1])
+    if (ex->frwd_flags & FRWD_BIT(1))
     {
         src2 = ALU_frwd;
-        pipeline[2].frwd_flags[1] = false;
+        ex->frwd_flags &= ~FRWD_BIT(1);
         // printf("[ALU_frwd] src2: %d\n", src2);
     }
-    else if (pipeline[2].frwd_flags[3])
+    else if (ex->frwd_flags & FRWD_BIT(3))
     {
         src2 = MEM_frwd;
-        pipeline[2].frwd_flags[3] = false;
+        ex->frwd_flags &= ~FRWD_BIT(3);
         // printf("[MEM_frwd] src2: %d\n", src2);
     }
     else
     {
-        src2 = registers[r_i_type->rt];
+        src2 = sim->registers[r_i_type->rt];
         // printf("reg[R%d] src2: %d\n", r_i_type->rt, src2);
         // printf("[reg] src2: %d\n", src2);
     }
@@ -317,8 +631,8 @@ int32_t execute_r_i_type(R_I_type *r_i_type, int32_t ALU_frwd, int32_t MEM_frwd)
             ALU_result = src1 ^ src2;
             break;
         default:
-            printf("\n[ERROR] Unknown R-type opcode: 0x%02X\n", r_i_type->opcode);
-            exit(1);
+            fprintf(sim->out, "\n[ERROR] Unknown R-type opcode: 0x%02X\n", r_i_type->opcode);
+            sim_fail(sim, SIM_ERR_OPCODE);
         }
     }
     else
@@ -347,88 +661,87 @@ int32_t execute_r_i_type(R_I_type *r_i_type, int32_t ALU_frwd, int32_t MEM_frwd)
         case 0x0C: // LDW
         {
             ALU_result = src1 + r_i_type->imm;
-            if (ALU_result < 0 || ALU_result / 4 >= MEMORY_SIZE)
+            if (ALU_result < 0 || (uint32_t)ALU_result >= sim->memory.size)
             {
-                printf("\n[ERROR] Memory access out of bounds at address 0x%08X\n", ALU_result);
-                exit(1);
+                fprintf(sim->out, "\n[ERROR] Memory access out of bounds at address 0x%08X\n", ALU_result);
+                sim_fail(sim, SIM_ERR_MEMORY);
             }
         }
         break;
         case 0x0D: // STW
         {
             ALU_result = src1 + r_i_type->imm;
-            if (ALU_result < 0 || ALU_result / 4 >= MEMORY_SIZE)
+            if (ALU_result < 0 || (uint32_t)ALU_result >= sim->memory.size)
             {
-                printf("\n[ERROR] Memory access out of bounds at address 0x%08X\n", ALU_result);
-                exit(1);
+                fprintf(sim->out, "\n[ERROR] Memory access out of bounds at address 0x%08X\n", ALU_result);
+                sim_fail(sim, SIM_ERR_MEMORY);
             }
         }
         break;
         case 0x0E: // BZ
             if (src1 == 0)
             {
-                PC -= 4;
-                branch_taken = true;
-                if (mode == 1 || mode == 2)
-                    PC -= 8;
-                PC += r_i_type->imm * 4;
+                sim->PC -= 4;
+                sim->branch_taken = true;
+                sim->PC += r_i_type->imm * 4; // The pipeline modes redirect fetch themselves
             }
             else
             {
-                branch_taken = false;
+                sim->branch_taken = false;
             }
             break;
         case 0x0F: // BEQ
             if (src1 == src2)
             {
-                PC -= 4;
-                branch_taken = true;
-                if (mode == 1 || mode == 2)
-                    PC -= 8;
-                PC += r_i_type->imm * 4;
+                sim->PC -= 4;
+                sim->branch_taken = true;
+                sim->PC += r_i_type->imm * 4; // The pipeline modes redirect fetch themselves
             }
             else
             {
-                branch_taken = false;
+                sim->branch_taken = false;
             }
             break;
         case 0x10: // JR
-            PC -= 4;
-            PC = src1; // Assuming PC is in bytes
-            branch_taken = true;
+            sim->PC -= 4;
+            sim->PC = src1; // Assuming PC is in bytes
+            sim->branch_taken = true;
             break;
         case 0x11: // HALT
-            printf("\n[INFO] HALT instruction at EXE stage. Terminating simulation.\n");
-            control_count++;
+            TRACE(TRACE_SUMMARY, "\n[INFO] HALT instruction at EXE stage. Terminating simulation.\n");
+            sim->control_count++;
             // total_cycles++;
-            if (mode == 1 || mode == 2)
-                PC -= 4;
-            halt_summary();
-            exit(EXIT_FAILURE);
+            sim->status = SIM_HALTED; // The simulator loop stops after this stage
             break;
         default:
-            printf("\n[ERROR] [EXE] Unknown I-type opcode: 0x%02X\n", r_i_type->opcode);
-            exit(1);
+            fprintf(sim->out, "\n[ERROR] [EXE] Unknown I-type opcode: 0x%02X\n", r_i_type->opcode);
+            sim_fail(sim, SIM_ERR_OPCODE);
         }
     }
     return ALU_result;
 }
 
 // MEM stage: LDW reads from memory here
-int32_t run_mem_stage(int32_t ALU_result, R_I_type *r_i_type)
+int32_t run_mem_stage(Simulator *sim, int32_t ALU_result, R_I_type *r_i_type)
 {
     int32_t fetched_mem = 0;
     switch (r_i_type->opcode)
     {
     case 0x0C: // LDW
     {
-        fetched_mem = memory[ALU_result / 4];
+        fetched_mem = mem_read(&sim->memory, ALU_result);
     }
     break;
     case 0x0D: // STW
     {
-        memory[ALU_result / 4] = registers[r_i_type->rt];
-        modified_memory[ALU_result / 4] = true; // Mark memory as modified
+        if (!mem_store(&sim->memory, ALU_result, sim->registers[r_i_type->rt])) // Also marks the word as modified
+        {
+            fprintf(sim->out, "\n[ERROR] Could not allocate the memory page at address 0x%08X\n", ALU_result);
+            sim_fail(sim, SIM_ERR_NOMEM);
+        }
+        // Self-modifying store: refresh the stale pre-decoded entry
+        if (ALU_result / 4 < sim->decoded_words)
+            invalidate_text_word(sim, ALU_result / 4);
     }
     break;
     default:
@@ -439,7 +752,7 @@ int32_t run_mem_stage(int32_t ALU_result, R_I_type *r_i_type)
 }
 
 // Write Back stage: All instructions write back the register values here
-void run_wb_stage(int32_t fetched_mem, R_I_type *r_i_type)
+void run_wb_stage(Simulator *sim, int32_t fetched_mem, R_I_type *r_i_type)
 {
 
     if (r_i_type->R_or_I_type)
@@ -450,20 +763,20 @@ void run_wb_stage(int32_t fetched_mem, R_I_type *r_i_type)
         case 0x00: // ADD
         case 0x02: // SUB
         case 0x04: // MUL
-            registers[r_i_type->rd] = fetched_mem;
-            modified_registers[r_i_type->rd] = true;
-            arithmetic_count++;
+            sim->registers[r_i_type->rd] = fetched_mem;
+            sim->modified_registers[r_i_type->rd] = true;
+            sim->arithmetic_count++;
             break;
         case 0x06: // OR
         case 0x08: // AND
         case 0x0A: // XOR
-            registers[r_i_type->rd] = fetched_mem;
-            modified_registers[r_i_type->rd] = true;
-            logical_count++;
+            sim->registers[r_i_type->rd] = fetched_mem;
+            sim->modified_registers[r_i_type->rd] = true;
+            sim->logical_count++;
             break;
         default:
-            printf("\n[ERROR] Unknown R-type opcode: 0x%02X\n", r_i_type->opcode);
-            exit(1);
+            fprintf(sim->out, "\n[ERROR] Unknown R-type opcode: 0x%02X\n", r_i_type->opcode);
+            sim_fail(sim, SIM_ERR_OPCODE);
         }
     }
     else
@@ -474,410 +787,2629 @@ void run_wb_stage(int32_t fetched_mem, R_I_type *r_i_type)
         case 0x01: // ADDI
         case 0x03: // SUBI
         case 0x05: // MULI
-            registers[r_i_type->rt] = fetched_mem;
-            modified_registers[r_i_type->rt] = true;
-            arithmetic_count++;
+            sim->registers[r_i_type->rt] = fetched_mem;
+            sim->modified_registers[r_i_type->rt] = true;
+            sim->arithmetic_count++;
             break;
         case 0x07: // ORI
         case 0x09: // ANDI
         case 0x0B: // XORI
-            registers[r_i_type->rt] = fetched_mem;
-            modified_registers[r_i_type->rt] = true;
-            logical_count++;
+            sim->registers[r_i_type->rt] = fetched_mem;
+            sim->modified_registers[r_i_type->rt] = true;
+            sim->logical_count++;
             break;
         case 0x0C: // LDW
-            registers[r_i_type->rt] = fetched_mem;
-            modified_registers[r_i_type->rt] = true;
-            memory_count++;
+            sim->registers[r_i_type->rt] = fetched_mem;
+            sim->modified_registers[r_i_type->rt] = true;
+            sim->memory_count++;
             break;
         case 0x0D: // STW
-            memory_count++;
+            sim->memory_count++;
             break;
         case 0x0E: // BZ
         case 0x0F: // BEQ
         case 0x10: // JR
-            control_count++;
+            sim->control_count++;
             break;
         default:
-            printf("\n[ERROR] [WB] Unknown I-type opcode: 0x%02X\n", r_i_type->opcode);
-            exit(1);
+            fprintf(sim->out, "\n[ERROR] [WB] Unknown I-type opcode: 0x%02X\n", r_i_type->opcode);
+            sim_fail(sim, SIM_ERR_OPCODE);
         }
     }
 }
 
-void printModRegs()
+void printModRegs(Simulator *sim)
 {
-    printf("\nModified Registers:\n");
+    fprintf(sim->out, "\nModified Registers:\n");
     for (int i = 0; i < 32; i++)
     {
-        if (modified_registers[i])
+        if (sim->modified_registers[i])
         {
-            printf("R%d = %d\n", i, registers[i]);
+            fprintf(sim->out, "R%d = %d\n", i, sim->registers[i]);
             // modified_registers[i] = false; // Reset the modified flag
         }
     }
-    printf("\n");
+    fprintf(sim->out, "\n");
 }
 
-void functional_simulator(int words_read)
+// Runs at most 'budget' instructions
+void functional_simulator(Simulator *sim, int words_read, int64_t budget)
 {
     int32_t ALU_result, mem_result = 0;
-    while (PC / 4 < words_read)
+    Profile *profile = sim->profile;
+    for (; budget > 0 && sim->PC / 4 < words_read; budget--)
     {
-        printf("\nDEBUG: Fetching instruction at PC = 0x%08X\n", PC);
-        instruction fetched_instr = fetch();
+        TRACE(TRACE_CYCLE, "\nDEBUG: Fetching instruction at PC = 0x%08X\n", sim->PC);
+        // Fetch and decode come from the table built by predecode_image()
+        DecodedInstr *entry = &sim->decoded_text[sim->PC / 4];
+        sim->PC += 4;
 
-        printf("DEBUG: Decoding instruction 0x%08X\n", fetched_instr.instruction);
-        R_I_type r_i_type = {0};
-        decode(fetched_instr, &r_i_type);
+        TRACE(TRACE_CYCLE, "DEBUG: Decoding instruction 0x%08X\n", mem_read(&sim->memory, sim->PC - 4));
+        R_I_type r_i_type = entry->r_i_type;
+        print_decoded(sim, &r_i_type);
+        if (profile != NULL)
+            profile_instruction(profile, sim->PC - 4, r_i_type.opcode);
 
-        printf("DEBUG: Executing instruction\n");
+        TRACE(TRACE_CYCLE, "DEBUG: Executing instruction\n");
         // ALU_result = execute_r_i_type(&r_i_type);
-        ALU_result = execute_r_i_type(&r_i_type, 0, 0);
+        ALU_result = execute_r_i_type(sim, &r_i_type, 0, 0);
+        if (sim->status == SIM_HALTED)
+            return;
 
-        printf("DEBUG: MEM Stage\n");
-        mem_result = run_mem_stage(ALU_result, &r_i_type);
+        TRACE(TRACE_CYCLE, "DEBUG: MEM Stage\n");
+        if (entry->handler == HANDLER_LOAD || entry->handler == HANDLER_STORE)
+            mem_result = run_mem_stage(sim, ALU_result, &r_i_type);
+        else
+            mem_result = ALU_result;
 
-        printf("DEBUG: Write Back Stage\n");
-        run_wb_stage(mem_result, &r_i_type);
+        TRACE(TRACE_CYCLE, "DEBUG: Write Back Stage\n");
+        run_wb_stage(sim, mem_result, &r_i_type);
 
         // Print modified registers
         // printModRegs();
     }
 }
 
-uint8_t shift_pipeline(uint8_t hazardCnt)
+// Runs the pre-decoded instruction at PC without trace output. The fast
+// simulator uses it to finish a budget that ends inside a block.
+void step_instruction(Simulator *sim)
+{
+    // A copy, as a store may re-decode this very word before WB
+    DecodedInstr entry = sim->decoded_text[sim->PC / 4];
+    if (sim->profile != NULL)
+        profile_instruction(sim->profile, sim->PC, entry.r_i_type.opcode);
+    sim->PC += 4;
+    int32_t ALU_result = execute_r_i_type(sim, &entry.r_i_type, 0, 0);
+    if (sim->status == SIM_HALTED)
+        return;
+    if (entry.handler == HANDLER_LOAD || entry.handler == HANDLER_STORE)
+        run_wb_stage(sim, run_mem_stage(sim, ALU_result, &entry.r_i_type), &entry.r_i_type);
+    else
+        run_wb_stage(sim, ALU_result, &entry.r_i_type);
+}
+
+// Fast Functional Simulator (mode 3): runs translated basic blocks from the
+// block cache. EX, MEM and WB of each instruction are fused into one handler,
+// dispatched by computed goto on the opcode (or superinstruction) of each
+// block op, and instruction counts are added once per block instead of per
+// instruction. Produces the same results as functional_simulator() without
+// the per-stage calls or debug output. Stops early, at a block boundary, once
+// less than a block of the budget is left.
+// Cross-jumping is disabled so GCC keeps one indirect jump per handler
+// instead of merging them into a single, poorly predicted dispatch site.
+__attribute__((optimize("no-crossjumping"))) void fast_simulator(Simulator *sim, int words_read, int64_t budget)
+{
+    static void *dispatch[UOP_COUNT] = {
+        [0x00] = &&op_add,
+        [0x01] = &&op_addi,
+        [0x02] = &&op_sub,
+        [0x03] = &&op_subi,
+        [0x04] = &&op_mul,
+        [0x05] = &&op_muli,
+        [0x06] = &&op_or,
+        [0x07] = &&op_ori,
+        [0x08] = &&op_and,
+        [0x09] = &&op_andi,
+        [0x0A] = &&op_xor,
+        [0x0B] = &&op_xori,
+        [0x0C] = &&op_ldw,
+        [0x0D] = &&op_stw,
+        [0x0E] = &&op_bz,
+        [0x0F] = &&op_beq,
+        [0x10] = &&op_jr,
+        [0x11] = &&op_halt,
+        [0x12 ... OPCODE_END - 1] = &&op_invalid,
+        [OPCODE_END] = &&op_end,
+        [UOP_LDW_ADD] = &&op_ldw_add,
+        [UOP_ADDI_BZ] = &&op_addi_bz,
+        [UOP_SUBI_BZ] = &&op_subi_bz,
+        [UOP_NEXT_BLOCK] = &&op_next_block,
+    };
+
+    // Counters are kept local so they stay in registers, and flushed on exit
+    InstrCounts totals = {0};
+    BlockOp *op;
+    uint32_t base; // PC of the first instruction of the running block
+    int32_t addr;
+    int first_op;       // First op of the running block
+    int link_from = -1; // Last op whose successor slot is resolved by the next lookup
+    int link_slot = 0;
+    // A block runs at most BLOCK_MAX_INSTRS + 1 instructions (a fused pair can
+    // straddle the limit), so one is only entered below this count
+    int64_t block_limit = budget - BLOCK_MAX_INSTRS;
+
+    if (sim->block_index == NULL)
+        init_block_cache(sim, words_read);
+
+#define ADD_COUNTS(counts)                        \
+    do                                            \
+    {                                             \
+        totals.arithmetic += (counts).arithmetic; \
+        totals.logical += (counts).logical;       \
+        totals.memory += (counts).memory;         \
+        totals.control += (counts).control;       \
+        totals.total += (counts).total;           \
+    } while (0)
+#define FLUSH_COUNTS()                              \
+    do                                              \
+    {                                               \
+        sim->arithmetic_count += totals.arithmetic; \
+        sim->logical_count += totals.logical;       \
+        sim->memory_count += totals.memory;         \
+        sim->control_count += totals.control;       \
+        sim->total_instructions += totals.total;    \
+    } while (0)
+// Before an error exit: the ops of the running block ahead of the failing
+// one ran, and the failing instruction itself counts toward the total only,
+// with PC past it, as in functional_simulator(). A fused op's pc_off is that
+// of its second instruction, and only the LDW of LDW+ADD can fail.
+#define FLUSH_FAILED_COUNTS()                                            \
+    do                                                                   \
+    {                                                                    \
+        if (op > &sim->block_ops[first_op])                              \
+        {                                                                \
+            InstrCounts ran = count_block_prefix(sim, first_op, op - 1); \
+            ADD_COUNTS(ran);                                             \
+        }                                                                \
+        totals.total++;                                                  \
+        sim->PC = base + op->pc_off + (op->op == UOP_LDW_ADD ? 0 : 4);   \
+        FLUSH_COUNTS();                                                  \
+    } while (0)
+#define NEXT_OP()                  \
+    do                             \
+    {                              \
+        op++;                      \
+        goto *dispatch[op->op];    \
+    } while (0)
+#define ENTER_BLOCK(op_index)           \
+    do                                  \
+    {                                   \
+        first_op = (op_index);          \
+        op = &sim->block_ops[first_op]; \
+        base = sim->PC;                 \
+        goto *dispatch[op->op];         \
+    } while (0)
+// Leaves the block through a static edge, following the cached link to the
+// successor when it has already been resolved
+#define END_BLOCK_LINKED(target, slot)                         \
+    do                                                         \
+    {                                                          \
+        sim->PC = (target);                                    \
+        ADD_COUNTS(op->counts);                                \
+        if (op->succ[slot] >= 0 && totals.total < block_limit) \
+            ENTER_BLOCK(op->succ[slot]);                       \
+        link_from = op - sim->block_ops;                       \
+        link_slot = (slot);                                    \
+        goto next_block;                                       \
+    } while (0)
+// Taken and fall-through exits are separate paths so the successor is
+// reached through a predicted branch, not an address computed from the
+// register compare
+#define BRANCH(instr, cond)                                                  \
+    do                                                                       \
+    {                                                                        \
+        if (cond)                                                            \
+            END_BLOCK_LINKED(base + op->pc_off + (instr).imm * 4, 1);        \
+        END_BLOCK_LINKED(base + op->pc_off + 4, 0);                          \
+    } while (0)
+#define ALU_R(instr, operator)                                                                   \
+    sim->registers[(instr).rd] = sim->registers[(instr).rs] operator sim->registers[(instr).rt]; \
+    sim->modified_registers[(instr).rd] = true;
+#define ALU_I(instr, operator)                                                   \
+    sim->registers[(instr).rt] = sim->registers[(instr).rs] operator(instr).imm; \
+    sim->modified_registers[(instr).rt] = true;
+#define CHECK_ADDR(instr)                                                                     \
+    addr = sim->registers[(instr).rs] + (instr).imm;                                          \
+    if (addr < 0 || (uint32_t)addr >= sim->memory.size)                                       \
+    {                                                                                         \
+        fprintf(sim->out, "\n[ERROR] Memory access out of bounds at address 0x%08X\n", addr); \
+        FLUSH_FAILED_COUNTS();                                                                \
+        sim_fail(sim, SIM_ERR_MEMORY);                                                        \
+    }
+#define LDW(instr)                                             \
+    CHECK_ADDR(instr)                                          \
+    sim->registers[(instr).rt] = mem_read(&sim->memory, addr); \
+    sim->modified_registers[(instr).rt] = true;
+
+next_block:
+    if (sim->PC / 4 >= (uint32_t)words_read || totals.total >= block_limit)
+        goto op_exit;
+    first_op = sim->block_index[sim->PC / 4];
+    if (first_op < 0)
+        first_op = translate_block(sim, sim->PC / 4, words_read);
+    if (link_from >= 0)
+    {
+        sim->block_ops[link_from].succ[link_slot] = first_op;
+        link_from = -1;
+    }
+    ENTER_BLOCK(first_op);
+
+op_add:
+    ALU_R(op->a, +)
+    NEXT_OP();
+op_sub:
+    ALU_R(op->a, -)
+    NEXT_OP();
+op_mul:
+    ALU_R(op->a, *)
+    NEXT_OP();
+op_or:
+    ALU_R(op->a, |)
+    NEXT_OP();
+op_and:
+    ALU_R(op->a, &)
+    NEXT_OP();
+op_xor:
+    ALU_R(op->a, ^)
+    NEXT_OP();
+op_addi:
+    ALU_I(op->a, +)
+    NEXT_OP();
+op_subi:
+    ALU_I(op->a, -)
+    NEXT_OP();
+op_muli:
+    ALU_I(op->a, *)
+    NEXT_OP();
+op_ori:
+    ALU_I(op->a, |)
+    NEXT_OP();
+op_andi:
+    ALU_I(op->a, &)
+    NEXT_OP();
+op_xori:
+    ALU_I(op->a, ^)
+    NEXT_OP();
+op_ldw:
+    LDW(op->a)
+    NEXT_OP();
+op_stw:
+    CHECK_ADDR(op->a)
+    if (!mem_store(&sim->memory, addr, sim->registers[op->a.rt]))
+    {
+        fprintf(sim->out, "\n[ERROR] Could not allocate the memory page at address 0x%08X\n", addr);
+        FLUSH_FAILED_COUNTS();
+        sim_fail(sim, SIM_ERR_NOMEM);
+    }
+    if (addr / 4 < sim->decoded_words)
+    {
+        // The rest of this block may be stale: account for what ran and
+        // continue from a fresh translation
+        invalidate_text_word(sim, addr / 4);
+        InstrCounts ran = count_block_prefix(sim, first_op, op);
+        ADD_COUNTS(ran);
+        sim->PC = base + op->pc_off + 4;
+        goto next_block;
+    }
+    NEXT_OP();
+op_ldw_add:
+    LDW(op->a)
+    ALU_R(op->b, +)
+    NEXT_OP();
+op_bz:
+    BRANCH(op->a, sim->registers[op->a.rs] == 0);
+op_beq:
+    BRANCH(op->a, sim->registers[op->a.rs] == sim->registers[op->a.rt]);
+op_addi_bz:
+    ALU_I(op->a, +)
+    BRANCH(op->b, sim->registers[op->b.rs] == 0);
+op_subi_bz:
+    ALU_I(op->a, -)
+    BRANCH(op->b, sim->registers[op->b.rs] == 0);
+op_jr:
+    // Register target: no static successor to link
+    sim->PC = sim->registers[op->a.rs];
+    ADD_COUNTS(op->counts);
+    goto next_block;
+op_next_block:
+    END_BLOCK_LINKED(base + op->pc_off, 0);
+op_halt:
+    sim->PC = base + op->pc_off + 4;
+    ADD_COUNTS(op->counts);
+    TRACE(TRACE_SUMMARY, "\n[INFO] HALT instruction at EXE stage. Terminating simulation.\n");
+    sim->status = SIM_HALTED;
+    goto op_exit;
+op_invalid:
+    fprintf(sim->out, "\n[ERROR] [EXE] Unknown I-type opcode: 0x%02X\n", op->a.opcode);
+    FLUSH_FAILED_COUNTS();
+    sim_fail(sim, SIM_ERR_OPCODE);
+op_end:
+    // Fell off the end of the image
+    sim->PC = base + op->pc_off;
+    ADD_COUNTS(op->counts);
+op_exit:
+    FLUSH_COUNTS();
+
+#undef ADD_COUNTS
+#undef FLUSH_COUNTS
+#undef FLUSH_FAILED_COUNTS
+#undef NEXT_OP
+#undef ENTER_BLOCK
+#undef END_BLOCK_LINKED
+#undef BRANCH
+#undef ALU_R
+#undef ALU_I
+#undef CHECK_ADDR
+#undef LDW
+}
+
+// The scoreboard records, per register, which latches from EX on hold an
+// instruction that writes it, so the hazard checks below are a lookup per
+// source register instead of a comparison per latch. Like the comparisons it
+// replaces it follows the latch contents, stalled (stale) latches included.
+
+// Destination register of a decoded instruction, NUM_REGISTERS if it has none
+static inline uint8_t dest_register(R_I_type *r_i_type)
+{
+    if (r_i_type->opcode > 0x0C) // Only ALU ops and LDW write a register
+        return NUM_REGISTERS;
+    return r_i_type->R_or_I_type ? r_i_type->rd : r_i_type->rt;
+}
+
+// Rebuilds the scoreboard after the latches were replaced wholesale
+void scoreboard_rebuild(Simulator *sim)
+{
+    memset(sim->reg_writers, 0, sizeof(sim->reg_writers));
+    for (int stage = 0; stage < sim->pipe.depth; stage++)
+    {
+        sim->pipeline[stage].dst = dest_register(&sim->pipeline[stage].decoded);
+        if (stage >= sim->pipe.stage_ex && stage <= sim->pipe.stage_wb)
+            sim->reg_writers[sim->pipeline[stage].dst] |= STAGE_BIT(stage);
+    }
+}
+
+// The latches are a window of PIPELINE_MAX_DEPTH slots of latch_ring. When
+// every latch moves on, the window slides down one slot rather than each
+// latch being copied to the next, so a cycle copies one latch at most.
+
+// Empties the latches, placing the window at the top of latch_ring
+void pipeline_clear(Simulator *sim)
+{
+    sim->pipeline = sim->latch_ring + PIPELINE_RING - PIPELINE_MAX_DEPTH;
+    memset(sim->pipeline, 0, PIPELINE_MAX_DEPTH * sizeof(PipelineStage));
+}
+
+// Moves every latch one stage on: the latch of stage s becomes that of stage
+// s + 1, and the one left in stage 0 is stale. Once the window reaches the
+// bottom of latch_ring the latches are copied back to the top, every
+// PIPELINE_RING - PIPELINE_MAX_DEPTH cycles.
+static inline PipelineStage *pipeline_advance(Simulator *sim)
+{
+    if (sim->pipeline == sim->latch_ring)
+        sim->pipeline = memcpy(sim->latch_ring + PIPELINE_RING - PIPELINE_MAX_DEPTH, sim->latch_ring,
+                               sim->pipe.depth * sizeof(PipelineStage));
+    return --sim->pipeline;
+}
+
+// Cycles the instruction entering a multi-cycle stage waits before the stage
+// works on it, looked up in 'extra' (PipelineModel.extra_ex or extra_mem)
+static inline uint8_t stage_hold(PipelineStage *latch, const uint8_t *extra)
 {
-    // Shift WB, MEM, EX stages normally
-    pipeline[4] = pipeline[3];
-    pipeline[3] = pipeline[2];
+    if (!latch->valid || latch->isStall)
+        return 0;
+    return extra[latch->decoded.opcode & 0x3F];
+}
+
+uint8_t shift_pipeline(Simulator *sim, uint8_t hazardCnt)
+{
+    PipelineStage *pipeline = sim->pipeline;
+    int ex = sim->pipe.stage_ex;
+    int mem = sim->pipe.stage_mem;
+    int wb = sim->pipe.stage_wb;
+
+    if (sim->ex_hold | sim->mem_hold)
+    {
+        // A multi-cycle EX or MEM holds up the whole pipeline, so the stall
+        // counts and forwarding set up in ID stay valid
+        if (sim->profile != NULL)
+        {
+            // Charged to MEM, the older instruction, when both hold
+            if (sim->mem_hold > 0)
+                sim->profile->mem_stalls++;
+            else
+                sim->profile->ex_stalls++;
+            profile_stall(sim->profile, pipeline[sim->mem_hold > 0 ? mem : ex].pc, 1);
+        }
+        if (sim->ex_hold > 0)
+            sim->ex_hold--;
+        if (sim->mem_hold > 0)
+            sim->mem_hold--;
+        for (int stage = 0; stage <= sim->pipe.stage_id; stage++)
+            pipeline[stage].isStall = true;
+        sim->total_stalls++;
+        return hazardCnt;
+    }
+
+    // Scoreboard: WB retires, MEM and EX move on; EX is added back below
+    sim->reg_writers[pipeline[wb].dst] ^= STAGE_BIT(wb);
+    sim->reg_writers[pipeline[mem].dst] ^= STAGE_BIT(mem) | STAGE_BIT(wb);
+    sim->reg_writers[pipeline[ex].dst] ^= STAGE_BIT(ex) | STAGE_BIT(mem);
+    sim->stages_done = 0;
 
     if (hazardCnt > 0)
     {
+        // Shift WB, MEM stages only
+        pipeline[wb] = pipeline[mem];
+        pipeline[mem] = pipeline[ex];
         // Insert NOP into EX
-        pipeline[2].isStall = true;
-        pipeline[1].isStall = true;
-        pipeline[0].isStall = true;
+        for (int stage = 0; stage <= ex; stage++)
+            pipeline[stage].isStall = true;
         // total_stalls++;
         hazardCnt--;
         // ID and IF stages remain
     }
-    else if (branch_taken)
+    else if (sim->branch_taken)
     {
-        pipeline[2].isStall = true;
-        pipeline[1].isStall = true;
+        pipeline[wb] = pipeline[mem];
+        pipeline[mem] = pipeline[ex];
+        for (int stage = 1; stage <= ex; stage++)
+            pipeline[stage].isStall = true;
         pipeline[0].isStall = false;
-        branch_taken = false;
-        branch_delay = true;
+        sim->branch_taken = false;
+        sim->branch_delay = sim->pipe.stage_id; // Squashed in ID and the IF stages after the first
+        if (sim->profile != NULL)
+        {
+            sim->profile->branch_bubbles += ex;
+            profile_stall(sim->profile, pipeline[mem].pc, ex);
+        }
         // total_stalls++;
     }
     else
     {
-        pipeline[2] = pipeline[1];
-        pipeline[1] = pipeline[0];
-        if (branch_delay)
-        {
-            pipeline[1].isStall = false;
-            pipeline[2].isStall = true;
-            // total_stalls++;
-            branch_delay = false;
-        }
-        else
+        // Shift every stage
+        pipeline = pipeline_advance(sim);
+        for (int stage = ex; stage > 0; stage--)
+            pipeline[stage].isStall = false;
+        pipeline[0] = pipeline[1]; // IF keeps its latch until it fetches over it
+        if (sim->branch_delay > 0)
         {
-            pipeline[2].isStall = false;
-            pipeline[1].isStall = false;
+            // The squashed instructions go through EX as bubbles
+            for (int stage = ex; stage > ex - sim->branch_delay; stage--)
+                pipeline[stage].isStall = true;
+            sim->branch_delay--;
         }
 
         // pipeline[2].isStall = false;
         // pipeline[1].isStall = false;
         pipeline[0].isStall = false;
+        sim->ex_hold = stage_hold(&pipeline[ex], sim->pipe.extra_ex);
     }
+    sim->mem_hold = stage_hold(&pipeline[mem], sim->pipe.extra_mem);
+
+    // EX holds a new instruction, or keeps its (stalled) one
+    sim->reg_writers[pipeline[ex].dst] |= STAGE_BIT(ex);
     return hazardCnt;
 }
 
-uint8_t has_RAW_hazard(R_I_type *curr, R_I_type *ex, R_I_type *mem)
+// Stall cycles needed before 'curr' can read its sources from the register
+// file: until the nearest producer in EX or MEM has written back
+uint8_t has_RAW_hazard(Simulator *sim, R_I_type *curr)
 {
-    uint8_t hazardCnt = 0;
     uint8_t src1 = curr->rs;
     uint8_t src2 = (curr->opcode == 0x0F || curr->R_or_I_type) ? curr->rt : 0; // Rt only used in BEQ or R-type
 
-    if (halt_seen)
+    if (sim->halt_seen)
     {
-        printf("DEBUG: HALT instruction encountered, terminating the simulation after draining the pipeline!\n");
+        TRACE(TRACE_CYCLE, "DEBUG: HALT instruction encountered, terminating the simulation after draining the pipeline!\n");
         // total_stalls++;
         return 2;
     }
-    if (mem && (mem->opcode <= 0x0B || mem->opcode == 0x0C))
-    {
-        uint8_t mem_dst = mem->R_or_I_type ? mem->rd : mem->rt;
-        if ((src1 && src1 == mem_dst) || (src2 && src2 == mem_dst))
-        {
-            hazardCnt = 1;
-            // total_stalls++;
-        }
-    }
-    if (ex && (ex->opcode <= 0x0B || ex->opcode == 0x0C))
-    {
-        uint8_t ex_dst = ex->R_or_I_type ? ex->rd : ex->rt;
-        if ((src1 && src1 == ex_dst) || (src2 && src2 == ex_dst))
-        {
-            hazardCnt = 2;
-            // total_stalls++;
-        }
-    }
 
-    return hazardCnt;
+    // R0 is never waited for
+    uint16_t producers = (src1 ? sim->reg_writers[src1] : 0) | (src2 ? sim->reg_writers[src2] : 0);
+    producers &= STAGE_BIT(sim->pipe.stage_ex) | STAGE_BIT(sim->pipe.stage_mem);
+    if (producers == 0)
+        return 0;
+    return sim->pipe.stage_wb - __builtin_ctz(producers);
 }
 
-uint8_t has_RAW_hazard_forwarding(R_I_type *curr, R_I_type *ex, R_I_type *mem)
+// With forwarding, only a load in EX stalls (for 1 cycle); otherwise the
+// nearest producer is forwarded, EX before MEM and src1 before src2. A value
+// whose forwarding path is disabled is waited for as without forwarding,
+// except that an ALU result in EX can take the MEM/WB path a cycle later.
+uint8_t has_RAW_hazard_forwarding(Simulator *sim, R_I_type *curr)
 {
     uint8_t src1 = curr->rs;
     uint8_t src2 = (curr->opcode == 0x0F || curr->R_or_I_type) ? curr->rt : 0; // Rt only used in BEQ or R-type
 
-    // printf("src1 = %d\n", src1);
-    // printf("src2 = %d\n", src2);
-    // printf("ex->rt = %d\n", ex->rt);
-    // printf("ex->rd = %d\n", ex->rd);
-    // printf("mem->rt = %d\n", mem->rt);
-    // printf("mem->rd = %d\n", mem->rd);
-
-    if (halt_seen)
+    if (sim->halt_seen)
     {
-        printf("DEBUG: HALT instruction encountered, terminating the simulation after draining the pipeline!\n");
+        TRACE(TRACE_CYCLE, "DEBUG: HALT instruction encountered, terminating the simulation after draining the pipeline!\n");
         // printf("DEBUG: returning HazardCnt = 2\n");
         return 2;
     }
 
-    if (ex && (ex->opcode == 0x0C))
+    const uint16_t ex = STAGE_BIT(sim->pipe.stage_ex);
+    const uint16_t mem = STAGE_BIT(sim->pipe.stage_mem);
+    bool fwd_ex = sim->pipe.forwarding & SIM_FWD_EX;
+    bool fwd_mem = sim->pipe.forwarding & SIM_FWD_MEM;
+    PipelineStage *id = &sim->pipeline[sim->pipe.stage_id];
+    if (sim->pipeline[sim->pipe.stage_ex].decoded.opcode == 0x0C) // LDW
     {
-        if ((src1 == ex->rt))
+        if (!fwd_mem)
+            return has_RAW_hazard(sim, curr);
+        // The loaded value is forwarded from MEM after a 1 cycle stall
+        if (sim->reg_writers[src1] & ex)
         {
-            // printf("src1(%d) == ex->rt(%d)\n", src1, ex->rt);
-            pipeline[1].frwd_flags[2] = true;
-            // When LDW, we stall for 1 cycle first
-            // printf("DEBUG: returning HazardCnt = 1\n");
+            id->frwd_flags |= FRWD_BIT(2);
             return 1;
         }
-        if ((src2 == ex->rt))
+        if (sim->reg_writers[src2] & ex)
         {
-            // printf("src2(%d) == ex->rt(%d)\n", src2, ex->rt);
-            pipeline[1].frwd_flags[3] = true;
-            // When LDW, we stall for 1 cycle first
-            // printf("DEBUG: returning HazardCnt = 1\n");
+            id->frwd_flags |= FRWD_BIT(3);
             return 1;
         }
         return 0;
     }
-    if (ex && (ex->opcode <= 0x0B))
+    uint16_t writers1 = src1 ? sim->reg_writers[src1] : 0;
+    uint16_t writers2 = src2 ? sim->reg_writers[src2] : 0;
+    if ((writers1 | writers2) & ex)
     {
-        uint8_t ex_dst = ex->R_or_I_type ? ex->rd : ex->rt;
-        if ((src1 && src1 == ex_dst))
+        int src = (writers1 & ex) ? 0 : 1;
+        if (fwd_ex)
         {
-            pipeline[1].frwd_flags[0] = true;
-            // printf("DEBUG: returning HazardCnt = 0\n");
-            return 0;
-        }
-        if ((src2 && src2 == ex_dst))
-        {
-            pipeline[1].frwd_flags[1] = true;
-            // printf("DEBUG: returning HazardCnt = 0\n");
+            id->frwd_flags |= FRWD_BIT(src); // 0: src1, 1: src2 from EX
             return 0;
         }
+        if (!fwd_mem)
+            return has_RAW_hazard(sim, curr);
+        id->frwd_flags |= FRWD_BIT(src + 2);
+        return 1;
     }
-    if (mem && (mem->opcode <= 0x0B || mem->opcode == 0x0C))
+    if ((writers1 | writers2) & mem)
     {
-        uint8_t mem_dst = mem->R_or_I_type ? mem->rd : mem->rt;
-        if ((src1 && src1 == mem_dst))
-        {
-            pipeline[1].frwd_flags[2] = true;
-            // printf("DEBUG: returning HazardCnt = 0\n");
-            return 0;
-        }
-        if ((src2 && src2 == mem_dst))
-        {
-            pipeline[1].frwd_flags[3] = true;
-            // printf("DEBUG: returning HazardCnt = 0\n");
-            return 0;
-        }
+        if (!fwd_mem)
+            return has_RAW_hazard(sim, curr);
+        id->frwd_flags |= FRWD_BIT((writers1 & mem) ? 2 : 3); // 2: src1, 3: src2 from MEM
     }
     return 0;
 }
 
-void print_pipeline()
+// Writes the name of 'stage' to 'name': IF (IF1, IF2, ... with several IF
+// stages), ID, EX, MEM or WB
+void get_stage_name(Simulator *sim, int stage, char name[16])
 {
-    printf("DEBUG: Pipeline contents -\n");
-    if (pipeline[0].valid)
-    {
-        if (!pipeline[0].isStall)
-            printf("IF: %s\n", pipeline[0].raw_str);
-        else
-            printf("IF: Stall\n");
-    }
-    if (pipeline[1].valid)
+    if (stage < sim->pipe.stage_id)
     {
-        if (!pipeline[1].isStall)
-            printf("ID: %s\n", pipeline[1].raw_str);
+        if (sim->pipe.stage_id == 1)
+            strcpy(name, "IF");
         else
-            printf("ID: Stall\n");
+            snprintf(name, 16, "IF%d", stage + 1);
+        return;
     }
-    if (pipeline[2].valid)
+    static const char *names[] = {"ID", "EX", "MEM", "WB"};
+    strcpy(name, names[stage - sim->pipe.stage_id]);
+}
+
+void print_pipeline(Simulator *sim)
+{
+    fprintf(sim->out, "DEBUG: Pipeline contents -\n");
+    for (int stage = 0; stage < sim->pipe.depth; stage++)
     {
-        if (!pipeline[2].isStall)
-            printf("EX: %s\n", pipeline[2].raw_str);
+        if (!sim->pipeline[stage].valid)
+            continue;
+        char name[16];
+        get_stage_name(sim, stage, name);
+        if (!sim->pipeline[stage].isStall)
+            fprintf(sim->out, "%s: %s\n", name, get_decode_str(sim->pipeline[stage].raw));
         else
-            printf("EX: Stall\n");
+            fprintf(sim->out, "%s: Stall\n", name);
     }
-    if (pipeline[3].valid)
+    fprintf(sim->out, "\n");
+}
+
+void print_struct(Simulator *sim, PipelineStage pipe)
+{
+    fprintf(sim->out, "pipeline.raw: %s\n", get_decode_str(pipe.raw));
+    fprintf(sim->out, "pipeline.decoded: Opcode: %4x, Rd: %4x, Rt: %4x, Rs: %4x\n", pipe.decoded.opcode, pipe.decoded.rd, pipe.decoded.rt, pipe.decoded.rs);
+    fprintf(sim->out, "pipeline.alu_result: %d\n", pipe.alu_result);
+    fprintf(sim->out, "pipeline.mem_result: %d\n", pipe.mem_result);
+    fprintf(sim->out, "pipeline.valid: %b\n", pipe.valid);
+    fprintf(sim->out, "pipeline.isStall: %b\n", pipe.isStall);
+}
+
+// MEM of the instruction in the MEM latch. A D-cache miss holds it there,
+// and the pipeline behind it, for the cycles the miss takes.
+static inline void pipeline_mem_stage(Simulator *sim, PipelineStage *mem)
+{
+    TRACE(TRACE_CYCLE, "DEBUG: MEM Stage\n");
+    mem->mem_result = run_mem_stage(sim, mem->alu_result, &mem->decoded);
+    sim->stages_done |= DONE_MEM;
+    if (sim->dcache.num_sets > 0 && (mem->decoded.opcode == 0x0C || mem->decoded.opcode == 0x0D)) // LDW, STW
     {
-        if (!pipeline[3].isStall)
-            printf("MEM: %s\n", pipeline[3].raw_str);
-        else
-            printf("MEM: Stall\n");
+        sim->mem_hold = cache_access(&sim->dcache, mem->alu_result, mem->decoded.opcode == 0x0D);
+        if (sim->mem_hold > 0)
+            TRACE(TRACE_CYCLE, "DEBUG: D-cache miss at 0x%08X, %d cycles\n", mem->alu_result, sim->mem_hold);
     }
-    if (pipeline[4].valid)
+}
+
+// Dumps the latches and the registers that differ when co-simulation fails
+void cosim_dump(Simulator *sim)
+{
+    fprintf(sim->out, "Pipeline latches (cycle %lld):\n", (long long)sim->total_cycles);
+    for (int stage = sim->pipe.depth - 1; stage >= 0; stage--)
     {
-        if (!pipeline[4].isStall)
-            printf("WB: %s\n", pipeline[4].raw_str);
+        PipelineStage *latch = &sim->pipeline[stage];
+        char name[16];
+        get_stage_name(sim, stage, name);
+        if (!latch->valid)
+            fprintf(sim->out, "  %-4s empty\n", name);
+        else if (latch->isStall)
+            fprintf(sim->out, "  %-4s Stall\n", name);
         else
-            printf("WB: Stall\n");
+            fprintf(sim->out, "  %-4s #%u 0x%08X %-20s alu_result %d mem_result %d frwd %d%d%d%d\n", name, latch->seq, latch->pc,
+                    get_decode_str(latch->raw), latch->alu_result, latch->mem_result, latch->frwd_flags & 1,
+                    latch->frwd_flags >> 1 & 1, latch->frwd_flags >> 2 & 1, latch->frwd_flags >> 3 & 1);
     }
-    printf("\n");
+    fprintf(sim->out, "Registers (pipeline / functional):\n");
+    for (int reg = 0; reg < NUM_REGISTERS; reg++)
+        if (sim->registers[reg] != sim->shadow->registers[reg])
+            fprintf(sim->out, "  R%-2d %d / %d\n", reg, sim->registers[reg], sim->shadow->registers[reg]);
 }
 
-void print_struct(PipelineStage pipe)
+// Runs the instruction that just retired from 'wb' on the shadow functional
+// simulator, and fails the run unless both models wrote the same value
+void cosim_retire(Simulator *sim, PipelineStage *wb)
 {
-    printf("pipeline.raw_str: %s\n", pipe.raw_str);
-    printf("pipeline.decoded: Opcode: %4x, Rd: %4x, Rt: %4x, Rs: %4x\n", pipe.decoded.opcode, pipe.decoded.rd, pipe.decoded.rt, pipe.decoded.rs);
-    printf("pipeline.alu_result: %d\n", pipe.alu_result);
-    printf("pipeline.mem_result: %d\n", pipe.mem_result);
-    printf("pipeline.valid: %b\n", pipe.valid);
-    printf("pipeline.isStall: %b\n", pipe.isStall);
+    Simulator *shadow = sim->shadow;
+    R_I_type *d = &wb->decoded;
+    char mismatch[96] = "";
+    if (shadow->PC != wb->pc)
+        snprintf(mismatch, sizeof(mismatch), "functional model is at PC 0x%08X", shadow->PC);
+    else if (wb->pc / 4 >= (uint32_t)shadow->words_read)
+    {
+        // Fetched past the image, which only the pipeline does; follow it
+        shadow->PC += 4;
+        if (wb->dst < NUM_REGISTERS)
+            shadow->registers[wb->dst] = sim->registers[wb->dst];
+    }
+    else
+    {
+        jmp_buf exit_jmp;
+        shadow->exit_jmp = &exit_jmp;
+        if (shadow->decoded_text == NULL)
+            predecode_image(shadow, shadow->words_read);
+        if (setjmp(exit_jmp) == 0)
+            step_instruction(shadow);
+        if (shadow->status != SIM_OK)
+            snprintf(mismatch, sizeof(mismatch), "functional model ends with %s", sim_status_name(shadow->status));
+        else if (wb->dst < NUM_REGISTERS && sim->registers[wb->dst] != shadow->registers[wb->dst])
+            snprintf(mismatch, sizeof(mismatch), "R%d = %d, functional model %d", wb->dst, sim->registers[wb->dst],
+                     shadow->registers[wb->dst]);
+        else if (d->opcode == 0x0D && mem_read(&sim->memory, wb->alu_result) != mem_read(&shadow->memory, wb->alu_result)) // STW
+            snprintf(mismatch, sizeof(mismatch), "Mem[0x%08X] = %d, functional model %d", wb->alu_result,
+                     mem_read(&sim->memory, wb->alu_result), mem_read(&shadow->memory, wb->alu_result));
+    }
+    if (mismatch[0] == '\0')
+        return;
+
+    fprintf(sim->out, "\n[ERROR] [COSIM] 0x%08X %s retired at WB: %s\n", wb->pc, get_decode_str(wb->raw), mismatch);
+    cosim_dump(sim);
+    sim_fail(sim, SIM_ERR_COSIM);
 }
 
-void pipeline_simulator(int words_read)
+// MEM and WB of the instructions in the MEM and WB latches. A store in MEM
+// goes after WB, so it stores the value written back this cycle. Each stage
+// works once per latch, on the last cycle of a multi-cycle MEM.
+void run_mem_wb_stages(Simulator *sim)
 {
-    memset(pipeline, 0, sizeof(pipeline));
-    uint8_t hazardCnt = 0;
-    int32_t ALU_result, mem_result = 0;
-    while (PC / 4 < words_read)
+    PipelineStage *mem = &sim->pipeline[sim->pipe.stage_mem];
+    PipelineStage *wb = &sim->pipeline[sim->pipe.stage_wb];
+    if (mem->decoded.opcode == 0x0D)
     {
-        printf("\nDEBUG: NEW LOOP START\n");
-
-        total_cycles++;
-        if (!pipeline[0].isStall && !halt_seen)
-        {
-            printf("\nDEBUG: Fetching instruction at PC = 0x%08X\n", PC);
-            pipeline[0].raw = fetch();
-            pipeline[0].raw_str = get_decode_str(pipeline[0].raw);
-            pipeline[0].valid = true;
-        }
-        if (pipeline[1].valid && !pipeline[1].isStall && !halt_seen)
+        if (wb->valid && !wb->isStall && !(sim->stages_done & DONE_WB))
         {
-            printf("DEBUG: Decoding instruction 0x%08X\n", pipeline[0].raw.instruction);
-            decode(pipeline[1].raw, &pipeline[1].decoded);
-            // check for hazard
-            if (mode == 1)
-                hazardCnt = has_RAW_hazard(&pipeline[1].decoded, &pipeline[2].decoded, &pipeline[3].decoded);
-            else
-                hazardCnt = has_RAW_hazard_forwarding(&pipeline[1].decoded, &pipeline[2].decoded, &pipeline[3].decoded);
-            if (!halt_seen)
-                total_stalls += hazardCnt;
+            TRACE(TRACE_CYCLE, "DEBUG: Write Back Stage\n");
+            run_wb_stage(sim, wb->mem_result, &wb->decoded);
+            sim->stages_done |= DONE_WB;
+            if (sim->shadow != NULL)
+                cosim_retire(sim, wb);
         }
 
-        if (pipeline[2].valid && !pipeline[2].isStall)
+        if (mem->valid && !mem->isStall && sim->mem_hold == 0 && !(sim->stages_done & DONE_MEM))
+            pipeline_mem_stage(sim, mem);
+    }
+    else
+    {
+
+        if (mem->valid && !mem->isStall && sim->mem_hold == 0 && !(sim->stages_done & DONE_MEM))
+            pipeline_mem_stage(sim, mem);
+
+        if (wb->valid && !wb->isStall && !(sim->stages_done & DONE_WB))
         {
-            // print_struct(pipeline[2]);
-            printf("DEBUG: Executing instruction\n");
-            pipeline[2].alu_result = execute_r_i_type(&pipeline[2].decoded, pipeline[3].alu_result, pipeline[4].mem_result);
+            TRACE(TRACE_CYCLE, "DEBUG: Write Back Stage\n");
+            run_wb_stage(sim, wb->mem_result, &wb->decoded);
+            sim->stages_done |= DONE_WB;
+            if (sim->shadow != NULL)
+                cosim_retire(sim, wb);
         }
+    }
+}
 
-        if (pipeline[3].decoded.opcode == 0x0D)
-        {
-            if (pipeline[4].valid && !pipeline[4].isStall)
-            {
-                printf("DEBUG: Write Back Stage\n");
-                run_wb_stage(pipeline[4].mem_result, &pipeline[4].decoded);
-            }
+// Counter of the branch at 'pc' in the bimodal or gshare table
+static inline uint8_t *predictor_counter(Simulator *sim, uint32_t pc)
+{
+    uint32_t index = pc >> 2;
+    if (sim->pipe.predictor == SIM_BP_GSHARE)
+        index ^= sim->predictor.history;
+    return &sim->predictor.counters[index & ((1u << sim->pipe.predictor_bits) - 1)];
+}
 
-            if (pipeline[3].valid && !pipeline[3].isStall)
-            {
-                printf("DEBUG: MEM Stage\n");
-                pipeline[3].mem_result = run_mem_stage(pipeline[3].alu_result, &pipeline[3].decoded);
-            }
-        }
+static inline uint32_t btb_index(Simulator *sim, uint32_t pc)
+{
+    return (pc >> 2) & ((1u << sim->pipe.btb_bits) - 1);
+}
+
+// Empty BTB, counters weakly not taken, no history and no statistics
+void predictor_reset(Simulator *sim)
+{
+    BranchPredictor *bp = &sim->predictor;
+    memset(bp->counters, 1, sizeof(bp->counters));
+    memset(bp->btb_pc, 0xFF, sizeof(bp->btb_pc));
+    memset(bp->btb_target, 0, sizeof(bp->btb_target));
+    bp->history = 0;
+    bp->branches = 0;
+    bp->mispredictions = 0;
+    bp->penalty_cycles = 0;
+}
+
+// IF: where fetch goes after the word 'raw' fetched from 'pc'. BZ and BEQ
+// targets come from the word itself, JR targets from the BTB; a target
+// outside the loaded text is never predicted.
+uint32_t predict_next_pc(Simulator *sim, uint32_t pc, uint32_t raw, int words_read)
+{
+    uint8_t opcode = (raw >> 26) & 0x3F;
+    uint32_t target;
+    bool taken;
+    if (opcode == 0x10) // JR
+    {
+        uint32_t index = btb_index(sim, pc);
+        taken = sim->predictor.btb_pc[index] == pc;
+        target = sim->predictor.btb_target[index];
+    }
+    else if (opcode == 0x0E || opcode == 0x0F) // BZ, BEQ
+    {
+        int16_t imm = raw & 0xFFFF;
+        target = pc + imm * 4;
+        if (sim->pipe.predictor == SIM_BP_STATIC)
+            taken = imm <= 0;
         else
+            taken = *predictor_counter(sim, pc) >= 2;
+    }
+    else
+        return pc + 4;
+    return taken && target / 4 < (uint32_t)words_read ? target : pc + 4;
+}
+
+// EX: trains the predictor with the branch or jump just executed, which went
+// to sim->next_pc, and checks the prediction it was fetched with. When right,
+// fetch carries on from 'fetch_pc'; when wrong, it is sent to the real target
+// and the younger instructions are squashed as for a taken branch without a
+// predictor.
+void resolve_branch(Simulator *sim, PipelineStage *ex, uint32_t fetch_pc)
+{
+    BranchPredictor *bp = &sim->predictor;
+    if (ex->decoded.opcode == 0x10) // JR
+    {
+        uint32_t index = btb_index(sim, ex->pc);
+        bp->btb_pc[index] = ex->pc;
+        bp->btb_target[index] = sim->next_pc;
+    }
+    else if (sim->pipe.predictor != SIM_BP_STATIC)
+    {
+        bool taken = sim->branch_taken;
+        uint8_t *counter = predictor_counter(sim, ex->pc);
+        if (taken && *counter < 3)
+            (*counter)++;
+        else if (!taken && *counter > 0)
+            (*counter)--;
+        bp->history = ((bp->history << 1) | taken) & ((1u << sim->pipe.history_bits) - 1);
+    }
+
+    bp->branches++;
+    if (sim->next_pc == ex->predicted_pc)
+    {
+        sim->PC = fetch_pc;
+        sim->branch_taken = false;
+        return;
+    }
+    TRACE(TRACE_CYCLE, "DEBUG: Branch mispredicted, fetching from 0x%08X\n", sim->next_pc);
+    bp->mispredictions++;
+    bp->penalty_cycles += sim->pipe.stage_ex; // Bubbles until the target reaches EX
+    sim->PC = sim->next_pc;
+    sim->branch_taken = true;
+    sim->halt_seen = false; // A HALT in ID is on the squashed path
+}
+
+// IF with an I-cache: looks PC up unless its line is on the way, and returns
+// true, leaving a bubble in IF, while a miss is being served
+bool icache_fetch_bubble(Simulator *sim)
+{
+    if (sim->fetch_hold == 0)
+    {
+        uint32_t cycles = cache_access(&sim->icache, sim->PC, false);
+        if (cycles == 0)
+            return false;
+        TRACE(TRACE_CYCLE, "\nDEBUG: I-cache miss at PC = 0x%08X, %d cycles\n", sim->PC, cycles);
+        sim->fetch_hold = cycles + 1;
+    }
+    if (--sim->fetch_hold == 0)
+        return false; // The line has arrived
+    sim->pipeline[0].valid = false;
+    sim->pipeline[0].dst = NUM_REGISTERS;
+    sim->total_stalls++; // Like the D-cache misses held in MEM
+    return true;
+}
+
+// Fetches stop the run once PC passes 'words_read' words. The IF stages past
+// the first fetch further ahead of EX, so they move the limit along with them.
+static inline uint32_t pipeline_fetch_limit(Simulator *sim, int words_read)
+{
+    return words_read + sim->pipe.stage_id - 1;
+}
+
+// Event-driven cycle skipping. Cycles in which no stage can work only count
+// down the hold counters, so they are added up in one step, to the next
+// cycle in which something happens: a multi-cycle EX or MEM completing with
+// fetch and ID held, or an I-cache miss ending with the pipeline drained.
+// Stalls and profiling counts are credited as the skipped cycles would have.
+// Not used while cycles are traced, as each would be printed.
+void pipeline_skip_idle(Simulator *sim, uint8_t hazardCnt)
+{
+    PipelineStage *pipeline = sim->pipeline;
+    PipelineStage *id = &pipeline[sim->pipe.stage_id];
+    PipelineStage *ex = &pipeline[sim->pipe.stage_ex];
+    PipelineStage *mem = &pipeline[sim->pipe.stage_mem];
+    PipelineStage *wb = &pipeline[sim->pipe.stage_wb];
+    if (wb->valid && !wb->isStall && !(sim->stages_done & DONE_WB))
+        return;
+
+    if (sim->ex_hold | sim->mem_hold)
+    {
+        if (!sim->halt_seen && (!pipeline[0].isStall || (id->valid && !id->isStall)))
+            return;
+        // shift_pipeline() holds the pipeline while either counter runs; EX
+        // and MEM work once theirs reaches 0, if they have something left
+        uint32_t skip = sim->ex_hold > sim->mem_hold ? sim->ex_hold : sim->mem_hold;
+        if (ex->valid && !ex->isStall && !(sim->stages_done & DONE_EX) && sim->ex_hold < skip)
+            skip = sim->ex_hold;
+        if (mem->valid && !mem->isStall && !(sim->stages_done & DONE_MEM) && sim->mem_hold < skip)
+            skip = sim->mem_hold;
+        if (skip == 0)
+            return;
+
+        uint32_t mem_cycles = sim->mem_hold < skip ? sim->mem_hold : skip;
+        if (sim->profile != NULL)
         {
+            sim->profile->mem_stalls += mem_cycles;
+            sim->profile->ex_stalls += skip - mem_cycles;
+            profile_stall(sim->profile, mem->pc, mem_cycles);
+            profile_stall(sim->profile, ex->pc, skip - mem_cycles);
+        }
+        sim->ex_hold -= sim->ex_hold < skip ? sim->ex_hold : skip;
+        sim->mem_hold -= mem_cycles;
+        for (int stage = 0; stage <= sim->pipe.stage_id; stage++)
+            pipeline[stage].isStall = true;
+        sim->total_cycles += skip;
+        sim->total_stalls += skip;
+    }
+    else if (sim->fetch_hold > 1 && hazardCnt == 0 && sim->branch_delay == 0 && !sim->branch_taken && !sim->halt_seen)
+    {
+        for (int stage = 0; stage < sim->pipe.depth; stage++)
+            if (pipeline[stage].valid || pipeline[stage].isStall)
+                return;
+        // Only bubbles move until the line arrives; after 'depth' of them
+        // every latch holds the same one
+        uint32_t skip = sim->fetch_hold - 1;
+        for (uint32_t cycle = 0; cycle < skip && cycle < sim->pipe.depth; cycle++)
+            shift_pipeline(sim, 0);
+        sim->fetch_hold -= skip;
+        sim->total_cycles += skip;
+        sim->total_stalls += skip;
+    }
+}
 
-            if (pipeline[3].valid && !pipeline[3].isStall)
+// Runs cycles until 'budget' more instructions have reached EX. The latches
+// and pending stalls stay in the Simulator, so a later call picks up where
+// this one stopped.
+void pipeline_simulator(Simulator *sim, int words_read, int64_t budget)
+{
+    uint8_t hazardCnt = sim->hazard_cnt;
+    int32_t ALU_result, mem_result = 0;
+    int64_t start = sim->total_instructions;
+    uint32_t fetch_limit = pipeline_fetch_limit(sim, words_read);
+    while (sim->PC / 4 < fetch_limit && sim->total_instructions - start < budget)
+    {
+        TRACE(TRACE_CYCLE, "\nDEBUG: NEW LOOP START\n");
+
+        if ((sim->ex_hold | sim->mem_hold | sim->fetch_hold) && !TRACE_ENABLED(TRACE_CYCLE) && sim->pipe_trace == NULL)
+            pipeline_skip_idle(sim, hazardCnt);
+        sim->total_cycles++;
+        PipelineStage *id = &sim->pipeline[sim->pipe.stage_id]; // The latches move with shift_pipeline()
+        PipelineStage *ex = &sim->pipeline[sim->pipe.stage_ex];
+        if (!sim->pipeline[0].isStall && !sim->halt_seen && (sim->icache.num_sets == 0 || !icache_fetch_bubble(sim)))
+        {
+            TRACE(TRACE_CYCLE, "\nDEBUG: Fetching instruction at PC = 0x%08X\n", sim->PC);
+            sim->pipeline[0].pc = sim->PC;
+            sim->pipeline[0].raw = fetch(sim);
+            sim->pipeline[0].valid = true;
+            sim->pipeline[0].seq = ++sim->fetch_seq;
+            if (sim->pipe.predictor != SIM_BP_NONE)
+            {
+                sim->PC = predict_next_pc(sim, sim->pipeline[0].pc, sim->pipeline[0].raw.instruction, words_read);
+                sim->pipeline[0].predicted_pc = sim->PC;
+            }
+        }
+        if (id->valid && !id->isStall && !sim->halt_seen)
+        {
+            TRACE(TRACE_CYCLE, "DEBUG: Decoding instruction 0x%08X\n", sim->pipeline[0].raw.instruction);
+            decode(sim, id->raw, &id->decoded);
+            id->dst = dest_register(&id->decoded);
+            // check for hazard
+            if (sim->pipe.forwarding == 0)
+                hazardCnt = has_RAW_hazard(sim, &id->decoded);
+            else
+                hazardCnt = has_RAW_hazard_forwarding(sim, &id->decoded);
+            if (!sim->halt_seen)
             {
-                printf("DEBUG: MEM Stage\n");
-                pipeline[3].mem_result = run_mem_stage(pipeline[3].alu_result, &pipeline[3].decoded);
+                sim->total_stalls += hazardCnt;
+                if (sim->profile != NULL && hazardCnt > 0)
+                {
+                    sim->profile->raw_stalls += hazardCnt;
+                    profile_stall(sim->profile, id->pc, hazardCnt);
+                }
             }
+        }
 
-            if (pipeline[4].valid && !pipeline[4].isStall)
+        if (ex->valid && !ex->isStall && sim->ex_hold == 0 && !(sim->stages_done & DONE_EX))
+        {
+            // print_struct(pipeline[2]);
+            TRACE(TRACE_CYCLE, "DEBUG: Executing instruction\n");
+            uint32_t fetch_pc = sim->PC;
+            if (sim->profile != NULL)
             {
-                printf("DEBUG: Write Back Stage\n");
-                run_wb_stage(pipeline[4].mem_result, &pipeline[4].decoded);
+                profile_instruction(sim->profile, ex->pc, ex->decoded.opcode);
+                profile_forwarding(sim->profile, ex->frwd_flags);
             }
+            ex->alu_result = execute_r_i_type(sim, &ex->decoded, sim->pipeline[sim->pipe.stage_mem].alu_result, sim->pipeline[sim->pipe.stage_wb].mem_result);
+            if (sim->status == SIM_HALTED)
+            {
+                sim->PC = ex->pc + 4; // Fetch went on until ID saw the HALT
+                return;
+            }
+            sim->stages_done |= DONE_EX;
+
+            // Where the program carries on, should the pipeline be drained now
+            R_I_type *executed = &ex->decoded;
+            if (executed->opcode == 0x10) // JR
+                sim->next_pc = sim->PC;
+            else if ((executed->opcode == 0x0E || executed->opcode == 0x0F) && sim->branch_taken) // BZ, BEQ
+                sim->next_pc = ex->pc + executed->imm * 4;
+            else
+                sim->next_pc = ex->pc + 4;
+            if (sim->pipe.predictor != SIM_BP_NONE && get_opclass(executed->opcode) == SIM_OP_BRANCH)
+                resolve_branch(sim, ex, fetch_pc);
+            else if (sim->branch_taken)
+                sim->PC = sim->next_pc; // The younger instructions are squashed by shift_pipeline()
         }
+
+        run_mem_wb_stages(sim);
         // Print modified registers
         // printf("DEBUG: hazardCnt = %d\n", hazardCnt);
         // printModRegs();
-        print_pipeline();
+        if (TRACE_ENABLED(TRACE_CYCLE))
+            print_pipeline(sim);
+        if (sim->pipe_trace != NULL)
+            pipe_trace_cycle(sim->pipe_trace, sim, hazardCnt);
         // halt_summary();
-        hazardCnt = shift_pipeline(hazardCnt);
+        hazardCnt = shift_pipeline(sim, hazardCnt);
     }
+    sim->hazard_cnt = hazardCnt;
 }
 
-int main(int argc, char *argv[])
+// Hands the pipeline state over to the functional engine: the instructions
+// past EX finish MEM and WB, the ones still in IF, ID and EX are dropped, and
+// PC is set to the instruction after the last one executed. The pipeline is
+// left empty, to be refilled from there.
+void drain_pipeline(Simulator *sim)
 {
-    if (argc != 3) // Check if the filename is provided as an argument
+    PipelineStage *mem = &sim->pipeline[sim->pipe.stage_mem];
+    PipelineStage *wb = &sim->pipeline[sim->pipe.stage_wb];
+    for (int cycle = 0; cycle < 2 || mem->valid || (wb->valid && !wb->isStall && !(sim->stages_done & DONE_WB)); cycle++)
     {
-    EXIT_FLAG:
-        printf("Usage: %s <Filename> <Mode>\n", argv[0]);
-        printf("<Filename>: input mem filename\n");
-        printf("<Mode>: 0/1/2\n");
-        printf("\t 0 - Functional Simulator\n");
-        printf("\t 1 - Pipeline Simulator with Forwarding\n");
-        printf("\t 2 - Pipeline Simulator without Forwarding\n");
-        return 1;
+        sim->total_cycles++;
+        run_mem_wb_stages(sim);
+        if (sim->mem_hold > 0)
+        {
+            sim->mem_hold--;
+            continue;
+        }
+        *wb = *mem;
+        mem->valid = false;
+        sim->stages_done = 0;
     }
+    pipeline_clear(sim);
+    scoreboard_rebuild(sim);
+    sim->PC = sim->next_pc;
+    sim->halt_seen = false;
+    sim->branch_taken = false;
+    sim->branch_delay = 0;
+    sim->hazard_cnt = 0;
+    sim->ex_hold = 0;
+    sim->stages_done = 0;
+    sim->fetch_hold = 0;
+}
 
-    const char *filename = argv[1]; // Get the filename from the command-line argument
-    mode = atoi(argv[2]);           // Get the mode to run
+// Parses a byte count with an optional K/M/G suffix; returns 0 if malformed
+uint64_t parse_size(const char *str)
+{
+    char *end;
+    uint64_t value = strtoull(str, &end, 0);
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        value <<= 10;
+        /* fall through */
+    case 'M':
+    case 'm':
+        value <<= 10;
+        /* fall through */
+    case 'K':
+    case 'k':
+        value <<= 10;
+        end++;
+        break;
+    }
+    return *end == '\0' ? value : 0;
+}
+
+// Applies one dcache or icache setting of a -pipe spec, 'option' being the
+// rest of the key: "" (size), _ways, _line, _miss, _policy=lru|plru or
+// _write=back|through. Returns false if malformed.
+bool parse_cache_setting(const char *option, size_t option_len, const char *value, size_t value_len, SimCacheConfig *cache)
+{
+    char text[32];
+    if (value_len == 0 || value_len >= sizeof(text))
+        return false;
+    memcpy(text, value, value_len);
+    text[value_len] = '\0';
+    char *end;
+    long number = strtol(text, &end, 10);
+    bool is_number = *end == '\0';
+
+    if (option_len == 0)
+    {
+        uint64_t size = parse_size(text);
+        if (size == 0 && strcmp(text, "0") != 0)
+            return false;
+        cache->size = size <= INT32_MAX ? (int)size : -1;
+    }
+    else if (option_len == 5 && strncmp(option, "_ways", 5) == 0 && is_number)
+        cache->ways = (int)number;
+    else if (option_len == 5 && strncmp(option, "_line", 5) == 0 && is_number)
+        cache->line_size = (int)number;
+    else if (option_len == 5 && strncmp(option, "_miss", 5) == 0 && is_number)
+        cache->miss_latency = (int)number;
+    else if (option_len == 7 && strncmp(option, "_policy", 7) == 0 && (!strcmp(text, "lru") || !strcmp(text, "plru")))
+        cache->policy = strcmp(text, "lru") == 0 ? SIM_CACHE_LRU : SIM_CACHE_PLRU;
+    else if (option_len == 6 && strncmp(option, "_write", 6) == 0 && (!strcmp(text, "back") || !strcmp(text, "through")))
+        cache->write_back = strcmp(text, "back") == 0;
+    else
+        return false;
+    return true;
+}
+
+// Parses a -pipe spec, comma-separated "key=value" settings applied to
+// 'config': if, alu, mul, load, store, branch, fwd=none|ex|mem|all,
+// bp=none|static|bimodal|gshare, bp_bits, history, btb_bits, and the dcache
+// and icache settings of parse_cache_setting(). Returns false if malformed.
+bool parse_pipeline_spec(const char *spec, SimPipelineConfig *config)
+{
+    static const char *classes[SIM_NUM_OP_CLASSES] = {"alu", "mul", "load", "store", "branch"};
+    static const char *paths[] = {"none", "ex", "mem", "all"}; // Indexed by SIM_FWD_* bits
+    while (*spec != '\0')
+    {
+        const char *eq = strchr(spec, '=');
+        if (eq == NULL)
+            return false;
+        size_t key_len = eq - spec;
+        const char *value = eq + 1;
+        size_t value_len = strcspn(value, ",");
+        char *end;
+        long number = strtol(value, &end, 10);
+        bool is_number = value_len > 0 && end == value + value_len;
 
-    int words_read = file_read(filename);
-    // print_contents(0, words_read - 1);
+        int *field = NULL;
+        if (key_len == 2 && strncmp(spec, "if", 2) == 0)
+            field = &config->fetch_stages;
+        else if (key_len == 7 && strncmp(spec, "bp_bits", 7) == 0)
+            field = &config->predictor_bits;
+        else if (key_len == 7 && strncmp(spec, "history", 7) == 0)
+            field = &config->history_bits;
+        else if (key_len == 8 && strncmp(spec, "btb_bits", 8) == 0)
+            field = &config->btb_bits;
+        for (int i = 0; i < SIM_NUM_OP_CLASSES; i++)
+            if (key_len == strlen(classes[i]) && strncmp(spec, classes[i], key_len) == 0)
+                field = &config->latency[i];
+        if (field != NULL)
+        {
+            if (!is_number)
+                return false;
+            *field = (int)number;
+        }
+        else if (key_len == 3 && strncmp(spec, "fwd", 3) == 0)
+        {
+            config->forwarding = -2;
+            for (int i = 0; i < 4; i++)
+                if (value_len == strlen(paths[i]) && strncmp(value, paths[i], value_len) == 0)
+                    config->forwarding = i;
+            if (config->forwarding < 0)
+                return false;
+        }
+        else if (key_len >= 6 && (strncmp(spec, "dcache", 6) == 0 || strncmp(spec, "icache", 6) == 0))
+        {
+            SimCacheConfig *cache = spec[0] == 'd' ? &config->dcache : &config->icache;
+            if (!parse_cache_setting(spec + 6, key_len - 6, value, value_len, cache))
+                return false;
+        }
+        else if (key_len == 2 && strncmp(spec, "bp", 2) == 0)
+        {
+            config->predictor = -1;
+            for (int i = 0; i < SIM_NUM_PREDICTORS; i++)
+                if (value_len == strlen(predictor_names[i]) && strncmp(value, predictor_names[i], value_len) == 0)
+                    config->predictor = i;
+            if (config->predictor < 0)
+                return false;
+        }
+        else
+            return false;
+
+        spec = value + value_len;
+        if (*spec == ',')
+            spec++;
+    }
+    return true;
+}
+
+// Library API, see MIPSLite.h
+
+Simulator *sim_create(uint8_t mode, uint32_t memory_size, FILE *out)
+{
+    Simulator *sim = calloc(1, sizeof(Simulator));
+    if (sim == NULL)
+        return NULL;
+    sim->mode = mode;
+    sim->out = out != NULL ? out : stdout;
+    mem_init(&sim->memory, memory_size);
+    sim->status = SIM_ERR_LOAD; // Nothing to run until an image is loaded
+    pipeline_clear(sim);
+    SimPipelineConfig config;
+    sim_default_pipeline(&config);
+    sim_configure_pipeline(sim, &config);
+    return sim;
+}
+
+void sim_default_pipeline(SimPipelineConfig *config)
+{
+    config->fetch_stages = 1;
+    for (int i = 0; i < SIM_NUM_OP_CLASSES; i++)
+        config->latency[i] = 1;
+    config->forwarding = -1;
+    config->predictor = SIM_BP_NONE;
+    config->predictor_bits = 12;
+    config->history_bits = 8;
+    config->btb_bits = 8;
+    SimCacheConfig cache = {0, 2, 32, SIM_CACHE_LRU, 1, 10};
+    config->dcache = cache;
+    config->icache = cache;
+}
+
+SimStatus sim_configure_pipeline(Simulator *sim, const SimPipelineConfig *config)
+{
+    if (config->fetch_stages < 1 || config->fetch_stages > PIPELINE_MAX_DEPTH - 4 ||
+        config->forwarding < -1 || config->forwarding > (SIM_FWD_EX | SIM_FWD_MEM) ||
+        config->predictor < 0 || config->predictor >= SIM_NUM_PREDICTORS ||
+        config->predictor_bits < 1 || config->predictor_bits > BP_MAX_BITS ||
+        config->history_bits < 0 || config->history_bits > config->predictor_bits ||
+        config->btb_bits < 0 || config->btb_bits > BTB_MAX_BITS ||
+        !cache_config_valid(&config->dcache) || !cache_config_valid(&config->icache))
+        return SIM_ERR_CONFIG;
+    for (int i = 0; i < SIM_NUM_OP_CLASSES; i++)
+        if (config->latency[i] < 1 || config->latency[i] > PIPELINE_MAX_LATENCY)
+            return SIM_ERR_CONFIG;
+    for (int i = 0; i < sim->pipe.depth; i++)
+        if (sim->pipeline[i].valid)
+            return SIM_ERR_CONFIG;
+    if (sim->pipe_trace != NULL)
+        return SIM_ERR_CONFIG;
+    Cache dcache = {0};
+    Cache icache = {0};
+    if (!cache_configure(&dcache, &config->dcache) || !cache_configure(&icache, &config->icache))
+    {
+        cache_free(&dcache);
+        return SIM_ERR_NOMEM;
+    }
+    cache_free(&sim->dcache);
+    cache_free(&sim->icache);
+    sim->dcache = dcache;
+    sim->icache = icache;
+
+    PipelineModel *pipe = &sim->pipe;
+    if (config->fetch_stages + 4 > pipe->depth) // Latches added to the pipeline start empty
+        memset(&sim->pipeline[pipe->depth], 0, (config->fetch_stages + 4 - pipe->depth) * sizeof(PipelineStage));
+    pipe->stage_id = config->fetch_stages;
+    pipe->stage_ex = pipe->stage_id + 1;
+    pipe->stage_mem = pipe->stage_id + 2;
+    pipe->stage_wb = pipe->stage_id + 3;
+    pipe->depth = pipe->stage_id + 4;
+    for (int i = 0; i < SIM_NUM_OP_CLASSES; i++)
+        pipe->latency[i] = config->latency[i];
+    for (int opcode = 0; opcode < 64; opcode++)
+    {
+        uint8_t opclass = get_opclass(opcode);
+        bool mem = opclass == SIM_OP_LOAD || opclass == SIM_OP_STORE;
+        pipe->extra_ex[opcode] = mem ? 0 : pipe->latency[opclass] - 1;
+        pipe->extra_mem[opcode] = mem ? pipe->latency[opclass] - 1 : 0;
+    }
+    if (config->forwarding >= 0)
+        pipe->forwarding = config->forwarding;
+    else
+        pipe->forwarding = sim->mode == 1 ? 0 : SIM_FWD_EX | SIM_FWD_MEM;
+    pipe->predictor = config->predictor;
+    pipe->predictor_bits = config->predictor_bits;
+    pipe->history_bits = config->history_bits;
+    pipe->btb_bits = config->btb_bits;
+    pipe->dcache = config->dcache;
+    pipe->icache = config->icache;
+    predictor_reset(sim);
+    scoreboard_rebuild(sim);
+    return SIM_OK;
+}
 
-    PC = 0;
+void sim_destroy(Simulator *sim)
+{
+    if (sim == NULL)
+        return;
+    if (sim->pipe_trace != NULL)
+        pipe_trace_close(sim->pipe_trace);
+    profile_free(sim->profile);
+    sim_destroy(sim->shadow);
+    mem_free(&sim->memory);
+    free(sim->checkpoint_file);
+    free(sim->decoded_text);
+    free(sim->block_index);
+    free(sim->block_ops);
+    cache_free(&sim->dcache);
+    cache_free(&sim->icache);
+    free(sim);
+}
+
+// Drops the decoded and translated forms of the image; they are rebuilt by
+// the next sim_run()
+void discard_decoded_text(Simulator *sim)
+{
+    free(sim->decoded_text);
+    free(sim->block_index);
+    sim->decoded_text = NULL;
+    sim->block_index = NULL;
+    sim->decoded_words = 0;
+    sim->num_block_ops = 0;
+}
+
+// Puts the shadow of sim_set_cosim() in the state of 'sim', at the oldest
+// instruction in the pipeline that has not retired yet. Returns false if the
+// shadow's memory cannot be allocated.
+bool cosim_sync(Simulator *sim)
+{
+    Simulator *shadow = sim->shadow;
+    discard_decoded_text(shadow);
+    if (!mem_copy(&shadow->memory, &sim->memory))
+        return false;
+    memcpy(shadow->registers, sim->registers, sizeof(sim->registers));
+    shadow->words_read = sim->words_read;
+    shadow->PC = sim->PC;
+    for (int stage = 0; stage < sim->pipe.depth; stage++)
+    {
+        PipelineStage *latch = &sim->pipeline[stage];
+        if (latch->valid && !latch->isStall && !(stage == sim->pipe.stage_wb && (sim->stages_done & DONE_WB)))
+            shadow->PC = latch->pc;
+    }
+    shadow->status = SIM_OK;
+    return true;
+}
+
+// Everything but memory back to the state right after loading
+void reset_state(Simulator *sim)
+{
+    sim->PC = sim->entry_pc;
+    sim->halt_seen = false;
+    sim->branch_taken = false;
+    sim->branch_delay = 0;
+    sim->hazard_cnt = 0;
+    sim->ex_hold = 0;
+    sim->mem_hold = 0;
+    sim->stages_done = 0;
+    sim->fetch_hold = 0;
+    sim->next_pc = sim->entry_pc;
+    sim->fetch_seq = 0;
+    sim->total_instructions = 0;
+    sim->arithmetic_count = 0;
+    sim->logical_count = 0;
+    sim->memory_count = 0;
+    sim->control_count = 0;
+    sim->total_stalls = 0;
+    sim->total_cycles = 0;
+    sim->ff_instructions = 0;
+    sim->num_samples = 0;
+    sim->sampled_instructions = 0;
+    sim->sampled_cycles = 0;
+    sim->sampled_stalls = 0;
+    sim->sample_cpi_sum = 0;
+    sim->sample_cpi_sq_sum = 0;
     for (int i = 0; i < 32; i++)
     {
-        registers[i] = 0;
-        modified_registers[i] = false; // Initialize modified registers
+        sim->registers[i] = 0;
+        sim->modified_registers[i] = false; // Initialize modified registers
     }
+    pipeline_clear(sim);
+    scoreboard_rebuild(sim);
+    predictor_reset(sim);
+    cache_reset(&sim->dcache);
+    cache_reset(&sim->icache);
+    if (sim->profile != NULL)
+        profile_reset(sim->profile);
+    sim->status = SIM_OK;
+    if (sim->shadow != NULL && !cosim_sync(sim))
+        sim->status = SIM_ERR_NOMEM;
+}
+
+SimStatus sim_load_image(Simulator *sim, const char *filename)
+{
+    if (is_checkpoint_file(filename))
+        return sim_restore_checkpoint(sim, filename);
 
-    switch (mode)
+    jmp_buf exit_jmp;
+    sim->exit_jmp = &exit_jmp;
+    if (setjmp(exit_jmp) != 0)
+        return sim->status;
+
+    discard_decoded_text(sim);
+    mem_free(&sim->memory);
+    free(sim->checkpoint_file);
+    sim->checkpoint_file = NULL;
+    sim->words_read = 0;
+    sim->PC = 0; // Binary images may set their own entry PC
+    sim->words_read = file_read(sim, filename);
+    // print_contents(sim, 0, sim->words_read - 1);
+    sim->entry_pc = sim->PC;
+    mem_snapshot(&sim->memory);
+    reset_state(sim);
+    return sim->status;
+}
+
+SimStatus sim_load_words(Simulator *sim, const uint32_t *words, uint32_t num_words)
+{
+    discard_decoded_text(sim);
+    mem_free(&sim->memory);
+    free(sim->checkpoint_file);
+    sim->checkpoint_file = NULL;
+    sim->words_read = 0;
+    if (num_words == 0 || num_words > sim->memory.size / 4)
+        return sim->status = SIM_ERR_LOAD;
+    for (uint32_t i = 0; i < num_words; i++)
+        if (!mem_write(&sim->memory, i * 4, words[i]))
+            return sim->status = SIM_ERR_NOMEM;
+    sim->words_read = num_words;
+    sim->entry_pc = 0;
+    mem_snapshot(&sim->memory);
+    reset_state(sim);
+    return sim->status;
+}
+
+SimStatus sim_reset(Simulator *sim)
+{
+    if (sim->words_read == 0)
+        return SIM_ERR_LOAD;
+    if (sim->checkpoint_file != NULL)
+    {
+        char *filename = sim->checkpoint_file;
+        sim->checkpoint_file = NULL;
+        SimStatus status = sim_restore_checkpoint(sim, filename);
+        free(filename);
+        return status;
+    }
+    // Stores may have rewritten the image, so decode it again as well
+    discard_decoded_text(sim);
+    mem_restore(&sim->memory);
+    reset_state(sim);
+    return sim->status;
+}
+
+// Runs at most 'budget' instructions on the fast simulator, finishing a
+// budget that ends inside a block one instruction at a time. While profiling
+// every instruction runs one at a time, as blocks are not counted per
+// instruction.
+void run_fast(Simulator *sim, int words_read, int64_t budget)
+{
+    int64_t start = sim->total_instructions;
+    if (sim->profile == NULL)
+    {
+        // fast_simulator() counts in int, so a long run goes in chunks. One
+        // that stops more than a block short of its budget reached the end.
+        int64_t chunk, ran;
+        do
+        {
+            int64_t left = budget - (sim->total_instructions - start);
+            chunk = left < FAST_MAX_CHUNK ? left : FAST_MAX_CHUNK;
+            ran = sim->total_instructions;
+            fast_simulator(sim, words_read, chunk);
+            ran = sim->total_instructions - ran;
+        } while (sim->status == SIM_OK && chunk == FAST_MAX_CHUNK && ran > FAST_MAX_CHUNK - 2 * BLOCK_MAX_INSTRS);
+    }
+    while (sim->status == SIM_OK && sim->PC / 4 < (uint32_t)words_read && sim->total_instructions - start < budget)
+        step_instruction(sim);
+}
+
+SimStatus sim_run(Simulator *sim, uint64_t max_instructions)
+{
+    if (sim->status != SIM_OK)
+        return sim->status;
+    if (sim->mode > 3)
+        return sim->status = SIM_ERR_MODE;
+
+    jmp_buf exit_jmp;
+    sim->exit_jmp = &exit_jmp;
+    if (setjmp(exit_jmp) != 0)
+        return sim->status;
+
+    int64_t budget = max_instructions == 0 || max_instructions > INT64_MAX ? INT64_MAX : (int64_t)max_instructions;
+    int words_read = sim->words_read;
+    if ((sim->mode == 0 || sim->mode == 3) && sim->decoded_text == NULL)
+        predecode_image(sim, words_read);
+    uint64_t host_start = 0;
+    int64_t instructions = sim->total_instructions;
+    int64_t cycles = sim->total_cycles;
+    if (sim->profile != NULL)
+    {
+        if (!profile_resize(sim->profile, words_read))
+            return sim->status = SIM_ERR_NOMEM;
+        host_start = profile_clock_ns();
+    }
+
+    switch (sim->mode)
     {
     case 0:
         // Functional Simulator
-        functional_simulator(words_read);
+        functional_simulator(sim, words_read, budget);
         break;
     case 1:
         // Pipeline Sumulator without Forwarding
-        // Same function is called, but "mode" us a global variable, and below function internally handles different calls
-        pipeline_simulator(words_read);
+        // Same function is called, but "mode" is part of the simulator, and below function internally handles different calls
+        pipeline_simulator(sim, words_read, budget);
         break;
     case 2:
         // Pipeline Sumulator with Forwarding
-        // Same function is called, but "mode" us a global variable, and below function internally handles different calls
-        pipeline_simulator(words_read);
+        // Same function is called, but "mode" is part of the simulator, and below function internally handles different calls
+        pipeline_simulator(sim, words_read, budget);
         break;
+    case 3:
+        // Fast Functional Simulator: same results as mode 0, no per-stage calls or trace
+        run_fast(sim, words_read, budget);
+        break;
+    }
+    if (sim->profile != NULL)
+        profile_host_run(sim->profile, host_start, sim->total_instructions - instructions, sim->total_cycles - cycles);
+
+    uint32_t end = sim->mode == 1 || sim->mode == 2 ? pipeline_fetch_limit(sim, words_read) : (uint32_t)words_read;
+    if (sim->status == SIM_OK && sim->PC / 4 >= end)
+        sim->status = SIM_END_OF_IMAGE;
+    return sim->status;
+}
+
+SimStatus sim_fast_forward(Simulator *sim, uint64_t max_instructions)
+{
+    if (sim->status != SIM_OK)
+        return sim->status;
+    if (sim->mode > 3)
+        return sim->status = SIM_ERR_MODE;
+
+    uint8_t mode = sim->mode;
+    jmp_buf exit_jmp;
+    sim->exit_jmp = &exit_jmp;
+    if (setjmp(exit_jmp) != 0)
+    {
+        sim->mode = mode;
+        return sim->status;
+    }
+
+    for (int i = 0; i < sim->pipe.depth; i++)
+    {
+        if (sim->pipeline[i].valid)
+        {
+            drain_pipeline(sim);
+            break;
+        }
+    }
+
+    int64_t budget = max_instructions == 0 || max_instructions > INT64_MAX ? INT64_MAX : (int64_t)max_instructions;
+    int words_read = sim->words_read;
+    if (sim->decoded_text == NULL)
+        predecode_image(sim, words_read);
+
+    int64_t start = sim->total_instructions;
+    uint64_t host_start = 0;
+    if (sim->profile != NULL)
+    {
+        if (!profile_resize(sim->profile, words_read))
+            return sim->status = SIM_ERR_NOMEM;
+        host_start = profile_clock_ns();
+    }
+    sim->mode = 3; // execute_r_i_type() corrects PC for the pipeline's fetch-ahead in modes 1 and 2
+    run_fast(sim, words_read, budget);
+    sim->mode = mode;
+    if (sim->profile != NULL)
+        profile_host_run(sim->profile, host_start, sim->total_instructions - start, 0);
+    sim->branch_taken = false; // Left set by taken branches
+    sim->next_pc = sim->PC;
+    sim->ff_instructions += sim->total_instructions - start;
+    if (sim->shadow != NULL && !cosim_sync(sim))
+        sim->status = SIM_ERR_NOMEM;
+
+    if (sim->status == SIM_OK && sim->PC / 4 >= (uint32_t)words_read)
+        sim->status = SIM_END_OF_IMAGE;
+    return sim->status;
+}
+
+SimStatus sim_run_sampled(Simulator *sim, const SimSampling *sampling)
+{
+    if (sim->mode != 1 && sim->mode != 2)
+        return sim_run(sim, 0);
+
+    SimStatus status = sim->status;
+    if (status == SIM_OK && sampling->fast_forward > 0)
+        status = sim_fast_forward(sim, sampling->fast_forward);
+    if (sampling->period == 0 || sampling->measure == 0)
+        return status == SIM_OK ? sim_run(sim, 0) : status;
+
+    uint64_t detailed = sampling->warmup + sampling->measure;
+    uint64_t skip = sampling->period > detailed ? sampling->period - detailed : 0;
+    while (status == SIM_OK)
+    {
+        if (sampling->warmup > 0)
+            status = sim_run(sim, sampling->warmup);
+        if (status != SIM_OK)
+            break;
+
+        int64_t instructions = sim->total_instructions;
+        int64_t cycles = sim->total_cycles;
+        int64_t stalls = sim->total_stalls;
+        status = sim_run(sim, sampling->measure);
+        // A sample cut short by the end of the run still counts
+        instructions = sim->total_instructions - instructions;
+        if (instructions > 0)
+        {
+            double cpi = (double)(sim->total_cycles - cycles) / instructions;
+            sim->num_samples++;
+            sim->sampled_instructions += instructions;
+            sim->sampled_cycles += sim->total_cycles - cycles;
+            sim->sampled_stalls += sim->total_stalls - stalls;
+            sim->sample_cpi_sum += cpi;
+            sim->sample_cpi_sq_sum += cpi * cpi;
+        }
+
+        if (status == SIM_OK && skip > 0)
+            status = sim_fast_forward(sim, skip);
+    }
+    return status;
+}
+
+SimStatus sim_save_checkpoint(Simulator *sim, const char *filename)
+{
+    if (sim->words_read == 0)
+        return SIM_ERR_LOAD;
+    if (!checkpoint_save(sim, filename))
+    {
+        fprintf(sim->out, "Error: The checkpoint could not be written.\n");
+        return SIM_ERR_IO;
+    }
+    TRACE(TRACE_SUMMARY, "Checkpoint saved after %lld instructions.\n", (long long)sim->total_instructions);
+    return SIM_OK;
+}
+
+SimStatus sim_restore_checkpoint(Simulator *sim, const char *filename)
+{
+    size_t size;
+    void *data = map_file(filename, &size);
+    if (data == NULL)
+    {
+        fprintf(sim->out, "The file could not be opened.\n");
+        return SIM_ERR_LOAD;
+    }
+
+    discard_decoded_text(sim);
+    mem_free(&sim->memory);
+    free(sim->checkpoint_file);
+    sim->checkpoint_file = NULL;
+    SimStatus status = checkpoint_restore(sim, data, size);
+    if (status != SIM_OK)
+    {
+        if (sim->memory.image == NULL)
+            unmap_file(data, size);
+        mem_free(&sim->memory);
+        sim->words_read = 0;
+        return sim->status = status;
+    }
+    sim->checkpoint_file = strdup(filename);
+    scoreboard_rebuild(sim);
+    if (sim->profile != NULL)
+        profile_reset(sim->profile);
+    if (sim->shadow != NULL && !cosim_sync(sim))
+        return sim->status = SIM_ERR_NOMEM;
+
+    TRACE(TRACE_SUMMARY, "Checkpoint Loaded. Number of instructions read: %d, executed: %lld.\n", sim->words_read,
+          (long long)sim->total_instructions);
+    return sim->status;
+}
+
+SimStatus sim_set_pipe_trace(Simulator *sim, const char *filename)
+{
+    SimStatus status = SIM_OK;
+    if (sim->pipe_trace != NULL && !pipe_trace_close(sim->pipe_trace))
+        status = SIM_ERR_IO;
+    sim->pipe_trace = NULL;
+    if (filename != NULL && status == SIM_OK)
+    {
+        sim->pipe_trace = pipe_trace_open(filename, &sim->pipe);
+        if (sim->pipe_trace == NULL)
+            status = SIM_ERR_IO;
+    }
+    return status;
+}
+
+SimStatus sim_set_profiling(Simulator *sim, int enable)
+{
+    if (!enable)
+    {
+        profile_free(sim->profile);
+        sim->profile = NULL;
+        return SIM_OK;
+    }
+    if (sim->profile != NULL)
+        return SIM_OK;
+    Profile *profile = calloc(1, sizeof(Profile));
+    if (profile == NULL || !profile_resize(profile, sim->words_read))
+    {
+        profile_free(profile);
+        return SIM_ERR_NOMEM;
+    }
+    sim->profile = profile;
+    return SIM_OK;
+}
+
+SimStatus sim_set_cosim(Simulator *sim, int enable)
+{
+    if (!enable)
+    {
+        sim_destroy(sim->shadow);
+        sim->shadow = NULL;
+        return SIM_OK;
+    }
+    if (sim->mode != 1 && sim->mode != 2)
+        return SIM_ERR_CONFIG;
+    if (sim->shadow != NULL)
+        return SIM_OK;
+    sim->shadow = sim_create(0, sim->memory.size, sim->out);
+    if (sim->shadow == NULL || !cosim_sync(sim))
+    {
+        sim_destroy(sim->shadow);
+        sim->shadow = NULL;
+        return SIM_ERR_NOMEM;
+    }
+    return SIM_OK;
+}
+
+// Host speed of the profiled runs, per second of wall-clock time
+static double profile_rate(Profile *p, uint64_t count)
+{
+    return p->host_ns > 0 ? count * 1e9 / p->host_ns : 0;
+}
+
+void write_profile_json(Simulator *sim, FILE *file)
+{
+    Profile *p = sim->profile;
+    fprintf(file, "{\n");
+    fprintf(file, "  \"mode\": %d,\n", sim->mode);
+    fprintf(file, "  \"instructions\": %lld,\n", (long long)sim->total_instructions);
+    fprintf(file, "  \"cycles\": %lld,\n", (long long)sim->total_cycles);
+    fprintf(file, "  \"stalls\": %lld,\n", (long long)sim->total_stalls);
+    fprintf(file, "  \"stall_breakdown\": {\"raw\": %llu, \"ex_hold\": %llu, \"mem_hold\": %llu, \"branch\": %llu, "
+                  "\"dcache\": %lld, \"icache\": %lld},\n",
+            (unsigned long long)p->raw_stalls, (unsigned long long)p->ex_stalls, (unsigned long long)p->mem_stalls,
+            (unsigned long long)p->branch_bubbles, (long long)sim->dcache.stall_cycles, (long long)sim->icache.stall_cycles);
+    fprintf(file, "  \"forwarding\": {\"ex_src1\": %llu, \"ex_src2\": %llu, \"mem_src1\": %llu, \"mem_src2\": %llu},\n",
+            (unsigned long long)p->forwards[0], (unsigned long long)p->forwards[1], (unsigned long long)p->forwards[2],
+            (unsigned long long)p->forwards[3]);
+    fprintf(file, "  \"host\": {\"seconds\": %.6f, \"instructions_per_second\": %.0f, \"cycles_per_second\": %.0f},\n",
+            p->host_ns / 1e9, profile_rate(p, p->host_instructions), profile_rate(p, p->host_cycles));
+
+    fprintf(file, "  \"opcodes\": {");
+    const char *separator = "";
+    for (int opcode = 0; opcode < 64; opcode++)
+    {
+        if (p->opcodes[opcode] == 0)
+            continue;
+        fprintf(file, "%s\"%s\": %llu", separator, get_instruction_name(opcode), (unsigned long long)p->opcodes[opcode]);
+        separator = ", ";
+    }
+    fprintf(file, "},\n");
+
+    fprintf(file, "  \"pcs\": [");
+    separator = "\n";
+    for (uint32_t i = 0; i < p->words; i++)
+    {
+        if (p->executed[i] == 0 && p->stall_cycles[i] == 0)
+            continue;
+        instruction raw = {mem_read(&sim->memory, i * 4)};
+        fprintf(file, "%s    {\"pc\": %u, \"instruction\": \"%s\", \"executed\": %llu, \"stall_cycles\": %llu}", separator,
+                i * 4, get_decode_str(raw), (unsigned long long)p->executed[i], (unsigned long long)p->stall_cycles[i]);
+        separator = ",\n";
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+// One "section,name,count,stall_cycles" row per counter
+void write_profile_csv(Simulator *sim, FILE *file)
+{
+    Profile *p = sim->profile;
+    fprintf(file, "section,name,count,stall_cycles\n");
+    fprintf(file, "total,mode,%d,\n", sim->mode);
+    fprintf(file, "total,instructions,%lld,\n", (long long)sim->total_instructions);
+    fprintf(file, "total,cycles,%lld,\n", (long long)sim->total_cycles);
+    fprintf(file, "total,stalls,%lld,\n", (long long)sim->total_stalls);
+    fprintf(file, "stalls,raw,%llu,\n", (unsigned long long)p->raw_stalls);
+    fprintf(file, "stalls,ex_hold,%llu,\n", (unsigned long long)p->ex_stalls);
+    fprintf(file, "stalls,mem_hold,%llu,\n", (unsigned long long)p->mem_stalls);
+    fprintf(file, "stalls,branch,%llu,\n", (unsigned long long)p->branch_bubbles);
+    fprintf(file, "stalls,dcache,%lld,\n", (long long)sim->dcache.stall_cycles);
+    fprintf(file, "stalls,icache,%lld,\n", (long long)sim->icache.stall_cycles);
+    static const char *paths[4] = {"ex_src1", "ex_src2", "mem_src1", "mem_src2"};
+    for (int i = 0; i < 4; i++)
+        fprintf(file, "forwarding,%s,%llu,\n", paths[i], (unsigned long long)p->forwards[i]);
+    fprintf(file, "host,seconds,%.6f,\n", p->host_ns / 1e9);
+    fprintf(file, "host,instructions_per_second,%.0f,\n", profile_rate(p, p->host_instructions));
+    fprintf(file, "host,cycles_per_second,%.0f,\n", profile_rate(p, p->host_cycles));
+    for (int opcode = 0; opcode < 64; opcode++)
+        if (p->opcodes[opcode] > 0)
+            fprintf(file, "opcode,%s,%llu,\n", get_instruction_name(opcode), (unsigned long long)p->opcodes[opcode]);
+    for (uint32_t i = 0; i < p->words; i++)
+    {
+        if (p->executed[i] == 0 && p->stall_cycles[i] == 0)
+            continue;
+        instruction raw = {mem_read(&sim->memory, i * 4)};
+        fprintf(file, "pc,\"0x%08X: %s\",%llu,%llu\n", i * 4, get_decode_str(raw), (unsigned long long)p->executed[i],
+                (unsigned long long)p->stall_cycles[i]);
+    }
+}
+
+SimStatus sim_write_profile(Simulator *sim, const char *filename, SimProfileFormat format)
+{
+    if (sim->profile == NULL)
+        return SIM_ERR_CONFIG;
+    FILE *file = fopen(filename, "w");
+    if (file == NULL)
+        return SIM_ERR_IO;
+    if (format == SIM_PROFILE_CSV)
+        write_profile_csv(sim, file);
+    else
+        write_profile_json(sim, file);
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok ? SIM_OK : SIM_ERR_IO;
+}
+
+void sim_get_stats(Simulator *sim, SimStats *stats)
+{
+    stats->pc = sim->PC;
+    stats->total_instructions = sim->total_instructions;
+    stats->arithmetic_count = sim->arithmetic_count;
+    stats->logical_count = sim->logical_count;
+    stats->memory_count = sim->memory_count;
+    stats->control_count = sim->control_count;
+    stats->total_cycles = sim->total_cycles;
+    stats->total_stalls = sim->total_stalls;
+    stats->fast_forwarded = sim->ff_instructions;
+    stats->samples = sim->num_samples;
+    sample_estimates(sim, &stats->estimated_cycles, &stats->estimated_stalls, &stats->cpi_error);
+    stats->branches = sim->predictor.branches;
+    stats->mispredictions = sim->predictor.mispredictions;
+    stats->branch_penalty = sim->predictor.penalty_cycles;
+    stats->dcache_hits = sim->dcache.hits;
+    stats->dcache_misses = sim->dcache.misses;
+    stats->dcache_evictions = sim->dcache.evictions;
+    stats->icache_hits = sim->icache.hits;
+    stats->icache_misses = sim->icache.misses;
+    stats->icache_evictions = sim->icache.evictions;
+}
+
+int32_t sim_get_register(Simulator *sim, int reg)
+{
+    return reg >= 0 && reg < NUM_REGISTERS ? sim->registers[reg] : 0;
+}
+
+uint32_t sim_read_word(Simulator *sim, uint32_t addr)
+{
+    return mem_read(&sim->memory, addr);
+}
+
+void sim_print_summary(Simulator *sim)
+{
+    halt_summary(sim);
+}
+
+const char *sim_status_name(SimStatus status)
+{
+    switch (status)
+    {
+    case SIM_OK:
+        return "running";
+    case SIM_HALTED:
+        return "HALT";
+    case SIM_END_OF_IMAGE:
+        return "ended without HALT";
+    case SIM_ERR_MODE:
+        return "invalid mode";
+    case SIM_ERR_LOAD:
+        return "image not loaded";
+    case SIM_ERR_MEMORY:
+        return "memory access out of bounds";
+    case SIM_ERR_OPCODE:
+        return "unknown opcode";
+    case SIM_ERR_NOMEM:
+        return "out of host memory";
+    case SIM_ERR_IO:
+        return "checkpoint not written";
+    case SIM_ERR_CONFIG:
+        return "invalid pipeline configuration";
+    case SIM_ERR_COSIM:
+        return "co-simulation mismatch";
     default:
-        printf("\nINVALID MODE enteted!\nPlease enter a valid mode - 0/1/2\n\n");
+        return "unknown status";
+    }
+}
+
+// Loads and runs one image to completion as the CLI does, printing the
+// summary after HALT. If 'checkpoint_file' is set, a checkpoint is saved once
+// 'checkpoint_at' instructions have run and the run then carries on. Returns
+// the CLI exit status (1 after HALT or an error, 0 when the image ends without
+// HALT), or -1 for an invalid mode. With 'sampling' set, the run after the
+// checkpoint is a sampled one.
+int run_to_completion(Simulator *sim, const char *filename, uint64_t checkpoint_at, const char *checkpoint_file,
+                      const SimSampling *sampling, SimStatus *status)
+{
+    *status = sim_load_image(sim, filename);
+    if (*status == SIM_OK && checkpoint_file != NULL)
+    {
+        SimStats stats;
+        sim_get_stats(sim, &stats);
+        // A restored checkpoint may already be past the requested point
+        if (checkpoint_at > (uint64_t)stats.total_instructions)
+            *status = sim_run(sim, checkpoint_at - stats.total_instructions);
+        if (*status == SIM_OK)
+            *status = sim_save_checkpoint(sim, checkpoint_file);
+        else
+            fprintf(sim->out, "\n[WARN] Run ended before the checkpoint at %llu instructions.\n", (unsigned long long)checkpoint_at);
+    }
+    if (*status == SIM_OK)
+        *status = sampling != NULL ? sim_run_sampled(sim, sampling) : sim_run(sim, 0);
+
+    switch (*status)
+    {
+    case SIM_HALTED:
+        halt_summary(sim);
+        return 1;
+    case SIM_END_OF_IMAGE:
+        fprintf(sim->out, "\n[WARN] Simulation ended without HALT.\n");
+        return 0;
+    case SIM_ERR_MODE:
+        fprintf(sim->out, "\nINVALID MODE enteted!\nPlease enter a valid mode - 0/1/2/3\n\n");
+        return -1;
+    default:
+        return 1; // The error has been reported where it happened
+    }
+}
+
+#ifndef MIPS_LITE_NO_MAIN
+
+// One line of a batch manifest
+typedef struct BatchJob
+{
+    char *image;
+    char *output; // Receives the job's trace and halt_summary()
+    int mode;
+    SimStatus status;
+    bool failed; // Could not be run, or ended in an error
+} BatchJob;
+
+typedef struct BatchQueue
+{
+    BatchJob *jobs;
+    int num_jobs;
+    int next_job;
+    pthread_mutex_t lock;
+    uint32_t memory_size;
+} BatchQueue;
+
+// Runs one job on the calling thread with its own Simulator
+void run_batch_job(BatchJob *job, uint32_t memory_size)
+{
+    FILE *out = fopen(job->output, "w");
+    Simulator *sim = out != NULL ? sim_create(job->mode, memory_size, out) : NULL;
+    if (sim == NULL)
+    {
+        if (out != NULL)
+            fclose(out);
+        job->failed = true;
+        return;
+    }
+
+    run_to_completion(sim, job->image, 0, NULL, NULL, &job->status);
+    job->failed = job->status != SIM_HALTED && job->status != SIM_END_OF_IMAGE;
+
+    sim_destroy(sim);
+    fclose(out);
+}
+void *batch_worker(void *arg)
+{
+    BatchQueue *queue = arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->lock);
+        int job = queue->next_job++;
+        pthread_mutex_unlock(&queue->lock);
+        if (job >= queue->num_jobs)
+            return NULL;
+        run_batch_job(&queue->jobs[job], queue->memory_size);
+    }
+}
+
+// Reads a manifest with one "<Filename> <Mode> [Output]" job per line. Blank
+// lines and lines starting with '#' are skipped. The output defaults to
+// "<Filename>.<Mode>.out". Returns the number of jobs, or -1 on error.
+int read_manifest(const char *filename, BatchJob **jobs)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        printf("Error: The manifest could not be opened.\n");
+        return -1;
+    }
+
+    char line[1024], image[1024], output[1024];
+    int num_jobs = 0, cap = 0, line_num = 0;
+    *jobs = NULL;
+    while (fgets(line, sizeof(line), file))
+    {
+        line_num++;
+        int mode;
+        output[0] = '\0';
+        int fields = sscanf(line, "%1023s %d %1023s", image, &mode, output);
+        if (fields <= 0 || image[0] == '#')
+            continue;
+        if (fields < 2)
+        {
+            printf("Error: Manifest line %d needs <Filename> <Mode>.\n", line_num);
+            fclose(file);
+            return -1;
+        }
+        if (fields < 3 && snprintf(output, sizeof(output), "%s.%d.out", image, mode) >= (int)sizeof(output))
+        {
+            // A truncated name could be another job's output
+            printf("Error: Manifest line %d: the output file name is too long.\n", line_num);
+            fclose(file);
+            return -1;
+        }
+
+        if (num_jobs == cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            *jobs = realloc(*jobs, cap * sizeof(BatchJob));
+            if (*jobs == NULL)
+            {
+                printf("Error: Could not allocate the batch job list.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        BatchJob *job = &(*jobs)[num_jobs++];
+        memset(job, 0, sizeof(*job));
+        job->image = strdup(image);
+        job->output = strdup(output);
+        job->mode = mode;
+    }
+    fclose(file);
+    return num_jobs;
+}
+
+// Runs every job of a manifest on a pool of worker threads and reports how
+// each one ended. Returns 1 if any job failed, 0 otherwise.
+int run_batch(const char *manifest, int num_threads, uint32_t memory_size)
+{
+    BatchQueue queue = {0};
+    queue.num_jobs = read_manifest(manifest, &queue.jobs);
+    if (queue.num_jobs < 0)
+        return 1;
+    queue.memory_size = memory_size;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    if (num_threads > queue.num_jobs)
+        num_threads = queue.num_jobs;
+    pthread_t *threads = calloc(num_threads > 0 ? num_threads : 1, sizeof(pthread_t));
+    int started = 0;
+    while (threads != NULL && started < num_threads &&
+           pthread_create(&threads[started], NULL, batch_worker, &queue) == 0)
+        started++;
+    if (started == 0)
+        batch_worker(&queue); // No threads available, run the jobs here
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&queue.lock);
+
+    int failed = 0;
+    for (int i = 0; i < queue.num_jobs; i++)
+    {
+        BatchJob *job = &queue.jobs[i];
+        printf("[BATCH] %s (mode %d) -> %s: %s\n", job->image, job->mode, job->output,
+               job->failed ? "FAILED" : sim_status_name(job->status));
+        failed += job->failed;
+        free(job->image);
+        free(job->output);
+    }
+    printf("[BATCH] %d jobs, %d failed, %d threads\n", queue.num_jobs, failed, num_threads);
+    free(queue.jobs);
+    return failed ? 1 : 0;
+}
+
+// Differential fuzzing (-fuzz): every program from fuzz_generate() runs in
+// modes 0 to 3, and modes 1 to 3 must end in the state of mode 0
+#define FUZZ_CHUNK 16       // Programs a worker takes from the queue at once
+#define FUZZ_MAX_REPORTS 10 // Divergent programs described, the lowest numbered
+#define FUZZ_TEXT_LEN 256
+#define FUZZ_MAX_INSTRUCTIONS 1000000 // Bound of mode 0, far above what a program can run
+
+#if !defined(_WIN32)
+#define FUZZ_NULL_DEVICE "/dev/null"
+#else
+#define FUZZ_NULL_DEVICE "NUL"
+#endif
+
+typedef struct FuzzReport
+{
+    uint64_t program;
+    char text[FUZZ_TEXT_LEN];
+} FuzzReport;
+
+typedef struct FuzzQueue
+{
+    uint64_t num_programs;
+    uint64_t next_program;
+    uint64_t seed; // Of program 0, program i has seed + i
+    uint32_t memory_size;
+    const SimPipelineConfig *pipe_config;
+    pthread_mutex_t lock;
+    bool setup_failed;
+    uint64_t instructions; // Run by mode 0
+    uint64_t divergent[4]; // Programs per mode
+    uint64_t failed;       // Programs divergent in any mode
+    FuzzReport reports[FUZZ_MAX_REPORTS];
+    int num_reports;
+} FuzzQueue;
+
+// Completes the instructions of a pipeline mode that are past EX, so that
+// registers and memory hold the effect of exactly the instructions executed
+void fuzz_drain(Simulator *sim)
+{
+    if ((sim->mode != 1 && sim->mode != 2) || sim->status != SIM_OK)
+        return;
+    jmp_buf exit_jmp;
+    sim->exit_jmp = &exit_jmp;
+    if (setjmp(exit_jmp) == 0)
+        drain_pipeline(sim);
+}
+
+// Runs the program loaded in 'sim' again, for its first 'n' instructions
+void fuzz_run_prefix(Simulator *sim, uint64_t n)
+{
+    sim_reset(sim);
+    if (n > 0)
+        sim_run(sim, n);
+    fuzz_drain(sim);
+}
+
+// Describes the first difference between 'sim' and the mode 0 reference
+// 'ref' into 'text'. Returns false if they are in the same state.
+bool fuzz_compare(Simulator *ref, Simulator *sim, const FuzzProgram *prog, char *text, size_t len)
+{
+    if (sim->status != ref->status)
+    {
+        snprintf(text, len, "ends with %s, mode 0 with %s", sim_status_name(sim->status), sim_status_name(ref->status));
+        return true;
+    }
+    if (sim->total_instructions != ref->total_instructions)
+    {
+        snprintf(text, len, "%lld instructions, mode 0 %lld", (long long)sim->total_instructions,
+                 (long long)ref->total_instructions);
+        return true;
+    }
+    for (int reg = 0; reg < 32; reg++)
+    {
+        if (sim->registers[reg] != ref->registers[reg])
+        {
+            snprintf(text, len, "R%d = %d, mode 0 %d", reg, sim->registers[reg], ref->registers[reg]);
+            return true;
+        }
+    }
+    for (uint32_t addr = 0; addr < prog->data_base + FUZZ_DATA_BYTES; addr += 4)
+    {
+        if (addr == prog->num_words * 4)
+            addr = prog->data_base;
+        int32_t value = mem_read(&sim->memory, addr);
+        int32_t expected = mem_read(&ref->memory, addr);
+        if (value != expected)
+        {
+            snprintf(text, len, "Mem[0x%08X] = %d, mode 0 %d", addr, value, expected);
+            return true;
+        }
+    }
+    if (sim->status == SIM_OK && sim->PC != ref->PC)
+    {
+        snprintf(text, len, "PC 0x%08X, mode 0 0x%08X", sim->PC, ref->PC);
+        return true;
+    }
+    return false;
+}
+
+// Finds the first instruction after which mode 'mode' disagrees with mode
+// 0, bisecting on the number of instructions run, and describes it into
+// 'report'. 'final' describes the difference at the end of the runs.
+void fuzz_locate(Simulator *sims[4], int mode, const FuzzProgram *prog, const char *final, char *report, size_t len)
+{
+    Simulator *ref = sims[0];
+    Simulator *sim = sims[mode];
+    char text[FUZZ_TEXT_LEN];
+    uint64_t lo = 0;
+    uint64_t hi = ref->total_instructions;
+    fuzz_run_prefix(ref, hi);
+    fuzz_run_prefix(sim, hi);
+    if (!fuzz_compare(ref, sim, prog, text, sizeof(text)))
+    {
+        // Agrees until mode 0 halts, then runs on
+        snprintf(report, len, "mode %d diverges after the last instruction: %s", mode, final);
+        return;
+    }
+    while (hi - lo > 1)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        fuzz_run_prefix(ref, mid);
+        fuzz_run_prefix(sim, mid);
+        if (fuzz_compare(ref, sim, prog, text, sizeof(text)))
+            hi = mid;
+        else
+            lo = mid;
+    }
+
+    fuzz_run_prefix(ref, lo);
+    uint32_t pc = ref->PC;
+    char instr[48];
+    asm_disassemble(mem_read(&ref->memory, pc), instr, sizeof(instr));
+    fuzz_run_prefix(ref, hi);
+    fuzz_run_prefix(sim, hi);
+    fuzz_compare(ref, sim, prog, text, sizeof(text));
+    snprintf(report, len, "mode %d diverges at instruction %llu, PC 0x%08X (%s): %s", mode, (unsigned long long)hi, pc, instr, text);
+}
+
+// Runs one program in every mode. Returns the modes that end in another
+// state than mode 0 as a bit mask, describing the first one into 'report'.
+// The other modes get one instruction more than mode 0 needed, so one that
+// goes wrong into an endless loop is stopped, and shows as still running.
+int fuzz_program(Simulator *sims[4], const FuzzProgram *prog, uint64_t *instructions, char *report, size_t len)
+{
+    sim_load_words(sims[0], prog->words, prog->num_words);
+    sim_run(sims[0], FUZZ_MAX_INSTRUCTIONS);
+    *instructions = sims[0]->total_instructions;
+    for (int mode = 1; mode < 4; mode++)
+    {
+        sim_load_words(sims[mode], prog->words, prog->num_words);
+        sim_run(sims[mode], *instructions + 1);
+    }
+
+    int divergent = 0;
+    char text[FUZZ_TEXT_LEN];
+    for (int mode = 1; mode < 4; mode++)
+        if (fuzz_compare(sims[0], sims[mode], prog, text, sizeof(text)))
+            divergent |= 1 << mode;
+    for (int mode = 1; mode < 4; mode++)
+    {
+        if (divergent & (1 << mode))
+        {
+            fuzz_compare(sims[0], sims[mode], prog, text, sizeof(text));
+            fuzz_locate(sims, mode, prog, text, report, len);
+            break;
+        }
+    }
+    return divergent;
+}
+
+// Keeps the report of 'program' if it is among the FUZZ_MAX_REPORTS lowest
+// numbered, so the reports do not depend on the thread timing
+void fuzz_add_report(FuzzQueue *queue, uint64_t program, const char *text)
+{
+    int slot = queue->num_reports;
+    if (slot == FUZZ_MAX_REPORTS)
+    {
+        slot = 0;
+        for (int i = 1; i < FUZZ_MAX_REPORTS; i++)
+            if (queue->reports[i].program > queue->reports[slot].program)
+                slot = i;
+        if (queue->reports[slot].program < program)
+            return;
+    }
+    else
+        queue->num_reports++;
+    queue->reports[slot].program = program;
+    snprintf(queue->reports[slot].text, FUZZ_TEXT_LEN, "%s", text);
+}
+
+void *fuzz_worker(void *arg)
+{
+    FuzzQueue *queue = arg;
+    FILE *out = fopen(FUZZ_NULL_DEVICE, "w"); // Error messages of the runs, already reported as a divergence
+    Simulator *sims[4] = {0};
+    FuzzProgram *prog = malloc(sizeof(FuzzProgram));
+    bool ready = out != NULL && prog != NULL;
+    for (int mode = 0; mode < 4 && ready; mode++)
+    {
+        sims[mode] = sim_create(mode, queue->memory_size, out);
+        ready = sims[mode] != NULL && sim_configure_pipeline(sims[mode], queue->pipe_config) == SIM_OK;
+    }
+
+    uint64_t instructions = 0;
+    uint64_t divergent[4] = {0};
+    uint64_t failed = 0;
+    while (ready)
+    {
+        pthread_mutex_lock(&queue->lock);
+        uint64_t first = queue->next_program;
+        queue->next_program += FUZZ_CHUNK;
+        pthread_mutex_unlock(&queue->lock);
+        if (first >= queue->num_programs)
+            break;
+
+        uint64_t last = first + FUZZ_CHUNK < queue->num_programs ? first + FUZZ_CHUNK : queue->num_programs;
+        for (uint64_t program = first; program < last; program++)
+        {
+            fuzz_generate(prog, queue->seed + program, queue->memory_size);
+            char report[FUZZ_TEXT_LEN];
+            uint64_t count;
+            int modes = fuzz_program(sims, prog, &count, report, sizeof(report));
+            instructions += count;
+            if (modes == 0)
+                continue;
+            for (int mode = 1; mode < 4; mode++)
+                divergent[mode] += (modes >> mode) & 1;
+            failed++;
+            pthread_mutex_lock(&queue->lock);
+            fuzz_add_report(queue, program, report);
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->setup_failed |= !ready;
+    queue->instructions += instructions;
+    for (int mode = 1; mode < 4; mode++)
+        queue->divergent[mode] += divergent[mode];
+    queue->failed += failed;
+    pthread_mutex_unlock(&queue->lock);
+
+    for (int mode = 0; mode < 4; mode++)
+        sim_destroy(sims[mode]);
+    free(prog);
+    if (out != NULL)
+        fclose(out);
+    return NULL;
+}
+
+static int compare_fuzz_reports(const void *a, const void *b)
+{
+    uint64_t x = ((const FuzzReport *)a)->program;
+    uint64_t y = ((const FuzzReport *)b)->program;
+    return (x > y) - (x < y);
+}
+
+// Writes the program of 'seed' as assembly to "fuzz-<seed>.s", to be run on
+// its own. Returns false if it cannot be written.
+bool write_fuzz_program(uint64_t seed, uint32_t memory_size, char *filename, size_t len)
+{
+    FuzzProgram *prog = malloc(sizeof(FuzzProgram));
+    snprintf(filename, len, "fuzz-%llu.s", (unsigned long long)seed);
+    FILE *file = prog != NULL ? fopen(filename, "w") : NULL;
+    bool ok = file != NULL;
+    if (ok)
+    {
+        fuzz_generate(prog, seed, memory_size);
+        fprintf(file, "# Program of -fuzz -seed %llu -m %u\n", (unsigned long long)seed, memory_size);
+        for (uint32_t i = 0; i < prog->num_words; i++)
+        {
+            char text[48];
+            fprintf(file, "%s\n", asm_disassemble(prog->words[i], text, sizeof(text)));
+        }
+        ok = fclose(file) == 0;
+    }
+    free(prog);
+    return ok;
+}
+
+// Runs 'num_programs' random programs, from 'seed' on, in every mode on
+// 'num_threads' threads. Returns the exit status, 1 if any mode diverged.
+int run_fuzz(uint64_t num_programs, uint64_t seed, int num_threads, uint32_t memory_size, const SimPipelineConfig *pipe_config)
+{
+    if (memory_size < FUZZ_MIN_MEMORY)
+    {
+        printf("Error: -fuzz needs at least %d bytes of memory.\n", FUZZ_MIN_MEMORY);
+        return 1;
+    }
+    FuzzQueue *queue = calloc(1, sizeof(FuzzQueue));
+    if (queue == NULL)
+        return 1;
+    queue->num_programs = num_programs;
+    queue->seed = seed;
+    queue->memory_size = memory_size;
+    queue->pipe_config = pipe_config;
+    pthread_mutex_init(&queue->lock, NULL);
+    trace_verbosity = TRACE_OFF;
+
+    uint64_t start = profile_clock_ns();
+    if ((uint64_t)num_threads > (num_programs + FUZZ_CHUNK - 1) / FUZZ_CHUNK)
+        num_threads = (num_programs + FUZZ_CHUNK - 1) / FUZZ_CHUNK;
+    pthread_t *threads = calloc(num_threads > 0 ? num_threads : 1, sizeof(pthread_t));
+    int started = 0;
+    while (threads != NULL && started < num_threads &&
+           pthread_create(&threads[started], NULL, fuzz_worker, queue) == 0)
+        started++;
+    if (started == 0)
+        fuzz_worker(queue); // No threads available, run the programs here
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&queue->lock);
+    double seconds = (profile_clock_ns() - start) / 1e9;
+
+    int status = 0;
+    if (queue->setup_failed)
+    {
+        printf("Error: Could not create the simulators.\n");
+        status = 1;
+    }
+    qsort(queue->reports, queue->num_reports, sizeof(FuzzReport), compare_fuzz_reports);
+    for (int i = 0; i < queue->num_reports; i++)
+    {
+        FuzzReport *report = &queue->reports[i];
+        char filename[64];
+        bool written = write_fuzz_program(seed + report->program, memory_size, filename, sizeof(filename));
+        printf("[FUZZ] Seed %llu: %s%s%s\n", (unsigned long long)(seed + report->program), report->text,
+               written ? " -> " : "", written ? filename : "");
+    }
+    printf("[FUZZ] %llu programs, %llu instructions, %d threads, %.2f s, %.0f programs/s\n",
+           (unsigned long long)num_programs, (unsigned long long)queue->instructions, started > 0 ? started : 1,
+           seconds, seconds > 0 ? num_programs / seconds : 0);
+    printf("[FUZZ] Divergent programs: mode 1: %llu, mode 2: %llu, mode 3: %llu\n", (unsigned long long)queue->divergent[1],
+           (unsigned long long)queue->divergent[2], (unsigned long long)queue->divergent[3]);
+    if (queue->failed > 0)
+        status = 1;
+    free(queue);
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) // Check if the filename is provided as an argument
+    {
+    EXIT_FLAG:
+        printf("Usage: %s <Filename> <Mode> [Options]\n", argv[0]);
+        printf("       %s -batch <Manifest> [Options]\n", argv[0]);
+        printf("       %s -asm <Source> [Output]\n", argv[0]);
+        printf("       %s -disasm <Filename> [Output]\n", argv[0]);
+        printf("       %s -fuzz <Programs> [Options]\n", argv[0]);
+        printf("<Filename>: input mem filename (hex text, assembly source ending in .s or .asm,\n");
+        printf("\t    or binary image from mips_lite_gcc.py pack)\n");
+        printf("<Mode>: 0/1/2/3\n");
+        printf("\t 0 - Functional Simulator\n");
+        printf("\t 1 - Pipeline Simulator with Forwarding\n");
+        printf("\t 2 - Pipeline Simulator without Forwarding\n");
+        printf("\t 3 - Fast Functional Simulator\n");
+        printf("<Manifest>: one \"<Filename> <Mode> [Output]\" job per line, run concurrently;\n");
+        printf("\t      each job writes to Output (default <Filename>.<Mode>.out)\n");
+        printf("-asm: assemble Source to a hex text image at Output (default <Source>.o)\n");
+        printf("-disasm: write a hex text image back as assembly to Output (default <Filename>.s)\n");
+        printf("-fuzz: run that many random programs in every mode, on all CPUs, and report\n");
+        printf("\t    those where modes 1-3 end in another state than mode 0; each one is\n");
+        printf("\t    bisected to its first divergent instruction and written to fuzz-<Seed>.s\n");
+        printf("[Options]:\n");
+        printf("\t -v <Level> - Trace verbosity, up to the compiled TRACE_LEVEL (%d)\n", TRACE_LEVEL);
+        printf("\t              0 - summary only, 1 - status messages, 2 - per-cycle trace\n");
+        printf("\t -m <Bytes> - Data address space size, K/M/G suffix allowed (default %d, max 2G)\n", MEMORY_SIZE);
+        printf("\t -j <Threads> - Batch and fuzzing worker threads (default: one per CPU)\n");
+        printf("\t -seed <N> - Fuzzing: seed of the first program, the next get N+1, N+2... (default 1)\n");
+        printf("\t -checkpoint <Instructions> <File> - Save the full state to File after that many\n");
+        printf("\t              instructions, then carry on; pass File as <Filename> to resume from it\n");
+        printf("\t -ff <Instructions> - Modes 1/2: run that many instructions functionally first\n");
+        printf("\t -sample <Period> <Warmup> <Measure> - Modes 1/2: every Period instructions, run\n");
+        printf("\t              Warmup + Measure in the pipeline model and the rest functionally;\n");
+        printf("\t              cycles and stalls are estimated from the Measure intervals\n");
+        printf("\t -pipe <Spec> - Modes 1/2: pipeline timing, comma-separated key=value list of\n");
+        printf("\t              if=<IF stages> alu/mul/load/store/branch=<Cycles> fwd=none|ex|mem|all\n");
+        printf("\t              bp=none|static|bimodal|gshare bp_bits=<log2 Counters> history=<Bits>\n");
+        printf("\t              btb_bits=<log2 JR targets> (default if=1, 1 cycle each, fwd=none in\n");
+        printf("\t              mode 1 and all in mode 2, bp=none bp_bits=12 history=8 btb_bits=8)\n");
+        printf("\t              dcache=<Bytes> dcache_ways=<Ways> dcache_line=<Bytes> dcache_miss=<Cycles>\n");
+        printf("\t              dcache_policy=lru|plru dcache_write=back|through, the same for icache\n");
+        printf("\t              (default no caches; once sized 2-way, 32-byte lines, 10-cycle misses,\n");
+        printf("\t              LRU, write-back)\n");
+        printf("\t -ptrace <File> - Modes 1/2: record every cycle to a binary pipeline trace,\n");
+        printf("\t              rendered by mips_trace_view.py\n");
+        printf("\t -profile <File> - Write per-opcode and per-PC counts, stall causes, forwarding\n");
+        printf("\t              use and host speed to File, as CSV if it ends in .csv, else JSON\n");
+        printf("\t -cosim - Modes 1/2: check every instruction retiring from WB against the\n");
+        printf("\t              functional model, and stop at the first mismatch\n");
+        return 1;
+    }
+
+    // Same jobs as mips_lite_gcc.py encode and decode
+    if (strcmp(argv[1], "-asm") == 0 && argc <= 4)
+        return asm_file(argv[2], argc == 4 ? argv[3] : NULL);
+    if (strcmp(argv[1], "-disasm") == 0 && argc <= 4)
+        return disasm_file(argv[2], argc == 4 ? argv[3] : NULL);
+
+    uint64_t memory_size = MEMORY_SIZE;
+    bool batch = strcmp(argv[1], "-batch") == 0;
+    bool fuzz = strcmp(argv[1], "-fuzz") == 0;
+    uint64_t fuzz_seed = 1;
+    int num_threads = host_cpu_count();
+    uint64_t checkpoint_at = 0;
+    const char *checkpoint_file = NULL;
+    SimSampling sampling = {0};
+    bool sampled = false;
+    SimPipelineConfig pipe_config;
+    sim_default_pipeline(&pipe_config);
+    const char *pipe_trace_file = NULL;
+    const char *profile_file = NULL;
+    bool cosim = false;
+
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-v") == 0 && i + 1 < argc)
+            trace_verbosity = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            memory_size = parse_size(argv[++i]);
+            if (memory_size == 0 || memory_size > MEMORY_MAX_SIZE)
+                goto EXIT_FLAG;
+        }
+        else if (strcmp(argv[i], "-checkpoint") == 0 && i + 2 < argc && !batch)
+        {
+            checkpoint_at = strtoull(argv[++i], NULL, 0);
+            checkpoint_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-ff") == 0 && i + 1 < argc && !batch)
+        {
+            sampling.fast_forward = strtoull(argv[++i], NULL, 0);
+            sampled = true;
+        }
+        else if (strcmp(argv[i], "-sample") == 0 && i + 3 < argc && !batch)
+        {
+            sampling.period = strtoull(argv[++i], NULL, 0);
+            sampling.warmup = strtoull(argv[++i], NULL, 0);
+            sampling.measure = strtoull(argv[++i], NULL, 0);
+            if (sampling.period == 0 || sampling.measure == 0)
+                goto EXIT_FLAG;
+            sampled = true;
+        }
+        else if (strcmp(argv[i], "-pipe") == 0 && i + 1 < argc && !batch)
+        {
+            if (!parse_pipeline_spec(argv[++i], &pipe_config))
+                goto EXIT_FLAG;
+        }
+        else if (strcmp(argv[i], "-ptrace") == 0 && i + 1 < argc && !batch)
+            pipe_trace_file = argv[++i];
+        else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc && !batch)
+            profile_file = argv[++i];
+        else if (strcmp(argv[i], "-cosim") == 0 && !batch)
+            cosim = true;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && (batch || fuzz))
+        {
+            num_threads = atoi(argv[++i]);
+            if (num_threads < 1)
+                goto EXIT_FLAG;
+        }
+        else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc && fuzz)
+            fuzz_seed = strtoull(argv[++i], NULL, 0);
+        else
+            goto EXIT_FLAG;
+    }
+
+    if (batch)
+        return run_batch(argv[2], num_threads, (uint32_t)memory_size);
+    if (fuzz)
+        return run_fuzz(strtoull(argv[2], NULL, 0), fuzz_seed, num_threads, (uint32_t)memory_size, &pipe_config);
+
+    const char *filename = argv[1]; // Get the filename from the command-line argument
+    uint8_t mode = atoi(argv[2]);   // Get the mode to run
+
+    Simulator *sim = sim_create(mode, (uint32_t)memory_size, stdout);
+    if (sim == NULL)
+    {
+        printf("Error: Could not allocate the simulator.\n");
+        return 1;
+    }
+    if (sim_configure_pipeline(sim, &pipe_config) != SIM_OK)
+    {
+        sim_destroy(sim);
         goto EXIT_FLAG;
-        exit(1);
     }
+    if (pipe_trace_file != NULL && sim_set_pipe_trace(sim, pipe_trace_file) != SIM_OK)
+    {
+        printf("Error: Could not create the pipeline trace %s.\n", pipe_trace_file);
+        sim_destroy(sim);
+        return 1;
+    }
+    if (profile_file != NULL && sim_set_profiling(sim, 1) != SIM_OK)
+    {
+        printf("Error: Could not allocate the profiling counters.\n");
+        sim_destroy(sim);
+        return 1;
+    }
+    SimStatus cosim_status = cosim ? sim_set_cosim(sim, 1) : SIM_OK;
+    if (cosim_status != SIM_OK)
+    {
+        printf(cosim_status == SIM_ERR_CONFIG ? "Error: -cosim needs mode 1 or 2.\n" : "Error: Could not allocate the co-simulation model.\n");
+        sim_destroy(sim);
+        return 1;
+    }
+    SimStatus status;
+    int exit_status = run_to_completion(sim, filename, checkpoint_at, checkpoint_file, sampled ? &sampling : NULL, &status);
+    if (sim_set_pipe_trace(sim, NULL) != SIM_OK)
+        printf("Error: Could not write the pipeline trace %s.\n", pipe_trace_file);
+    if (profile_file != NULL)
+    {
+        size_t len = strlen(profile_file);
+        SimProfileFormat format = len >= 4 && strcmp(profile_file + len - 4, ".csv") == 0 ? SIM_PROFILE_CSV : SIM_PROFILE_JSON;
+        if (sim_write_profile(sim, profile_file, format) != SIM_OK)
+            printf("Error: Could not write the profile %s.\n", profile_file);
+    }
+    sim_destroy(sim);
+    if (exit_status < 0)
+        goto EXIT_FLAG;
+    return exit_status;
+}
 
-    printf("\n[WARN] Simulation ended without HALT.\n");
-    return 0;
-}
\ No newline at end of file
+#endif // MIPS_LITE_NO_MAIN
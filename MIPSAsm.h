@@ -0,0 +1,589 @@
+#ifndef MIPS_ASM_H
+#define MIPS_ASM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include "MIPSImage.h"
+
+// Assembler for the .s sources of mips_lite_gcc.py, run in-process so a
+// source can be loaded like any image. One instruction or directive per line:
+//
+//   [label:]... [MNEMONIC operands] [# comment]
+//
+// Operands are registers (R0..R31) and immediates, separated by commas or
+// spaces. An immediate is a decimal or 0x hex number, or a label: BZ and BEQ
+// take the word offset to it, other instructions its byte address. ".word"
+// followed by numbers or labels places data words. Labels are case-sensitive,
+// mnemonics are not.
+
+// Operands of each instruction format, in assembly order
+typedef enum AsmFormat
+{
+    ASM_NONE, // Unused opcode
+    ASM_R,    // rd, rt, rs
+    ASM_I,    // rt, rs, imm
+    ASM_BZ,   // rs, imm
+    ASM_BEQ,  // rs, rt, imm
+    ASM_JR,   // rs
+    ASM_HALT  // none
+} AsmFormat;
+
+typedef struct AsmOpcode
+{
+    const char *name;
+    uint8_t format; // AsmFormat
+} AsmOpcode;
+
+// Opcode table shared by the assembler, the disassembler,
+// get_instruction_name() and get_decode_str()
+static const AsmOpcode asm_opcodes[64] = {
+    [0x00] = {"ADD", ASM_R},
+    [0x01] = {"ADDI", ASM_I},
+    [0x02] = {"SUB", ASM_R},
+    [0x03] = {"SUBI", ASM_I},
+    [0x04] = {"MUL", ASM_R},
+    [0x05] = {"MULI", ASM_I},
+    [0x06] = {"OR", ASM_R},
+    [0x07] = {"ORI", ASM_I},
+    [0x08] = {"AND", ASM_R},
+    [0x09] = {"ANDI", ASM_I},
+    [0x0A] = {"XOR", ASM_R},
+    [0x0B] = {"XORI", ASM_I},
+    [0x0C] = {"LDW", ASM_I},
+    [0x0D] = {"STW", ASM_I},
+    [0x0E] = {"BZ", ASM_BZ},
+    [0x0F] = {"BEQ", ASM_BEQ},
+    [0x10] = {"JR", ASM_JR},
+    [0x11] = {"HALT", ASM_HALT},
+};
+
+#define ASM_MAX_ERRORS 20 // Printed; the rest are only counted
+
+typedef struct AsmLabel
+{
+    const char *name; // In the source, not terminated
+    uint32_t len;
+    uint32_t addr;
+} AsmLabel;
+
+typedef struct Assembler
+{
+    const char *filename;
+    FILE *err;
+    int line;
+    int errors;
+    bool resolve;      // Second pass: labels are all defined, operands are encoded
+    AsmLabel *labels;  // Open-addressed hash table, 'label_cap' a power of two
+    uint32_t label_cap;
+    uint32_t num_labels;
+    uint32_t *words;   // Second pass output
+    uint32_t num_words;
+} Assembler;
+
+void asm_error(Assembler *as, const char *format, ...)
+{
+    if (as->errors++ >= ASM_MAX_ERRORS)
+        return;
+    va_list args;
+    va_start(args, format);
+    fprintf(as->err, "\n[ERROR] %s:%d: ", as->filename, as->line);
+    vfprintf(as->err, format, args);
+    fprintf(as->err, "\n");
+    va_end(args);
+}
+
+// Mapped into the field with the other bits as mips_lite_gcc.py does, so its
+// images come out the same
+void asm_warn(Assembler *as, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fprintf(as->err, "\n[WARN] %s:%d: ", as->filename, as->line);
+    vfprintf(as->err, format, args);
+    fprintf(as->err, "\n");
+    va_end(args);
+}
+
+static inline bool asm_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == ',';
+}
+
+static inline bool asm_is_ident(char c, bool first)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_' || c == '.' || (!first && c >= '0' && c <= '9');
+}
+
+static inline const char *asm_skip(const char *p, const char *end)
+{
+    while (p < end && asm_is_space(*p))
+        p++;
+    return p;
+}
+
+static inline uint32_t asm_hash(const char *name, uint32_t len)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (uint32_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    return hash;
+}
+
+// Slot of the label, or of the empty entry where it belongs
+AsmLabel *asm_find_label(Assembler *as, const char *name, uint32_t len)
+{
+    uint32_t mask = as->label_cap - 1;
+    for (uint32_t i = asm_hash(name, len) & mask;; i = (i + 1) & mask)
+    {
+        AsmLabel *label = &as->labels[i];
+        if (label->name == NULL || (label->len == len && memcmp(label->name, name, len) == 0))
+            return label;
+    }
+}
+
+bool asm_define_label(Assembler *as, const char *name, uint32_t len, uint32_t addr)
+{
+    if ((as->num_labels + 1) * 2 > as->label_cap)
+    {
+        // Keep the table at most half full
+        AsmLabel *old = as->labels;
+        uint32_t old_cap = as->label_cap;
+        as->label_cap = old_cap ? old_cap * 2 : 256;
+        as->labels = calloc(as->label_cap, sizeof(AsmLabel));
+        if (as->labels == NULL)
+        {
+            as->labels = old;
+            as->label_cap = old_cap;
+            asm_error(as, "out of memory");
+            return false;
+        }
+        for (uint32_t i = 0; i < old_cap; i++)
+            if (old[i].name != NULL)
+                *asm_find_label(as, old[i].name, old[i].len) = old[i];
+        free(old);
+    }
+    AsmLabel *label = asm_find_label(as, name, len);
+    if (label->name != NULL)
+    {
+        asm_error(as, "label '%.*s' already defined", (int)len, name);
+        return false;
+    }
+    label->name = name;
+    label->len = len;
+    label->addr = addr;
+    as->num_labels++;
+    return true;
+}
+
+// Parses a register at *p into 'reg'; advances *p
+bool asm_register(Assembler *as, const char **p, const char *end, uint32_t *reg)
+{
+    const char *q = asm_skip(*p, end);
+    if (q == end || (*q != 'R' && *q != 'r' && *q != '$'))
+    {
+        asm_error(as, "register expected");
+        return false;
+    }
+    q++;
+    uint32_t value = 0;
+    const char *digits = q;
+    while (q < end && *q >= '0' && *q <= '9' && q - digits < 4)
+        value = value * 10 + (*q++ - '0');
+    if (q == digits || (q < end && !asm_is_space(*q)))
+    {
+        asm_error(as, "register expected");
+        return false;
+    }
+    if (value > 31)
+        asm_warn(as, "register R%u is out of range", value);
+    *reg = value;
+    *p = q;
+    return true;
+}
+
+// Parses a number or label at *p into 'value'; a label gives its address,
+// or the word offset to it from 'pc' if 'relative'. Advances *p.
+bool asm_immediate(Assembler *as, const char **p, const char *end, uint32_t pc, bool relative, int64_t *value)
+{
+    const char *q = asm_skip(*p, end);
+    const char *start = q;
+    if (q < end && asm_is_ident(*q, true))
+    {
+        while (q < end && asm_is_ident(*q, false))
+            q++;
+        *p = q;
+        if (!as->resolve)
+            return true;
+        AsmLabel *label = as->label_cap ? asm_find_label(as, start, q - start) : NULL;
+        if (label == NULL || label->name == NULL)
+        {
+            asm_error(as, "undefined label '%.*s'", (int)(q - start), start);
+            return false;
+        }
+        *value = relative ? ((int64_t)label->addr - pc) / 4 : label->addr;
+        return true;
+    }
+
+    bool negative = q < end && *q == '-';
+    if (q < end && (*q == '-' || *q == '+'))
+        q++;
+    int base = 10;
+    if (end - q > 2 && q[0] == '0' && (q[1] == 'x' || q[1] == 'X'))
+    {
+        base = 16;
+        q += 2;
+    }
+    const char *digits = q;
+    int64_t number = 0;
+    for (; q < end && number <= UINT32_MAX; q++)
+    {
+        int digit;
+        if (*q >= '0' && *q <= '9')
+            digit = *q - '0';
+        else if (base == 16 && (*q | 0x20) >= 'a' && (*q | 0x20) <= 'f')
+            digit = (*q | 0x20) - 'a' + 10;
+        else
+            break;
+        number = number * base + digit;
+    }
+    if (q == digits || (q < end && !asm_is_space(*q)))
+    {
+        if (as->resolve)
+            asm_error(as, "number or label expected");
+        return false;
+    }
+    *value = negative ? -number : number;
+    *p = q;
+    return true;
+}
+
+// The 16-bit immediate field of 'value'
+static inline uint32_t asm_imm16(Assembler *as, int64_t value)
+{
+    if (as->resolve && (value < -32768 || value > 65535))
+        asm_warn(as, "immediate %lld does not fit in 16 bits", (long long)value);
+    return (uint32_t)value & 0xFFFF;
+}
+
+static inline void asm_emit(Assembler *as, uint32_t word)
+{
+    if (as->resolve)
+        as->words[as->num_words] = word;
+    as->num_words++;
+}
+
+// Assembles one instruction named by the 'len' bytes at 'name'
+void asm_instruction(Assembler *as, const char *name, size_t len, const char *p, const char *end)
+{
+    int opcode = 0;
+    for (; opcode < 64; opcode++)
+    {
+        const char *op = asm_opcodes[opcode].name;
+        if (op != NULL && strlen(op) == len && strncasecmp(op, name, len) == 0)
+            break;
+    }
+    if (!as->resolve)
+    {
+        as->num_words++; // Reported and encoded by the second pass
+        return;
+    }
+    if (opcode == 64)
+    {
+        asm_error(as, "unknown instruction '%.*s'", (int)len, name);
+        asm_emit(as, 0);
+        return;
+    }
+
+    uint32_t pc = as->num_words * 4;
+    uint32_t word = (uint32_t)opcode << 26;
+    uint32_t rs = 0, rt = 0, rd = 0;
+    int64_t imm = 0;
+    bool ok = true;
+    switch (asm_opcodes[opcode].format)
+    {
+    case ASM_R:
+        ok = asm_register(as, &p, end, &rd) && asm_register(as, &p, end, &rt) && asm_register(as, &p, end, &rs);
+        word |= rs << 21 | rt << 16 | rd << 11;
+        break;
+    case ASM_I:
+        ok = asm_register(as, &p, end, &rt) && asm_register(as, &p, end, &rs) && asm_immediate(as, &p, end, pc, false, &imm);
+        word |= rs << 21 | rt << 16 | asm_imm16(as, imm);
+        break;
+    case ASM_BZ:
+        ok = asm_register(as, &p, end, &rs) && asm_immediate(as, &p, end, pc, true, &imm);
+        word |= rs << 21 | asm_imm16(as, imm);
+        break;
+    case ASM_BEQ:
+        ok = asm_register(as, &p, end, &rs) && asm_register(as, &p, end, &rt) && asm_immediate(as, &p, end, pc, true, &imm);
+        word |= rs << 21 | rt << 16 | asm_imm16(as, imm);
+        break;
+    case ASM_JR:
+        ok = asm_register(as, &p, end, &rs);
+        word |= rs << 21;
+        break;
+    }
+    if (ok && asm_skip(p, end) != end)
+    {
+        asm_error(as, "unexpected '%.*s'", (int)(end - asm_skip(p, end)), asm_skip(p, end));
+        ok = false;
+    }
+    asm_emit(as, word);
+}
+
+// One pass over the source: the first defines the labels and counts the
+// words, the second encodes them into as->words
+void asm_pass(Assembler *as, const char *data, size_t size)
+{
+    const char *end = data + size;
+    as->line = 0;
+    as->num_words = 0;
+    for (const char *p = data; p < end;)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *line_end = nl != NULL ? nl : end;
+        const char *comment = memchr(p, '#', line_end - p);
+        const char *stop = comment != NULL ? comment : line_end;
+        as->line++;
+
+        const char *q = asm_skip(p, stop);
+        while (q < stop && asm_is_ident(*q, true))
+        {
+            const char *name = q;
+            while (q < stop && asm_is_ident(*q, false))
+                q++;
+            if (q < stop && *q == ':')
+            {
+                if (!as->resolve)
+                    asm_define_label(as, name, q - name, as->num_words * 4);
+                q = asm_skip(q + 1, stop);
+                continue;
+            }
+            if (q - name == 5 && strncasecmp(name, ".word", 5) == 0)
+            {
+                while (asm_skip(q, stop) != stop)
+                {
+                    int64_t value = 0;
+                    if (!asm_immediate(as, &q, stop, as->num_words * 4, false, &value))
+                        break;
+                    asm_emit(as, (uint32_t)value);
+                }
+            }
+            else
+                asm_instruction(as, name, q - name, q, stop);
+            q = stop;
+        }
+        if (as->resolve && asm_skip(q, stop) != stop)
+            asm_error(as, "unexpected '%c'", *asm_skip(q, stop));
+        p = line_end + 1;
+    }
+}
+
+// Assembles a source held in memory. Returns the words, to be freed by the
+// caller, and their number in 'num_words'; NULL after printing the errors
+// to 'err'.
+uint32_t *asm_assemble(const char *data, size_t size, const char *filename, FILE *err, uint32_t *num_words)
+{
+    Assembler as = {0};
+    as.filename = filename;
+    as.err = err;
+    asm_pass(&as, data, size);
+    as.words = malloc((as.num_words ? as.num_words : 1) * sizeof(uint32_t));
+    if (as.words == NULL)
+        asm_error(&as, "out of memory");
+    else
+    {
+        as.resolve = true;
+        asm_pass(&as, data, size);
+    }
+    free(as.labels);
+    if (as.errors > ASM_MAX_ERRORS)
+        fprintf(err, "\n[ERROR] %s: %d more errors\n", filename, as.errors - ASM_MAX_ERRORS);
+    if (as.errors > 0)
+    {
+        free(as.words);
+        return NULL;
+    }
+    *num_words = as.num_words;
+    return as.words;
+}
+
+// Loads an assembled source into words 0.. of 'm'. Returns the number of
+// words, or -1 after printing the errors, or if it does not fit in 'm', and
+// MEM_ERR_NOMEM if a page cannot be allocated.
+int asm_load(Memory *m, const char *data, size_t size, const char *filename, FILE *err)
+{
+    uint32_t num_words;
+    uint32_t *words = asm_assemble(data, size, filename, err, &num_words);
+    if (words == NULL)
+        return -1;
+    if (num_words > m->size / 4)
+    {
+        fprintf(err, "\n[ERROR] %s: %u words do not fit in the memory\n", filename, num_words);
+        free(words);
+        return -1;
+    }
+    for (uint32_t i = 0; i < num_words; i++)
+    {
+        if (!mem_write(m, i * 4, words[i]))
+        {
+            free(words);
+            return MEM_ERR_NOMEM;
+        }
+    }
+    free(words);
+    return num_words;
+}
+
+// Whether 'filename' names an assembly source, by its .s or .asm extension
+bool asm_is_source(const char *filename)
+{
+    const char *dot = strrchr(filename, '.');
+    return dot != NULL && (strcmp(dot, ".s") == 0 || strcmp(dot, ".asm") == 0);
+}
+
+// Writes 'word' as assembly text that asm_assemble() reads back, in the
+// syntax of mips_lite_gcc.py decode; unused opcodes become .word
+const char *asm_disassemble(uint32_t word, char *text, size_t len)
+{
+    uint8_t opcode = word >> 26;
+    uint32_t rs = (word >> 21) & 0x1F;
+    uint32_t rt = (word >> 16) & 0x1F;
+    uint32_t rd = (word >> 11) & 0x1F;
+    int16_t imm = word & 0xFFFF;
+    const char *name = asm_opcodes[opcode].name;
+    switch (asm_opcodes[opcode].format)
+    {
+    case ASM_R:
+        snprintf(text, len, "%s R%u, R%u, R%u", name, rd, rt, rs);
+        break;
+    case ASM_I:
+        snprintf(text, len, "%s R%u, R%u, %d", name, rt, rs, imm);
+        break;
+    case ASM_BZ:
+        snprintf(text, len, "%s R%u, %d", name, rs, imm);
+        break;
+    case ASM_BEQ:
+        snprintf(text, len, "%s R%u, R%u, %d", name, rs, rt, imm);
+        break;
+    case ASM_JR:
+        snprintf(text, len, "%s R%u", name, rs);
+        break;
+    case ASM_HALT:
+        snprintf(text, len, "%s", name);
+        break;
+    default:
+        snprintf(text, len, ".word 0x%08X", word);
+        break;
+    }
+    return text;
+}
+
+// Output name of the command-line tools: 'filename' with its extension
+// replaced by 'extension'
+char *asm_output_name(const char *filename, const char *extension)
+{
+    const char *dot = strrchr(filename, '.');
+    const char *slash = strrchr(filename, '/');
+    size_t stem = dot != NULL && (slash == NULL || dot > slash) ? (size_t)(dot - filename) : strlen(filename);
+    char *name = malloc(stem + strlen(extension) + 1);
+    if (name != NULL)
+    {
+        memcpy(name, filename, stem);
+        strcpy(name + stem, extension);
+    }
+    return name;
+}
+
+// Output file of the command-line tools: a copy of 'output', or the one
+// asm_output_name() derives from 'input' if NULL
+char *asm_output_file(const char *output, const char *input, const char *extension)
+{
+    if (output == NULL)
+        return asm_output_name(input, extension);
+    size_t length = strlen(output) + 1;
+    char *name = malloc(length);
+    if (name != NULL)
+        memcpy(name, output, length);
+    return name;
+}
+
+// -asm: assembles 'source' into a hex text image at 'output' (the source
+// name with .o if NULL). Returns the exit status.
+int asm_file(const char *source, const char *output)
+{
+    size_t size;
+    char *data = map_file(source, &size);
+    if (data == NULL)
+    {
+        printf("Error: Could not open %s.\n", source);
+        return 1;
+    }
+    uint32_t num_words;
+    uint32_t *words = asm_assemble(data, size, source, stdout, &num_words);
+    unmap_file(data, size);
+    if (words == NULL)
+        return 1;
+
+    char *name = asm_output_file(output, source, ".o");
+    FILE *file = name != NULL ? fopen(name, "w") : NULL;
+    bool ok = file != NULL;
+    for (uint32_t i = 0; ok && i < num_words; i++)
+        ok = fprintf(file, "%08X\n", words[i]) > 0;
+    if (file != NULL && fclose(file) != 0)
+        ok = false;
+    if (ok)
+        printf("Assembled %u words to %s\n", num_words, name);
+    else
+        printf("Error: Could not write %s.\n", name != NULL ? name : source);
+    free(words);
+    free(name);
+    return ok ? 0 : 1;
+}
+
+// -disasm: writes a hex text image back as assembly at 'output' (the image
+// name with .s if NULL); blank and '#' comment lines are copied. Returns the
+// exit status.
+int disasm_file(const char *image, const char *output)
+{
+    size_t size;
+    char *data = map_file(image, &size);
+    if (data == NULL)
+    {
+        printf("Error: Could not open %s.\n", image);
+        return 1;
+    }
+    char *name = asm_output_file(output, image, ".s");
+    FILE *file = name != NULL ? fopen(name, "w") : NULL;
+    bool ok = file != NULL;
+    const char *end = data + size;
+    for (const char *p = data; ok && p < end;)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *line_end = nl != NULL ? nl : end;
+        const char *q = p;
+        while (q < line_end && (*q == ' ' || *q == '\t' || *q == '\r'))
+            q++;
+        char text[48];
+        if (q == line_end || *q == '#')
+            ok = fprintf(file, "%.*s\n", (int)(line_end - p), p) >= 0;
+        else
+            ok = fprintf(file, "%s\n", asm_disassemble(hex_parse_line(p, line_end), text, sizeof(text))) > 0;
+        p = line_end + 1;
+    }
+    if (file != NULL && fclose(file) != 0)
+        ok = false;
+    unmap_file(data, size);
+    if (ok)
+        printf("Disassembled to %s\n", name);
+    else
+        printf("Error: Could not write %s.\n", name != NULL ? name : image);
+    free(name);
+    return ok ? 0 : 1;
+}
+
+#endif // MIPS_ASM_H
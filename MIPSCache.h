@@ -0,0 +1,227 @@
+#ifndef MIPS_CACHE_H
+#define MIPS_CACHE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "MIPSLite.h"
+
+// Timing model of a set-associative cache. Only the tags and the replacement
+// state are kept; the data stays in Memory, so a cache decides how long an
+// access takes, never what it returns. The per-line state is held as
+// struct-of-arrays indexed by set * ways + way, so a lookup compares the
+// tags of a set in one branch-free loop.
+#define CACHE_MAX_WAYS 32
+#define CACHE_INVALID UINT32_MAX // Tag of an empty line; line addresses are at most 30 bits
+
+typedef struct Cache
+{
+    uint32_t num_sets; // 0 when the cache is disabled
+    uint8_t ways;
+    uint8_t line_bits;
+    uint8_t policy;      // SimCachePolicy
+    bool write_back;     // Write-back and write-allocate, else write-through without allocation
+    uint8_t miss_latency;
+    uint32_t *tags;      // Line address (addr >> line_bits), CACHE_INVALID if empty
+    uint8_t *dirty;
+    uint8_t *age;        // SIM_CACHE_LRU: 0 for the most recently used way of the set
+    uint32_t *plru;      // SIM_CACHE_PLRU: tree bits of each set, node n at bit n (1..ways-1)
+
+    int64_t reads;
+    int64_t writes;
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+    int64_t writebacks;   // Dirty lines evicted
+    int64_t stall_cycles; // Cycles added by misses and write-backs
+} Cache;
+
+// Number of lines of a configured cache
+static inline uint32_t cache_lines(const Cache *c)
+{
+    return c->num_sets * c->ways;
+}
+
+void cache_free(Cache *c)
+{
+    free(c->tags);
+    free(c->dirty);
+    free(c->age);
+    free(c->plru);
+    memset(c, 0, sizeof(*c));
+}
+
+// Empties every line and clears the counters
+void cache_reset(Cache *c)
+{
+    uint32_t lines = cache_lines(c);
+    for (uint32_t i = 0; i < lines; i++)
+    {
+        c->tags[i] = CACHE_INVALID;
+        c->age[i] = i % c->ways;
+    }
+    if (lines > 0)
+    {
+        memset(c->dirty, 0, lines);
+        memset(c->plru, 0, c->num_sets * sizeof(uint32_t));
+    }
+    c->reads = 0;
+    c->writes = 0;
+    c->hits = 0;
+    c->misses = 0;
+    c->evictions = 0;
+    c->writebacks = 0;
+    c->stall_cycles = 0;
+}
+
+static inline bool is_power_of_two(int value)
+{
+    return value > 0 && (value & (value - 1)) == 0;
+}
+
+// Checks the parameters of 'config' without touching any cache
+bool cache_config_valid(const SimCacheConfig *config)
+{
+    if (config->size == 0)
+        return true;
+    return is_power_of_two(config->size) && is_power_of_two(config->line_size) && config->line_size >= 4 &&
+           is_power_of_two(config->ways) && config->ways <= CACHE_MAX_WAYS &&
+           config->size >= config->line_size * config->ways &&
+           config->policy >= 0 && config->policy < SIM_NUM_CACHE_POLICIES &&
+           (config->write_back == 0 || config->write_back == 1) &&
+           config->miss_latency >= 0 && config->miss_latency <= SIM_CACHE_MAX_LATENCY;
+}
+
+// Replaces 'c' with an empty cache built from a valid 'config'. Returns false,
+// leaving 'c' as it was, if the arrays cannot be allocated.
+bool cache_configure(Cache *c, const SimCacheConfig *config)
+{
+    Cache next = {0};
+    if (config->size > 0)
+    {
+        next.ways = config->ways;
+        next.num_sets = config->size / (config->line_size * config->ways);
+        next.line_bits = __builtin_ctz(config->line_size);
+        next.policy = config->policy;
+        next.write_back = config->write_back;
+        next.miss_latency = config->miss_latency;
+        uint32_t lines = cache_lines(&next);
+        next.tags = malloc(lines * sizeof(uint32_t));
+        next.dirty = malloc(lines);
+        next.age = malloc(lines);
+        next.plru = malloc(next.num_sets * sizeof(uint32_t));
+        if (next.tags == NULL || next.dirty == NULL || next.age == NULL || next.plru == NULL)
+        {
+            cache_free(&next);
+            return false;
+        }
+    }
+    cache_free(c);
+    *c = next;
+    cache_reset(c);
+    return true;
+}
+
+// Marks 'way' of 'set' as the most recently used one
+static inline void cache_touch(Cache *c, uint32_t set, int way)
+{
+    if (c->policy == SIM_CACHE_LRU)
+    {
+        uint8_t *age = &c->age[set * c->ways];
+        uint8_t touched = age[way];
+        for (int w = 0; w < c->ways; w++)
+            age[w] += age[w] < touched;
+        age[way] = 0;
+    }
+    else
+    {
+        // Each node on the way's path points to the other half
+        uint32_t bits = c->plru[set];
+        int node = 1;
+        for (int half = c->ways / 2; half > 0; half /= 2)
+        {
+            int right = (way & half) != 0;
+            bits = right ? bits & ~(1u << node) : bits | (1u << node);
+            node = 2 * node + right;
+        }
+        c->plru[set] = bits;
+    }
+}
+
+// Way of 'set' to refill: an empty one if any, else the policy's choice
+static inline int cache_victim(Cache *c, uint32_t set)
+{
+    const uint32_t *tags = &c->tags[set * c->ways];
+    for (int w = 0; w < c->ways; w++)
+        if (tags[w] == CACHE_INVALID)
+            return w;
+    if (c->policy == SIM_CACHE_LRU)
+    {
+        const uint8_t *age = &c->age[set * c->ways];
+        int victim = 0;
+        for (int w = 1; w < c->ways; w++)
+            if (age[w] > age[victim])
+                victim = w;
+        return victim;
+    }
+    int node = 1;
+    int way = 0;
+    for (int half = c->ways / 2; half > 0; half /= 2)
+    {
+        int right = (c->plru[set] >> node) & 1;
+        way |= right ? half : 0;
+        node = 2 * node + right;
+    }
+    return way;
+}
+
+// Reads or writes the word at 'addr' and returns the cycles the access adds
+// to a hit: the miss latency, plus as much again to write back a dirty line
+// it evicts. Write-through stores go to memory through a write buffer and
+// never wait.
+uint32_t cache_access(Cache *c, uint32_t addr, bool write)
+{
+    uint32_t line = addr >> c->line_bits;
+    uint32_t set = line & (c->num_sets - 1);
+    uint32_t *tags = &c->tags[set * c->ways];
+    if (write)
+        c->writes++;
+    else
+        c->reads++;
+
+    uint32_t hit_ways = 0;
+    for (int w = 0; w < c->ways; w++)
+        hit_ways |= (uint32_t)(tags[w] == line) << w;
+    if (hit_ways != 0)
+    {
+        int way = __builtin_ctz(hit_ways);
+        c->hits++;
+        cache_touch(c, set, way);
+        if (write && c->write_back)
+            c->dirty[set * c->ways + way] = 1;
+        return 0;
+    }
+
+    c->misses++;
+    if (write && !c->write_back)
+        return 0;
+    int way = cache_victim(c, set);
+    uint32_t cycles = c->miss_latency;
+    if (tags[way] != CACHE_INVALID)
+    {
+        c->evictions++;
+        if (c->dirty[set * c->ways + way])
+        {
+            c->writebacks++;
+            cycles += c->miss_latency;
+        }
+    }
+    tags[way] = line;
+    c->dirty[set * c->ways + way] = write;
+    cache_touch(c, set, way);
+    c->stall_cycles += cycles;
+    return cycles;
+}
+
+#endif // MIPS_CACHE_H
@@ -0,0 +1,478 @@
+#ifndef MIPS_CHECKPOINT_H
+#define MIPS_CHECKPOINT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "MIPSDataStructure.h"
+#include "MIPSImage.h"
+
+// Checkpoint of a whole simulation: PC, registers, flags, counters, the
+// pipeline latches, the branch predictor, the caches and every allocated
+// memory page. All fields and words are little-endian.
+//
+//   CheckpointHeader
+//   state words, CHECKPOINT_STATE_WORDS of them (see checkpoint_state())
+//   cache words, as many as the configured caches need (see checkpoint_caches())
+//   CheckpointPage[num_pages]
+//   page data, MEM_PAGE_SIZE bytes per page, starting on a MEM_PAGE_SIZE
+//   boundary of the file
+//
+// Like binary images, the page data is mapped copy-on-write on restore rather
+// than read, so restoring a large memory only costs the page table.
+#define CHECKPOINT_MAGIC "MIPC"
+#define CHECKPOINT_VERSION 10
+
+typedef struct CheckpointHeader
+{
+    char magic[4];        // CHECKPOINT_MAGIC
+    uint32_t version;     // CHECKPOINT_VERSION
+    uint32_t state_words; // CHECKPOINT_STATE_WORDS
+    uint32_t num_pages;
+    uint32_t data_offset; // File offset of the first page, multiple of MEM_PAGE_SIZE
+    uint32_t cache_words;
+    uint32_t reserved[2];
+} CheckpointHeader;
+
+typedef struct CheckpointPage
+{
+    uint32_t page_num;
+    uint32_t modified[MEM_PAGE_WORDS / 32]; // MemPage.modified
+} CheckpointPage;
+
+#define CHECKPOINT_STATE_WORDS (57 + SIM_NUM_OP_CLASSES + 2 * NUM_REGISTERS + PIPELINE_MAX_DEPTH * 18 + \
+                                (1 << BP_MAX_BITS) / 16 + 2 * (1 << BTB_MAX_BITS))
+
+// Copies 'field' to (save) or from (restore) the word at 'cursor', so both
+// directions share a single field list
+#define CHECKPOINT_FIELD(field)                                      \
+    do                                                               \
+    {                                                                \
+        if (save)                                                    \
+            *cursor = image_le32((uint32_t)(field));                 \
+        else                                                         \
+            (field) = (__typeof__(field))image_le32(*cursor);        \
+        cursor++;                                                    \
+    } while (0)
+
+// CHECKPOINT_FIELD() of a 64-bit counter, low word first
+#define CHECKPOINT_FIELD64(field)                        \
+    do                                                   \
+    {                                                    \
+        uint32_t low = (uint64_t)(field);                \
+        uint32_t high = (uint64_t)(field) >> 32;         \
+        CHECKPOINT_FIELD(low);                           \
+        CHECKPOINT_FIELD(high);                          \
+        (field) = (int64_t)((uint64_t)high << 32 | low); \
+    } while (0)
+
+// CHECKPOINT_FIELD() of a bit-field, through a word
+#define CHECKPOINT_BITFIELD(field) \
+    do                             \
+    {                              \
+        uint32_t value = (field);  \
+        CHECKPOINT_FIELD(value);   \
+        (field) = value;           \
+    } while (0)
+
+#define CHECKPOINT_CACHE_CONFIG(config)          \
+    do                                           \
+    {                                            \
+        CHECKPOINT_FIELD((config).size);         \
+        CHECKPOINT_FIELD((config).ways);         \
+        CHECKPOINT_FIELD((config).line_size);    \
+        CHECKPOINT_FIELD((config).policy);       \
+        CHECKPOINT_FIELD((config).write_back);   \
+        CHECKPOINT_FIELD((config).miss_latency); \
+    } while (0)
+
+// Copies the scalar state of 'sim' to (save) or from (restore) 'words', one
+// word per field. Returns the number of words, which must be
+// CHECKPOINT_STATE_WORDS: checkpoint_save() refuses to write any other.
+uint32_t checkpoint_state(Simulator *sim, uint32_t *words, bool save)
+{
+    uint32_t *cursor = words;
+
+    CHECKPOINT_FIELD(sim->PC);
+    CHECKPOINT_FIELD(sim->mode);
+    CHECKPOINT_FIELD(sim->halt_seen);
+    CHECKPOINT_FIELD(sim->branch_taken);
+    CHECKPOINT_FIELD(sim->branch_delay);
+    CHECKPOINT_FIELD(sim->hazard_cnt);
+    CHECKPOINT_FIELD(sim->ex_hold);
+    CHECKPOINT_FIELD(sim->mem_hold);
+    CHECKPOINT_FIELD(sim->stages_done);
+    CHECKPOINT_FIELD(sim->next_pc);
+    CHECKPOINT_FIELD(sim->fetch_seq);
+    CHECKPOINT_FIELD(sim->pipe.stage_id);
+    for (int i = 0; i < SIM_NUM_OP_CLASSES; i++)
+        CHECKPOINT_FIELD(sim->pipe.latency[i]);
+    CHECKPOINT_FIELD(sim->pipe.forwarding);
+    CHECKPOINT_FIELD(sim->pipe.predictor);
+    CHECKPOINT_FIELD(sim->pipe.predictor_bits);
+    CHECKPOINT_FIELD(sim->pipe.history_bits);
+    CHECKPOINT_FIELD(sim->pipe.btb_bits);
+    CHECKPOINT_CACHE_CONFIG(sim->pipe.dcache);
+    CHECKPOINT_CACHE_CONFIG(sim->pipe.icache);
+    CHECKPOINT_FIELD(sim->fetch_hold);
+    CHECKPOINT_FIELD(sim->status);
+    CHECKPOINT_FIELD64(sim->total_instructions);
+    CHECKPOINT_FIELD64(sim->arithmetic_count);
+    CHECKPOINT_FIELD64(sim->logical_count);
+    CHECKPOINT_FIELD64(sim->memory_count);
+    CHECKPOINT_FIELD64(sim->control_count);
+    CHECKPOINT_FIELD64(sim->total_stalls);
+    CHECKPOINT_FIELD64(sim->total_cycles);
+    CHECKPOINT_FIELD64(sim->ff_instructions);
+    CHECKPOINT_FIELD(sim->words_read);
+    CHECKPOINT_FIELD(sim->entry_pc);
+    CHECKPOINT_FIELD(sim->memory.size);
+    for (int i = 0; i < NUM_REGISTERS; i++)
+    {
+        CHECKPOINT_FIELD(sim->registers[i]);
+        CHECKPOINT_FIELD(sim->modified_registers[i]);
+    }
+    for (int i = 0; i < PIPELINE_MAX_DEPTH; i++)
+    {
+        // Latches past the configured depth are not kept, and saved empty
+        PipelineStage unused = {0};
+        PipelineStage *stage = i < sim->pipe.depth ? &sim->pipeline[i] : &unused;
+        CHECKPOINT_FIELD(stage->pc);
+        CHECKPOINT_FIELD(stage->predicted_pc);
+        CHECKPOINT_FIELD(stage->seq);
+        CHECKPOINT_FIELD(stage->raw.instruction);
+        CHECKPOINT_BITFIELD(stage->decoded.opcode);
+        CHECKPOINT_FIELD(stage->decoded.rs);
+        CHECKPOINT_FIELD(stage->decoded.rt);
+        CHECKPOINT_FIELD(stage->decoded.rd);
+        CHECKPOINT_FIELD(stage->decoded.imm);
+        CHECKPOINT_BITFIELD(stage->decoded.R_or_I_type);
+        CHECKPOINT_FIELD(stage->alu_result);
+        CHECKPOINT_FIELD(stage->mem_result);
+        CHECKPOINT_BITFIELD(stage->valid);
+        CHECKPOINT_BITFIELD(stage->isStall);
+        for (int j = 0; j < 4; j++)
+        {
+            uint32_t flag = stage->frwd_flags >> j & 1;
+            CHECKPOINT_FIELD(flag);
+            stage->frwd_flags = (stage->frwd_flags & ~FRWD_BIT(j)) | (flag & 1) << j;
+        }
+    }
+
+    BranchPredictor *bp = &sim->predictor;
+    CHECKPOINT_FIELD(bp->history);
+    CHECKPOINT_FIELD64(bp->branches);
+    CHECKPOINT_FIELD64(bp->mispredictions);
+    CHECKPOINT_FIELD64(bp->penalty_cycles);
+    // Sixteen 2-bit counters per word
+    for (int i = 0; i < (1 << BP_MAX_BITS); i += 16)
+    {
+        uint32_t packed = 0;
+        for (int j = 0; j < 16; j++)
+            packed |= (uint32_t)(bp->counters[i + j] & 3) << (2 * j);
+        CHECKPOINT_FIELD(packed);
+        for (int j = 0; j < 16; j++)
+            bp->counters[i + j] = (packed >> (2 * j)) & 3;
+    }
+    for (int i = 0; i < (1 << BTB_MAX_BITS); i++)
+    {
+        CHECKPOINT_FIELD(bp->btb_pc[i]);
+        CHECKPOINT_FIELD(bp->btb_target[i]);
+    }
+    return cursor - words;
+}
+
+// Words checkpoint_caches() copies for the caches of 'sim'
+uint32_t checkpoint_cache_words(Simulator *sim)
+{
+    Cache *caches[2] = {&sim->dcache, &sim->icache};
+    uint32_t words = 0;
+    for (int i = 0; i < 2; i++)
+        words += 14 + 2 * cache_lines(caches[i]) + caches[i]->num_sets;
+    return words;
+}
+
+// Copies the counters, tags and replacement state of the caches like
+// checkpoint_state(); the caches of 'sim' must have the checkpoint's geometry
+void checkpoint_caches(Simulator *sim, uint32_t *words, bool save)
+{
+    uint32_t *cursor = words;
+    Cache *caches[2] = {&sim->dcache, &sim->icache};
+    for (int i = 0; i < 2; i++)
+    {
+        Cache *c = caches[i];
+        CHECKPOINT_FIELD64(c->reads);
+        CHECKPOINT_FIELD64(c->writes);
+        CHECKPOINT_FIELD64(c->hits);
+        CHECKPOINT_FIELD64(c->misses);
+        CHECKPOINT_FIELD64(c->evictions);
+        CHECKPOINT_FIELD64(c->writebacks);
+        CHECKPOINT_FIELD64(c->stall_cycles);
+        for (uint32_t line = 0; line < cache_lines(c); line++)
+        {
+            uint32_t flags = c->dirty[line] | (uint32_t)c->age[line] << 8;
+            CHECKPOINT_FIELD(c->tags[line]);
+            CHECKPOINT_FIELD(flags);
+            c->dirty[line] = flags & 1;
+            c->age[line] = flags >> 8;
+        }
+        for (uint32_t set = 0; set < c->num_sets; set++)
+            CHECKPOINT_FIELD(c->plru[set]);
+    }
+}
+#undef CHECKPOINT_CACHE_CONFIG
+#undef CHECKPOINT_BITFIELD
+#undef CHECKPOINT_FIELD64
+#undef CHECKPOINT_FIELD
+
+bool is_checkpoint_file(const char *filename)
+{
+    char magic[4];
+    FILE *file = fopen(filename, "rb");
+    bool found = file != NULL && fread(magic, 1, 4, file) == 4 && memcmp(magic, CHECKPOINT_MAGIC, 4) == 0;
+    if (file != NULL)
+        fclose(file);
+    return found;
+}
+
+// Writes 'sim' to a checkpoint file. Returns false if it cannot be written.
+// The file is written as <filename>.tmp and renamed over 'filename' once
+// complete, so a failed save leaves any earlier file intact, and a run
+// resumed from 'filename' can save back to it while its pages are mapped.
+bool checkpoint_save(Simulator *sim, const char *filename)
+{
+    size_t length = strlen(filename) + sizeof(".tmp");
+    char *tmp_name = malloc(length);
+    if (tmp_name == NULL)
+        return false;
+    snprintf(tmp_name, length, "%s.tmp", filename);
+    FILE *file = fopen(tmp_name, "wb");
+    if (file == NULL)
+    {
+        free(tmp_name);
+        return false;
+    }
+
+    uint32_t num_pages = 0;
+    for (uint32_t i = 0; i < MEM_L1_ENTRIES; i++)
+        for (uint32_t j = 0; sim->memory.l1[i] != NULL && j < MEM_L2_ENTRIES; j++)
+            num_pages += sim->memory.l1[i][j] != NULL;
+
+    uint32_t cache_words = checkpoint_cache_words(sim);
+    uint64_t table_end = sizeof(CheckpointHeader) + (CHECKPOINT_STATE_WORDS + (uint64_t)cache_words) * 4 +
+                         (uint64_t)num_pages * sizeof(CheckpointPage);
+    uint32_t data_offset = (table_end + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE * MEM_PAGE_SIZE;
+
+    CheckpointHeader header = {0};
+    memcpy(header.magic, CHECKPOINT_MAGIC, 4);
+    header.version = image_le32(CHECKPOINT_VERSION);
+    header.state_words = image_le32(CHECKPOINT_STATE_WORDS);
+    header.num_pages = image_le32(num_pages);
+    header.data_offset = image_le32(data_offset);
+    header.cache_words = image_le32(cache_words);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    uint32_t state[CHECKPOINT_STATE_WORDS];
+    ok = ok && checkpoint_state(sim, state, true) == CHECKPOINT_STATE_WORDS;
+    ok = ok && fwrite(state, sizeof(state), 1, file) == 1;
+    uint32_t *cache_state = malloc(cache_words * sizeof(uint32_t));
+    ok = ok && cache_state != NULL;
+    if (ok)
+    {
+        checkpoint_caches(sim, cache_state, true);
+        ok = fwrite(cache_state, sizeof(uint32_t), cache_words, file) == cache_words;
+    }
+    free(cache_state);
+
+    // Page table, then the pages in the same (address) order
+    for (int pass = 0; pass < 2 && ok; pass++)
+    {
+        if (pass == 1)
+        {
+            static const char zeros[MEM_PAGE_SIZE];
+            ok = fwrite(zeros, 1, data_offset - table_end, file) == data_offset - table_end;
+        }
+        for (uint32_t i = 0; i < MEM_L1_ENTRIES && ok; i++)
+        {
+            for (uint32_t j = 0; sim->memory.l1[i] != NULL && j < MEM_L2_ENTRIES && ok; j++)
+            {
+                MemPage *page = sim->memory.l1[i][j];
+                if (page == NULL)
+                    continue;
+                if (pass == 0)
+                {
+                    CheckpointPage entry;
+                    entry.page_num = image_le32((i << MEM_L2_BITS) | j);
+                    for (uint32_t w = 0; w < MEM_PAGE_WORDS / 32; w++)
+                        entry.modified[w] = image_le32(page->modified[w]);
+                    ok = fwrite(&entry, sizeof(entry), 1, file) == 1;
+                }
+                else
+                {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                    uint32_t words[MEM_PAGE_WORDS];
+                    for (uint32_t w = 0; w < MEM_PAGE_WORDS; w++)
+                        words[w] = image_le32(page->words[w]);
+                    ok = fwrite(words, MEM_PAGE_SIZE, 1, file) == 1;
+#else
+                    ok = fwrite(page->words, MEM_PAGE_SIZE, 1, file) == 1;
+#endif
+                }
+            }
+        }
+    }
+
+    ok = fflush(file) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+#if defined(_WIN32)
+    if (ok)
+        remove(filename); // rename() does not replace an existing file there
+#endif
+    ok = ok && rename(tmp_name, filename) == 0;
+    if (!ok)
+        remove(tmp_name);
+    free(tmp_name);
+    return ok;
+}
+
+// Whether the state decoded into 'restored' fits 'sim', which keeps its own
+// pipeline model. Values that size allocations, index arrays or count down
+// loops are range-checked; the error is printed if not.
+bool checkpoint_state_valid(Simulator *sim, Simulator *restored, bool same_pipe)
+{
+    const char *error = NULL;
+    if (restored->memory.size == 0 || restored->memory.size > MEMORY_MAX_SIZE || restored->words_read <= 0 ||
+        (uint64_t)restored->words_read * 4 > restored->memory.size)
+        error = "image size";
+    else if ((int)restored->status < SIM_OK || (int)restored->status > SIM_ERR_COSIM)
+        error = "status";
+    else if (restored->branch_delay > sim->pipe.stage_id || restored->ex_hold > PIPELINE_MAX_LATENCY ||
+             restored->mem_hold > PIPELINE_MAX_LATENCY + 2 * SIM_CACHE_MAX_LATENCY ||
+             restored->fetch_hold > SIM_CACHE_MAX_LATENCY + 1)
+        error = "pipeline hold";
+    // Latch registers index the register file and the scoreboard; dst itself
+    // is not saved, scoreboard_rebuild() derives it from them
+    for (int i = 0; i < sim->pipe.depth && error == NULL; i++)
+    {
+        R_I_type *decoded = &restored->pipeline[i].decoded;
+        if (decoded->rs >= NUM_REGISTERS || decoded->rt >= NUM_REGISTERS || decoded->rd >= NUM_REGISTERS)
+            error = "pipeline latch";
+    }
+    if (error != NULL)
+    {
+        fprintf(sim->out, "Error: Malformed checkpoint (%s).\n", error);
+        return false;
+    }
+
+    if ((sim->mode == 1 || sim->mode == 2) && restored->mode == sim->mode && !same_pipe)
+    {
+        fprintf(sim->out, "Error: Checkpoint taken with a different pipeline configuration.\n");
+        return false;
+    }
+    // Pipeline latches only make sense to the model that filled them; a
+    // functional checkpoint starts any model with an empty pipeline
+    if (restored->mode != sim->mode && (restored->mode == 1 || restored->mode == 2))
+    {
+        fprintf(sim->out, "Error: Checkpoint taken in mode %d can only be restored in that mode.\n", restored->mode);
+        return false;
+    }
+    return true;
+}
+
+// Restores a mapped checkpoint into 'sim', whose memory must be empty. The
+// data address space takes the size it had when the checkpoint was saved. On
+// success the mapping is owned by sim->memory and SIM_OK is returned; on a
+// malformed checkpoint an error is printed and SIM_ERR_LOAD returned, and
+// SIM_ERR_NOMEM if a page cannot be allocated.
+SimStatus checkpoint_restore(Simulator *sim, void *data, size_t size)
+{
+    const CheckpointHeader *header = data;
+    if (size < sizeof(CheckpointHeader) || memcmp(header->magic, CHECKPOINT_MAGIC, 4) != 0)
+    {
+        fprintf(sim->out, "Error: Not a checkpoint.\n");
+        return SIM_ERR_LOAD;
+    }
+    uint32_t num_pages = image_le32(header->num_pages);
+    uint32_t data_offset = image_le32(header->data_offset);
+    uint32_t cache_words = image_le32(header->cache_words);
+    uint64_t table_end = sizeof(CheckpointHeader) + (CHECKPOINT_STATE_WORDS + (uint64_t)cache_words) * 4 +
+                         (uint64_t)num_pages * sizeof(CheckpointPage);
+    if (image_le32(header->version) != CHECKPOINT_VERSION ||
+        image_le32(header->state_words) != CHECKPOINT_STATE_WORDS ||
+        data_offset % MEM_PAGE_SIZE != 0 || data_offset < table_end || data_offset > size ||
+        (size - data_offset) / MEM_PAGE_SIZE < num_pages)
+    {
+        fprintf(sim->out, "Error: Unsupported or truncated checkpoint.\n");
+        return SIM_ERR_LOAD;
+    }
+
+    // Decoded into a scratch copy first, so that a rejected checkpoint leaves
+    // 'sim' as it was
+    const uint32_t *state = (const uint32_t *)(header + 1);
+    Simulator *restored = malloc(sizeof(Simulator));
+    if (restored == NULL)
+        return SIM_ERR_NOMEM;
+    memcpy(restored, sim, sizeof(Simulator));
+    restored->pipeline = restored->latch_ring + (sim->pipeline - sim->latch_ring);
+    checkpoint_state(restored, (uint32_t *)state, false);
+    // The simulator keeps its own pipeline model; pipeline latches only fit
+    // the model that filled them
+    PipelineModel *pipe = &restored->pipe;
+    bool same_pipe = sim->pipe.stage_id == pipe->stage_id && sim->pipe.forwarding == pipe->forwarding &&
+                     memcmp(sim->pipe.latency, pipe->latency, sizeof(pipe->latency)) == 0 &&
+                     sim->pipe.predictor == pipe->predictor && sim->pipe.predictor_bits == pipe->predictor_bits &&
+                     sim->pipe.history_bits == pipe->history_bits && sim->pipe.btb_bits == pipe->btb_bits &&
+                     memcmp(&sim->pipe.dcache, &pipe->dcache, sizeof(pipe->dcache)) == 0 &&
+                     memcmp(&sim->pipe.icache, &pipe->icache, sizeof(pipe->icache)) == 0;
+    bool valid = checkpoint_state_valid(sim, restored, same_pipe);
+    free(restored);
+    if (!valid)
+        return SIM_ERR_LOAD;
+
+    uint8_t mode = sim->mode;
+    PipelineModel own_pipe = sim->pipe;
+    checkpoint_state(sim, (uint32_t *)state, false);
+    sim->pipe = own_pipe;
+    if (sim->mode != mode)
+    {
+        sim->mode = mode;
+        sim->halt_seen = false;
+        sim->branch_taken = false; // Left set by the functional simulators
+        sim->branch_delay = 0;
+        sim->next_pc = sim->PC;
+    }
+
+    // The caches only fit the geometry that filled them; any other starts cold
+    if (same_pipe && cache_words == checkpoint_cache_words(sim))
+        checkpoint_caches(sim, (uint32_t *)(state + CHECKPOINT_STATE_WORDS), false);
+    else
+    {
+        cache_reset(&sim->dcache);
+        cache_reset(&sim->icache);
+        sim->fetch_hold = 0;
+    }
+
+    const CheckpointPage *pages = (const CheckpointPage *)(state + CHECKPOINT_STATE_WORDS + cache_words);
+    uint32_t *words = (uint32_t *)((char *)data + data_offset);
+    for (uint32_t p = 0; p < num_pages; p++)
+    {
+        uint32_t *page_words = words + (size_t)p * MEM_PAGE_WORDS;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        for (uint32_t w = 0; w < MEM_PAGE_WORDS; w++)
+            page_words[w] = image_le32(page_words[w]);
+#endif
+        uint32_t page_num = image_le32(pages[p].page_num);
+        if (!mem_map_page(&sim->memory, page_num, page_words))
+            return SIM_ERR_NOMEM;
+        MemPage *page = mem_lookup_page(&sim->memory, page_num, false);
+        for (uint32_t w = 0; w < MEM_PAGE_WORDS / 32; w++)
+            page->modified[w] = image_le32(pages[p].modified[w]);
+    }
+
+    sim->memory.image = data;
+    sim->memory.image_size = size;
+    return SIM_OK;
+}
+
+#endif // MIPS_CHECKPOINT_H
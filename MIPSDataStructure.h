@@ -5,31 +5,15 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <setjmp.h>
+#include "MIPSMemory.h"
+#include "MIPSCache.h"
+#include "MIPSLite.h"
 
-#define MEMORY_SIZE 4096 // 4KB
+#define MEMORY_SIZE 4096 // 4KB, default size of the data address space (-m)
+#define MEMORY_MAX_SIZE 0x80000000u // LDW/STW addresses are signed 32-bit values
 #define NUM_REGISTERS 32
 
-// Global Variables
-uint32_t memory[MEMORY_SIZE / 4];
-bool modified_memory[MEMORY_SIZE / 4] = {false}; // Array to track modified memory
-int32_t registers[32];
-bool modified_registers[32] = {false}; // Array to track modified registers
-uint32_t PC = 0;
-bool halt_seen = false;
-bool branch_taken = false;
-bool branch_delay = false;
-uint8_t mode = 0;
-
-extern int total_instructions;
-extern int arithmetic_count;
-extern int logical_count;
-extern int memory_count;
-extern int control_count;
-
-// Timing Counters
-extern int clock_cycles;
-extern int stall_count;
-
 // Instruction Structures
 typedef struct instruction {
     uint32_t instruction;
@@ -37,29 +21,138 @@ typedef struct instruction {
 
 typedef struct R_I_type
 {
-    uint8_t opcode;
+    uint8_t opcode : 7;   // Also OPCODE_END and the UOP_* micro-ops
+    bool R_or_I_type : 1; // true for R-Type and false for I-Type
     uint8_t rs;
     uint8_t rt;
     uint8_t rd;
     int16_t imm;
-    bool R_or_I_type; // true for R-Type and false for I-Type
 } R_I_type;
 
-#define PIPELINE_DEPTH 5
+// Handler classes used to dispatch pre-decoded instructions
+typedef enum Handler
+{
+    HANDLER_ALU,    // ADD..XORI: register/immediate arithmetic and logic
+    HANDLER_LOAD,   // LDW
+    HANDLER_STORE,  // STW
+    HANDLER_BRANCH, // BZ, BEQ
+    HANDLER_JUMP,   // JR
+    HANDLER_HALT,   // HALT
+    HANDLER_INVALID // Unknown opcode, reported by the EXE stage
+} Handler;
+
+// Pre-decoded instruction: decoded fields plus the handler to run them
+typedef struct DecodedInstr
+{
+    R_I_type r_i_type;
+    uint8_t handler;
+} DecodedInstr;
+
+// Opcode of the sentinel entry placed just past the loaded image; it lies
+// outside the 6-bit opcode space so no real instruction can decode to it
+#define OPCODE_END 0x40
+
+// Micro-ops that only appear inside translated basic blocks
+#define UOP_LDW_ADD 0x41    // LDW followed by ADD
+#define UOP_ADDI_BZ 0x42    // ADDI followed by BZ
+#define UOP_SUBI_BZ 0x43    // SUBI followed by BZ
+#define UOP_NEXT_BLOCK 0x44 // Block hit BLOCK_MAX_INSTRS, continue at the next word
+#define UOP_COUNT 0x45
+
+#define BLOCK_MAX_INSTRS 64
+#define FAST_MAX_CHUNK (1 << 30) // Instructions per fast_simulator() call, well inside its int counters
+
+typedef struct InstrCounts
+{
+    int arithmetic;
+    int logical;
+    int memory;
+    int control;
+    int total; // Sum of the above
+} InstrCounts;
+
+// One dispatch of a translated block: a single instruction, or a fused pair.
+// The last op of a block also carries the block's instruction counts and the
+// links to its successors, so leaving a block touches only that op.
+typedef struct BlockOp
+{
+    uint8_t op;         // Opcode, OPCODE_END or UOP_*
+    uint16_t pc_off;    // Byte offset of the op's last instruction from the block start
+    R_I_type a;         // First (or only) instruction
+    R_I_type b;         // Second instruction of a fused pair
+    InstrCounts counts; // Last op only: added to the global counters when the block exits
+    int32_t succ[2];    // Last op only: first op of the (fall-through, taken) successor, -1 until linked
+} BlockOp;
+
+#define PIPELINE_MAX_DEPTH 16 // Latches allocated, at least the configured depth
+#define PIPELINE_RING (4 * PIPELINE_MAX_DEPTH) // Latch slots the pipeline slides down, see pipeline_advance()
+#define PIPELINE_MAX_LATENCY 64
+#define STAGE_BIT(stage) (1u << (stage))
+
+// Simulator.stages_done
+#define DONE_EX 1
+#define DONE_MEM 2
+#define DONE_WB 4
+
+// Pipeline model of modes 1 and 2, set by sim_configure_pipeline(). Stages
+// are numbered from the first IF stage, so stage_id is also the number of IF
+// stages.
+typedef struct PipelineModel
+{
+    uint8_t stage_id;
+    uint8_t stage_ex;
+    uint8_t stage_mem;
+    uint8_t stage_wb;
+    uint8_t depth;
+    uint8_t latency[SIM_NUM_OP_CLASSES]; // Cycles spent in EX, or in MEM for loads and stores
+    uint8_t forwarding;                  // SIM_FWD_* paths
+    uint8_t predictor;                   // SimPredictor
+    uint8_t predictor_bits;
+    uint8_t history_bits;
+    uint8_t btb_bits;
+    uint8_t extra_ex[64];                // Cycles per opcode past the first, in EX
+    uint8_t extra_mem[64];               // and in MEM
+    SimCacheConfig dcache;               // As configured; the caches themselves are Simulator.dcache and icache
+    SimCacheConfig icache;
+} PipelineModel;
+
+#define BP_MAX_BITS 14  // Counters of the bimodal and gshare predictors, log2
+#define BTB_MAX_BITS 10 // BTB entries, log2
+
+// State of the branch predictor selected by PipelineModel.predictor, trained
+// when branches resolve in EX
+typedef struct BranchPredictor
+{
+    uint32_t history;                       // gshare: outcomes of the latest branches, newest in bit 0
+    uint8_t counters[1 << BP_MAX_BITS];     // 2-bit saturating, taken from 2 up
+    uint32_t btb_pc[1 << BTB_MAX_BITS];     // Address of the JR in each entry, UINT32_MAX if empty
+    uint32_t btb_target[1 << BTB_MAX_BITS]; // Where it jumped last
+    int64_t branches;                       // Resolved against a prediction
+    int64_t mispredictions;
+    int64_t penalty_cycles;                 // Bubbles of the squashed wrong-path fetches
+} BranchPredictor;
+
+// Ring of disassembly buffers returned by get_decode_str()
+#define DECODE_STR_SLOTS 8
+#define DECODE_STR_LEN 48
 
 typedef struct PipelineStage
 {
+    uint32_t pc; // Address the instruction was fetched from
+    uint32_t predicted_pc; // Where fetch went next, when a branch predictor is in use
+    uint32_t seq; // Fetch number, see Simulator.fetch_seq
     instruction raw;
-    R_I_type decoded;
     int32_t alu_result;
     int32_t mem_result;
-    bool valid;
-    bool isStall;
-    char *raw_str;
-    bool frwd_flags[4]; // 00(0): src1_exe, 01(1): sec2_exe, 10(2): src1_mem, 11(3): src2_mem
+    // One 64-bit word from here, so a latch is 32 bytes
+    R_I_type decoded;
+    uint8_t dst; // Register written by 'decoded', NUM_REGISTERS if none; see scoreboard_rebuild()
+    bool valid : 1;
+    bool isStall : 1;
+    uint8_t frwd_flags : 4; // FRWD_BIT(i), i = 0: src1_exe, 1: src2_exe, 2: src1_mem, 3: src2_mem
 } PipelineStage;
 
-PipelineStage pipeline[PIPELINE_DEPTH];
+#define FRWD_BIT(i) (1u << (i))
 
 typedef struct HazardPacket
 {
@@ -67,8 +160,77 @@ typedef struct HazardPacket
     int hazardCnt;
 } HazardPacket;
 
-int total_stalls = 0;
-int total_cycles = 0;
+// All the state of one simulation, passed explicitly to every stage so that
+// several simulations can run in one process. The fields touched on every
+// instruction or cycle come first and are packed together, so PC, the
+// counters, the register file and the pipeline latches span a few adjacent
+// cache lines; the large page tables of the memories go last.
+typedef struct Simulator
+{
+    // Hot: architectural and pipeline state
+    uint32_t PC;
+    uint8_t mode;
+    bool halt_seen;
+    bool branch_taken;
+    uint8_t branch_delay; // Latches fetched after a taken branch still to go through EX as bubbles
+    uint8_t hazard_cnt; // Stall cycles left, kept across sim_run() calls
+    uint8_t ex_hold;     // Cycles the multi-cycle instruction in EX waits before executing
+    uint8_t mem_hold;    // Same for MEM
+    uint8_t stages_done; // DONE_* of the stages that already worked on their latch while the pipeline is held
+    uint8_t fetch_hold;  // I-cache miss: 1 + bubbles left until the line arrives, fetched without a lookup at 1
+    uint32_t next_pc;   // Pipeline modes: instruction after the last one executed, see drain_pipeline()
+    uint32_t fetch_seq; // Instructions fetched by the pipeline modes, numbering the latches for the pipeline trace
+    int64_t total_instructions;
+    int64_t arithmetic_count;
+    int64_t logical_count;
+    int64_t memory_count;
+    int64_t control_count;
+    int64_t total_stalls;
+    int64_t total_cycles;
+    int32_t registers[NUM_REGISTERS];
+    PipelineModel pipe;
+    PipelineStage *pipeline; // pipeline[s]: latch of stage s, a window of latch_ring
+    uint16_t reg_writers[NUM_REGISTERS + 1]; // Scoreboard: STAGE_BIT(s) set while pipeline[s], s >= stage_ex, writes the
+                                             // register; the extra entry collects instructions that write none
+    bool modified_registers[NUM_REGISTERS]; // Registers written by the program
+    PipelineStage latch_ring[PIPELINE_RING];
+
+    DecodedInstr *decoded_text; // One entry per word loaded by file_read(), built on first run
+    int decoded_words;
+    int words_read;    // Words of the loaded image the simulators may execute
+    uint32_t entry_pc; // PC after loading
+
+    // Translation cache used by the fast simulator. Each basic block is a run of
+    // ops in block_ops ending in BZ, BEQ, JR or HALT, found by its start word.
+    BlockOp *block_ops;
+    int num_block_ops;
+    int block_ops_cap;
+    int32_t *block_index; // First op of the block starting at each word, -1 if not translated
+
+    // Sampled simulation, see sim_run_sampled(): instructions run by the
+    // functional engine, and the totals of the measured detailed intervals
+    int64_t ff_instructions;
+    int num_samples;
+    int64_t sampled_instructions;
+    int64_t sampled_cycles;
+    int64_t sampled_stalls;
+    double sample_cpi_sum; // Sum and sum of squares of the per-sample CPI
+    double sample_cpi_sq_sum;
+
+    BranchPredictor predictor;
+    Cache dcache;
+    Cache icache;
+
+    char *checkpoint_file; // Restored by sim_reset() instead of the image, if set
+    struct PipeTrace *pipe_trace; // Binary pipeline trace being written, if any (MIPSPipeTrace.h)
+    struct Profile *profile;      // Counters of sim_set_profiling(), NULL while not profiling (MIPSProfile.h)
+    struct Simulator *shadow;     // Functional model run in lock-step by sim_set_cosim(), NULL if off
+    FILE *out;             // Trace, summary and error output
+    SimStatus status;      // SIM_OK while the run can continue
+    jmp_buf *exit_jmp;     // Where sim_fail() unwinds to, set by the API calls
+
+    Memory memory;         // Paged memory, tracks modified words and the snapshot of sim_reset() itself
+} Simulator;
 
 // typedef struct I_type
 // {
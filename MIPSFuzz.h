@@ -0,0 +1,168 @@
+#ifndef MIPS_FUZZ_H
+#define MIPS_FUZZ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "MIPSDataStructure.h"
+
+// Random program generator for differential testing of the modes (-fuzz).
+// Every program it makes is valid in all of them:
+//
+//   - loops are counted down in a register nothing else writes, at most two
+//     deep and four iterations each, and other branches and JR only jump
+//     forward, so every program reaches HALT;
+//   - LDW and STW address a FUZZ_DATA_BYTES window past the code through a
+//     base register nothing else writes, so they stay in range and never
+//     store over the code;
+//   - HALT follows enough filler that no wrong-path fetch behind a taken
+//     branch can reach it, and padding follows it so the pipeline modes can
+//     fetch past it.
+#define FUZZ_MAX_BODY 192      // Generated instructions, before the filler
+#define FUZZ_FILLER PIPELINE_MAX_DEPTH
+#define FUZZ_MAX_WORDS (1 + 12 + FUZZ_MAX_BODY + FUZZ_FILLER + 1 + PIPELINE_MAX_DEPTH)
+#define FUZZ_DATA_BYTES 1024
+#define FUZZ_MIN_MEMORY (FUZZ_MAX_WORDS * 4 + FUZZ_DATA_BYTES)
+
+// Registers with a fixed role; random instructions only write R1..R12
+#define FUZZ_REG_LOOP_OUTER 13
+#define FUZZ_REG_DATA 14
+#define FUZZ_REG_LOOP_INNER 15
+#define FUZZ_REG_JUMP 16
+#define FUZZ_NUM_WRITABLE 12
+#define FUZZ_NUM_READABLE 17 // R0..R16
+
+typedef struct FuzzProgram
+{
+    uint32_t words[FUZZ_MAX_WORDS];
+    uint32_t num_words;
+    uint32_t data_base; // Byte address of the LDW/STW window
+    uint64_t rng;
+    int reserved; // Body instructions kept for the ends of the loops being generated
+} FuzzProgram;
+
+// xorshift64*, seeded through splitmix64 so nearby seeds give unrelated programs
+static inline uint32_t fuzz_rand(FuzzProgram *p)
+{
+    p->rng ^= p->rng >> 12;
+    p->rng ^= p->rng << 25;
+    p->rng ^= p->rng >> 27;
+    return (p->rng * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+static inline uint32_t fuzz_below(FuzzProgram *p, uint32_t n)
+{
+    return (uint32_t)(((uint64_t)fuzz_rand(p) * n) >> 32);
+}
+
+static inline void fuzz_emit_r(FuzzProgram *p, uint8_t opcode, uint32_t rd, uint32_t rt, uint32_t rs)
+{
+    p->words[p->num_words++] = (uint32_t)opcode << 26 | rs << 21 | rt << 16 | rd << 11;
+}
+
+static inline void fuzz_emit_i(FuzzProgram *p, uint8_t opcode, uint32_t rt, uint32_t rs, int32_t imm)
+{
+    p->words[p->num_words++] = (uint32_t)opcode << 26 | rs << 21 | rt << 16 | ((uint32_t)imm & 0xFFFF);
+}
+
+// Instructions left for the body of the program
+static inline int fuzz_room(FuzzProgram *p)
+{
+    return (int)(1 + 12 + FUZZ_MAX_BODY) - (int)p->num_words - p->reserved;
+}
+
+// One ALU, LDW or STW instruction on random registers
+void fuzz_emit_op(FuzzProgram *p)
+{
+    uint8_t opcode = fuzz_below(p, 0x0E); // ADD..STW
+    uint32_t dst = 1 + fuzz_below(p, FUZZ_NUM_WRITABLE);
+    uint32_t src = fuzz_below(p, FUZZ_NUM_READABLE);
+    int32_t offset = fuzz_below(p, FUZZ_DATA_BYTES / 4) * 4;
+    if (opcode == 0x0C) // LDW
+        fuzz_emit_i(p, opcode, dst, FUZZ_REG_DATA, offset);
+    else if (opcode == 0x0D) // STW
+        fuzz_emit_i(p, opcode, src, FUZZ_REG_DATA, offset);
+    else if (opcode % 2 == 0) // R-type
+        fuzz_emit_r(p, opcode, dst, fuzz_below(p, FUZZ_NUM_READABLE), src);
+    else
+        fuzz_emit_i(p, opcode, dst, src, (int16_t)fuzz_rand(p));
+}
+
+// Up to 'n' random instructions, fewer if the body is full
+void fuzz_emit_ops(FuzzProgram *p, int n)
+{
+    for (int i = 0; i < n && fuzz_room(p) > 0; i++)
+        fuzz_emit_op(p);
+}
+
+// A block of straight-line code, forward branches, forward jumps and loops,
+// 'depth' loops deep
+void fuzz_emit_block(FuzzProgram *p, int depth, int length)
+{
+    uint32_t end = p->num_words + length;
+    while (p->num_words < end && fuzz_room(p) > 0)
+    {
+        uint32_t choice = fuzz_below(p, 100);
+        int skip = fuzz_below(p, 4);
+        if (choice < 55)
+            fuzz_emit_ops(p, 1 + fuzz_below(p, 8));
+        else if (choice < 75 && fuzz_room(p) > skip + 1)
+        {
+            // BZ or BEQ over the next 'skip' instructions, taken or not
+            uint32_t rs = fuzz_below(p, FUZZ_NUM_READABLE);
+            if (fuzz_below(p, 2))
+                fuzz_emit_i(p, 0x0E, 0, rs, skip + 1); // BZ
+            else
+                fuzz_emit_i(p, 0x0F, fuzz_below(p, FUZZ_NUM_READABLE), rs, skip + 1); // BEQ
+            fuzz_emit_ops(p, skip);
+        }
+        else if (choice < 85 && fuzz_room(p) > skip + 2)
+        {
+            // JR over the next 'skip' instructions
+            fuzz_emit_i(p, 0x01, FUZZ_REG_JUMP, 0, (p->num_words + 2 + skip) * 4); // ADDI
+            fuzz_emit_r(p, 0x10, 0, 0, FUZZ_REG_JUMP);                             // JR
+            fuzz_emit_ops(p, skip);
+        }
+        else if (depth < 2 && fuzz_room(p) > 8)
+        {
+            // Counted loop, the same shape as mips_bench.py's
+            uint32_t counter = depth == 0 ? FUZZ_REG_LOOP_OUTER : FUZZ_REG_LOOP_INNER;
+            fuzz_emit_i(p, 0x01, counter, 0, 1 + fuzz_below(p, 4)); // ADDI
+            p->reserved += 3;
+            uint32_t body = p->num_words;
+            fuzz_emit_block(p, depth + 1, 1 + fuzz_below(p, fuzz_room(p) < 24 ? fuzz_room(p) : 24));
+            p->reserved -= 3;
+            fuzz_emit_i(p, 0x03, counter, counter, 1);                          // SUBI
+            fuzz_emit_i(p, 0x0E, 0, counter, 2);                                // BZ
+            fuzz_emit_i(p, 0x0F, 0, 0, (int32_t)body - (int32_t)p->num_words); // BEQ R0, R0 back to the body
+        }
+    }
+}
+
+// Generates the program of 'seed' for a memory of 'memory_size' bytes, at
+// least FUZZ_MIN_MEMORY
+void fuzz_generate(FuzzProgram *p, uint64_t seed, uint32_t memory_size)
+{
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull; // splitmix64
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    p->rng = (z ^ (z >> 31)) | 1;
+    p->num_words = 0;
+    p->reserved = 0;
+
+    // The window ends below the top of memory and of the ADDI range
+    uint32_t top = memory_size < 0x8000 ? memory_size : 0x8000;
+    p->data_base = top - FUZZ_DATA_BYTES;
+    fuzz_emit_i(p, 0x01, FUZZ_REG_DATA, 0, p->data_base); // ADDI
+    for (uint32_t reg = 1; reg <= FUZZ_NUM_WRITABLE; reg++)
+        if (fuzz_below(p, 2))
+            fuzz_emit_i(p, 0x01, reg, 0, (int16_t)fuzz_rand(p)); // ADDI
+
+    fuzz_emit_block(p, 0, 8 + fuzz_below(p, FUZZ_MAX_BODY - 8));
+    for (int i = 0; i < FUZZ_FILLER; i++)
+        fuzz_emit_i(p, 0x01, 1 + i % FUZZ_NUM_WRITABLE, 1 + i % FUZZ_NUM_WRITABLE, 1); // ADDI
+    fuzz_emit_i(p, 0x11, 0, 0, 0); // HALT
+    for (int i = 0; i < PIPELINE_MAX_DEPTH; i++)
+        p->words[p->num_words++] = 0;
+}
+
+#endif // MIPS_FUZZ_H
@@ -0,0 +1,335 @@
+#ifndef MIPS_IMAGE_H
+#define MIPS_IMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "MIPSMemory.h"
+
+// Binary memory image, produced from the hex text format by
+// "mips_lite_gcc.py pack". All fields and words are little-endian.
+//
+//   ImageHeader
+//   ImageSegment[num_segments]
+//   segment data, each starting on a MEM_PAGE_SIZE boundary of the file and
+//   padded to a whole number of pages
+//
+// Segments are page aligned in both the file and the address space, so the
+// loader maps the file once and points the memory pages straight at it.
+#define IMAGE_MAGIC "MIPL"
+#define IMAGE_VERSION 1
+
+typedef struct ImageHeader
+{
+    char magic[4];         // IMAGE_MAGIC
+    uint32_t version;      // IMAGE_VERSION
+    uint32_t entry_pc;     // Initial PC
+    uint32_t text_words;   // Words from address 0 the simulators may execute, as returned by file_read()
+    uint32_t num_segments;
+    uint32_t reserved[3];
+} ImageHeader;
+
+typedef struct ImageSegment
+{
+    uint32_t addr;        // Load address, multiple of MEM_PAGE_SIZE
+    uint32_t num_words;
+    uint32_t file_offset; // Multiple of MEM_PAGE_SIZE
+    uint32_t reserved;
+} ImageSegment;
+
+static inline uint32_t image_le32(uint32_t value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(value);
+#else
+    return value;
+#endif
+}
+
+// Loads a mapped binary image into memory. On success the mapping is owned
+// by 'm' and the number of text words is returned; on a malformed image an
+// error is printed and -1 returned, and MEM_ERR_NOMEM if a page cannot be
+// allocated. On failure no page refers to the mapping, which stays the
+// caller's.
+int image_load(Memory *m, void *data, size_t size, uint32_t *entry_pc, FILE *err)
+{
+    const ImageHeader *header = data;
+    if (size < sizeof(ImageHeader) || memcmp(header->magic, IMAGE_MAGIC, 4) != 0)
+    {
+        fprintf(err, "Error: Not a binary image.\n");
+        return -1;
+    }
+    uint32_t num_segments = image_le32(header->num_segments);
+    if (image_le32(header->version) != IMAGE_VERSION ||
+        (size - sizeof(ImageHeader)) / sizeof(ImageSegment) < num_segments)
+    {
+        fprintf(err, "Error: Unsupported or truncated binary image.\n");
+        return -1;
+    }
+
+    if ((uint64_t)image_le32(header->text_words) * 4 > m->size)
+    {
+        fprintf(err, "Error: Image text is larger than the data address space (see -m).\n");
+        return -1;
+    }
+
+    // Every segment is checked before any is mapped, so a malformed image
+    // leaves 'm' as it was
+    const ImageSegment *segments = (const ImageSegment *)(header + 1);
+    for (uint32_t s = 0; s < num_segments; s++)
+    {
+        uint32_t addr = image_le32(segments[s].addr);
+        uint32_t num_words = image_le32(segments[s].num_words);
+        uint32_t offset = image_le32(segments[s].file_offset);
+        uint32_t num_pages = (num_words + MEM_PAGE_WORDS - 1) / MEM_PAGE_WORDS;
+        if (addr % MEM_PAGE_SIZE != 0 || offset % MEM_PAGE_SIZE != 0 ||
+            offset > size || (size - offset) / MEM_PAGE_SIZE < num_pages)
+        {
+            fprintf(err, "Error: Malformed segment %u in binary image.\n", s);
+            return -1;
+        }
+        if ((uint64_t)addr + (uint64_t)num_words * 4 > m->size)
+        {
+            fprintf(err, "Error: Image segment at 0x%08X is outside the data address space (see -m).\n", addr);
+            return -1;
+        }
+    }
+
+    for (uint32_t s = 0; s < num_segments; s++)
+    {
+        uint32_t addr = image_le32(segments[s].addr);
+        uint32_t num_words = image_le32(segments[s].num_words);
+        uint32_t offset = image_le32(segments[s].file_offset);
+        uint32_t num_pages = (num_words + MEM_PAGE_WORDS - 1) / MEM_PAGE_WORDS;
+        uint32_t *words = (uint32_t *)((char *)data + offset);
+        for (uint32_t p = 0; p < num_pages; p++)
+        {
+            uint32_t *page_words = words + p * MEM_PAGE_WORDS;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            for (uint32_t w = 0; w < MEM_PAGE_WORDS; w++)
+                page_words[w] = image_le32(page_words[w]);
+#endif
+            if (!mem_map_page(m, addr / MEM_PAGE_SIZE + p, page_words))
+            {
+                mem_unmap_pages(m, data, size);
+                return MEM_ERR_NOMEM;
+            }
+        }
+    }
+
+    m->image = data;
+    m->image_size = size;
+    *entry_pc = image_le32(header->entry_pc);
+    return image_le32(header->text_words);
+}
+
+// Hex text images: one word per line, parsed like strtoul(line, NULL, 16),
+// so leading whitespace, a 0x prefix, a sign and anything after the digits
+// (trailing blanks, "\r", comments) behave as they did with fgets/strtoul.
+// Blank lines load as 0.
+#define HEX_PARALLEL_MIN_BYTES (1 << 20) // Smaller files are parsed on one thread
+#define HEX_MAX_THREADS 16
+
+static inline uint64_t hex_load_le64(const char *p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+static inline bool is_hex_digit(char c)
+{
+    return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+}
+
+// Parses 8 hex digits at once (SWAR): validates all eight bytes and packs
+// their nibbles with a few shifts, with no per-character branches. Returns
+// false if any byte is not a hex digit.
+static inline bool hex_parse8(const char *p, uint32_t *word)
+{
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t high = 0x8080808080808080ull;
+    uint64_t x = hex_load_le64(p);
+    uint64_t lower = x | (0x20 * ones); // 'A'..'F' -> 'a'..'f'
+
+    // Per-byte range checks; bytes are < 0x80 so the adds never carry across
+    // lanes. Digits are checked before case folding, which would also map
+    // 0x10..0x19 onto them.
+    uint64_t digit = (x + 0x50 * ones) & ~(x + 0x46 * ones) & high;         // '0'..'9'
+    uint64_t alpha = (lower + 0x1F * ones) & ~(lower + 0x19 * ones) & high; // 'a'..'f'
+    if ((x & high) != 0 || (digit | alpha) != high)
+        return false;
+
+    // Nibble value of each byte; the first character is the most significant
+    uint64_t v = (lower & (0x0F * ones)) + (alpha >> 7) * 9;
+    v = ((v << 4) | (v >> 8)) & 0x00FF00FF00FF00FFull;
+    v = ((v << 8) | (v >> 16)) & 0x0000FFFF0000FFFFull;
+    *word = (uint32_t)((v << 16) | (v >> 32));
+    return true;
+}
+
+// General case, following strtoul() on an LP64 host: optional whitespace,
+// sign and 0x prefix, saturating on overflow, then truncated to 32 bits
+uint32_t hex_parse_slow(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f'))
+        p++;
+    bool negative = false;
+    if (p < end && (*p == '+' || *p == '-'))
+        negative = *p++ == '-';
+    if (end - p >= 3 && p[0] == '0' && (p[1] | 0x20) == 'x' && is_hex_digit(p[2]))
+        p += 2;
+
+    uint64_t value = 0;
+    bool overflow = false;
+    for (; p < end && is_hex_digit(*p); p++)
+    {
+        uint64_t digit = *p <= '9' ? *p - '0' : (*p | 0x20) - 'a' + 10;
+        if (value >> 60)
+            overflow = true;
+        value = value << 4 | digit;
+    }
+    if (overflow)
+        return UINT32_MAX;
+    return (uint32_t)(negative ? -value : value);
+}
+
+static inline uint32_t hex_parse_line(const char *p, const char *end)
+{
+    uint32_t word;
+    // Common case: exactly eight digits, then the end of the number
+    if (end - p >= 8 && hex_parse8(p, &word) && (end - p == 8 || !is_hex_digit(p[8])))
+        return word;
+    return hex_parse_slow(p, end);
+}
+
+typedef struct HexChunk
+{
+    Memory *m;
+    const char *begin; // First byte of the chunk's first line
+    const char *end;   // One past the chunk's last byte
+    uint32_t first;    // Word index of the chunk's first line
+    uint32_t limit;    // Words past this index are dropped
+} HexChunk;
+
+// Parses one chunk straight into pre-allocated pages. Only reads the page
+// table, so chunks can run concurrently.
+void *hex_parse_chunk(void *arg)
+{
+    HexChunk *chunk = arg;
+    const char *p = chunk->begin;
+    uint32_t index = chunk->first;
+    uint32_t *words = NULL;
+    uint32_t page_num = UINT32_MAX;
+
+    while (p < chunk->end && index < chunk->limit)
+    {
+        const char *nl = memchr(p, '\n', chunk->end - p);
+        const char *line_end = nl != NULL ? nl : chunk->end;
+        if (index / MEM_PAGE_WORDS != page_num)
+        {
+            page_num = index / MEM_PAGE_WORDS;
+            words = chunk->m->l1[page_num >> MEM_L2_BITS][page_num & (MEM_L2_ENTRIES - 1)]->words;
+        }
+        words[index % MEM_PAGE_WORDS] = hex_parse_line(p, line_end);
+        index++;
+        p = line_end + 1;
+    }
+    return NULL;
+}
+
+static inline uint32_t count_lines(const char *p, const char *end)
+{
+    uint32_t lines = 0;
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL)
+    {
+        lines++;
+        p++;
+    }
+    return lines;
+}
+
+int host_cpu_count()
+{
+#if defined(_SC_NPROCESSORS_ONLN)
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+#else
+    return 1;
+#endif
+}
+
+// Loads a hex text image held in memory into words 0.. of 'm' and returns the
+// number of words (lines) read, at most m->size / 4, or MEM_ERR_NOMEM. Large
+// files are split at line boundaries and parsed on several threads.
+int hex_image_load(Memory *m, const char *data, size_t size)
+{
+    int num_chunks = 1;
+    if (size >= HEX_PARALLEL_MIN_BYTES)
+    {
+        num_chunks = host_cpu_count();
+        if (num_chunks > HEX_MAX_THREADS)
+            num_chunks = HEX_MAX_THREADS;
+    }
+
+    // Cut the file into chunks that start on a line boundary
+    HexChunk chunks[HEX_MAX_THREADS];
+    const char *end = data + size;
+    const char *p = data;
+    for (int c = 0; c < num_chunks; c++)
+    {
+        chunks[c].m = m;
+        chunks[c].begin = p;
+        const char *cut = c == num_chunks - 1 ? end : data + size / num_chunks * (c + 1);
+        if (cut < p)
+            cut = p;
+        if (cut < end)
+        {
+            const char *nl = memchr(cut, '\n', end - cut);
+            cut = nl != NULL ? nl + 1 : end;
+        }
+        chunks[c].end = cut;
+        p = cut;
+    }
+
+    // Word index of each chunk's first line; a last line without '\n' still counts
+    uint64_t total = 0;
+    for (int c = 0; c < num_chunks; c++)
+    {
+        chunks[c].first = total < UINT32_MAX ? (uint32_t)total : UINT32_MAX;
+        total += count_lines(chunks[c].begin, chunks[c].end);
+    }
+    if (size > 0 && data[size - 1] != '\n')
+        total++;
+    uint32_t limit = m->size / 4;
+    uint32_t num_words = total < limit ? (uint32_t)total : limit;
+
+    for (uint32_t page = 0; page * MEM_PAGE_WORDS < num_words; page++)
+        if (mem_lookup_page(m, page, true) == NULL)
+            return MEM_ERR_NOMEM;
+    for (int c = 0; c < num_chunks; c++)
+        chunks[c].limit = num_words;
+
+    pthread_t threads[HEX_MAX_THREADS];
+    int started = 0;
+    for (int c = 1; c < num_chunks; c++)
+    {
+        if (pthread_create(&threads[c], NULL, hex_parse_chunk, &chunks[c]) != 0)
+            break;
+        started = c;
+    }
+    hex_parse_chunk(&chunks[0]);
+    // Chunks whose thread could not be started are parsed here
+    for (int c = started + 1; c < num_chunks; c++)
+        hex_parse_chunk(&chunks[c]);
+    for (int c = 1; c <= started; c++)
+        pthread_join(threads[c], NULL);
+
+    return num_words;
+}
+
+#endif // MIPS_IMAGE_H
@@ -0,0 +1,251 @@
+#ifndef MIPS_LITE_H
+#define MIPS_LITE_H
+
+// Library interface to the simulator. Only declarations live here, so other
+// programs can include it and link against FinalProject.c built with
+// -DMIPS_LITE_NO_MAIN, e.g.
+//
+//     gcc -c -O2 -DMIPS_LITE_NO_MAIN FinalProject.c
+//
+// A simulator is loaded once and can then be run, inspected and reset to the
+// loaded image any number of times. No function exits the process; each one
+// reports how the simulation stands through a SimStatus.
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef struct Simulator Simulator;
+
+typedef enum SimStatus
+{
+    SIM_OK,           // Ran the requested number of instructions, can continue
+    SIM_HALTED,       // Reached HALT
+    SIM_END_OF_IMAGE, // PC ran past the loaded image without HALT
+    SIM_ERR_MODE,     // Mode is not 0/1/2/3
+    SIM_ERR_LOAD,     // Image missing, empty, malformed or larger than memory
+    SIM_ERR_MEMORY,   // LDW/STW outside the data address space
+    SIM_ERR_OPCODE,   // Unknown opcode executed
+    SIM_ERR_NOMEM,    // Host allocation failed
+    SIM_ERR_IO,       // Checkpoint could not be written
+    SIM_ERR_CONFIG,   // Pipeline configuration rejected by sim_configure_pipeline()
+    SIM_ERR_COSIM     // Pipeline and functional model disagree, see sim_set_cosim()
+} SimStatus;
+
+typedef struct SimStats
+{
+    uint32_t pc;
+    int64_t total_instructions;
+    int64_t arithmetic_count;
+    int64_t logical_count;
+    int64_t memory_count;
+    int64_t control_count;
+    int64_t total_cycles; // Pipeline modes only
+    int64_t total_stalls; // Pipeline modes only
+
+    // Sampled simulation, pipeline modes only. Without fast-forwarding or
+    // samples the estimates equal total_cycles and total_stalls.
+    int64_t fast_forwarded;   // Instructions run by sim_fast_forward()
+    int samples;              // Measured intervals of sim_run_sampled()
+    double estimated_cycles;  // Whole-program clock cycles at the measured CPI
+    double estimated_stalls;
+    double cpi_error;         // Half-width of the 95% confidence interval of the CPI, relative; 0 below two samples
+
+    // Branch prediction, pipeline modes with a predictor only
+    int64_t branches;       // BZ, BEQ and JR resolved against a prediction
+    int64_t mispredictions;
+    int64_t branch_penalty; // Cycles lost to squashed wrong-path fetches
+
+    // Caches, pipeline modes with the cache enabled only
+    int64_t dcache_hits;
+    int64_t dcache_misses;
+    int64_t dcache_evictions;
+    int64_t icache_hits;
+    int64_t icache_misses;
+    int64_t icache_evictions;
+} SimStats;
+
+// Sampled simulation (SMARTS-style): the pipeline model only runs short
+// measured intervals spread evenly over the program, the fast functional
+// engine runs the rest, and cycles and stalls are extrapolated from the CPI
+// of the intervals
+typedef struct SimSampling
+{
+    uint64_t fast_forward; // Instructions run functionally before the first sample
+    uint64_t period;       // Instructions from the start of one sample to the next; 0 runs the
+                           // pipeline model from the fast-forward point to the end
+    uint64_t warmup;       // Detailed instructions at the start of a sample that refill the pipeline, not measured
+    uint64_t measure;      // Measured detailed instructions per sample
+} SimSampling;
+
+// Timing model of the pipeline modes. Instructions go through 'fetch_stages'
+// IF stages, then ID, EX, MEM and WB; each opcode class spends 'latency'
+// cycles in EX, or in MEM for loads and stores, holding up the whole
+// pipeline meanwhile. Results reach EX through the enabled forwarding paths,
+// otherwise from the register file after WB.
+typedef enum SimOpClass
+{
+    SIM_OP_ALU,    // Arithmetic and logical ops other than MUL/MULI, and HALT
+    SIM_OP_MUL,    // MUL, MULI
+    SIM_OP_LOAD,   // LDW
+    SIM_OP_STORE,  // STW
+    SIM_OP_BRANCH, // BZ, BEQ, JR
+    SIM_NUM_OP_CLASSES
+} SimOpClass;
+
+// Branch prediction. Without a predictor BZ, BEQ and JR resolve in EX and
+// whatever was fetched after a taken one is squashed, as if predicted not
+// taken. A predictor is consulted at fetch instead: the pipeline follows its
+// guess and is only squashed when EX finds it wrong. Every predictor sends JR
+// to the target of its last execution, kept in a branch target buffer (BTB).
+typedef enum SimPredictor
+{
+    SIM_BP_NONE,    // Resolve in EX, no statistics
+    SIM_BP_STATIC,  // Backward BZ/BEQ taken, forward ones not taken
+    SIM_BP_BIMODAL, // 2-bit counter per branch address
+    SIM_BP_GSHARE,  // 2-bit counters indexed by branch address XOR global history
+    SIM_NUM_PREDICTORS
+} SimPredictor;
+
+// Caches in front of the memory. A D-cache miss holds the load or store in
+// MEM, and with it the whole pipeline, for the miss latency; an I-cache miss
+// feeds bubbles into the pipeline for as long. Evicting a dirty line costs
+// the latency again. A size of 0 disables the cache.
+typedef enum SimCachePolicy
+{
+    SIM_CACHE_LRU,  // Least recently used way
+    SIM_CACHE_PLRU, // Tree pseudo-LRU
+    SIM_NUM_CACHE_POLICIES
+} SimCachePolicy;
+
+#define SIM_CACHE_MAX_LATENCY 64
+
+typedef struct SimCacheConfig
+{
+    int size;         // Bytes, a power of two; 0 for no cache
+    int ways;         // Associativity, a power of two up to 32
+    int line_size;    // Bytes, a power of two from 4
+    int policy;       // SimCachePolicy
+    int write_back;   // 1: write-back with write-allocate, 0: write-through without
+    int miss_latency; // Cycles a miss adds, up to SIM_CACHE_MAX_LATENCY
+} SimCacheConfig;
+
+#define SIM_FWD_EX 1  // EX/MEM latch to EX: ALU results without a stall
+#define SIM_FWD_MEM 2 // MEM/WB latch to EX: loads after one stall, older ALU results
+
+typedef struct SimPipelineConfig
+{
+    int fetch_stages;                // IF stages before ID, 1 for the classic 5-stage pipeline
+    int latency[SIM_NUM_OP_CLASSES]; // Cycles per opcode class, at least 1
+    int forwarding;                  // SIM_FWD_* paths, or -1 for the mode's: none in mode 1, both in mode 2
+    int predictor;                   // SimPredictor
+    int predictor_bits;              // log2 of the bimodal/gshare counters, at most 14
+    int history_bits;                // gshare global history length, at most predictor_bits
+    int btb_bits;                    // log2 of the BTB entries, at most 10
+    SimCacheConfig dcache;           // L1 data cache, used by LDW and STW
+    SimCacheConfig icache;           // L1 instruction cache, used by fetch
+} SimPipelineConfig;
+
+// Fills 'config' with the classic 5-stage pipeline: single-cycle stages, the
+// mode's forwarding, no branch predictor and no caches. The cache geometry
+// is set to a 4 KB 2-way cache of 32-byte lines, LRU and write-back, with a
+// 10-cycle miss latency, so enabling one only takes a size.
+void sim_default_pipeline(SimPipelineConfig *config);
+
+// Creates a simulator for mode 0/1/2/3 with 'memory_size' bytes of data
+// address space. Trace, summary and error text go to 'out' (stdout if NULL).
+Simulator *sim_create(uint8_t mode, uint32_t memory_size, FILE *out);
+void sim_destroy(Simulator *sim);
+
+// Loads a hex text or binary image, replacing any earlier one. A checkpoint
+// file is restored with sim_restore_checkpoint() instead.
+SimStatus sim_load_image(Simulator *sim, const char *filename);
+
+// Loads an image held in memory, word i at address 4 * i, replacing any
+// earlier one. Returns SIM_ERR_LOAD if it is empty or larger than memory.
+SimStatus sim_load_words(Simulator *sim, const uint32_t *words, uint32_t num_words);
+
+// Runs up to 'max_instructions' more instructions, or until the run ends if 0.
+// Once the run has ended (HALT, end of image or an error) the same status is
+// returned until sim_reset().
+SimStatus sim_run(Simulator *sim, uint64_t max_instructions);
+
+// Runs up to 'max_instructions' more instructions, or until the run ends if 0,
+// on the fast functional engine whatever the mode. In the pipeline modes the
+// instructions already past EX are completed first and the rest of the
+// pipeline is dropped; the next sim_run() refills it from the following
+// instruction. Fast-forwarded instructions add no cycles or stalls.
+SimStatus sim_fast_forward(Simulator *sim, uint64_t max_instructions);
+
+// Runs to the end as sampled simulation, see SimSampling. The functional
+// modes ignore 'sampling' and run as sim_run(sim, 0) would.
+SimStatus sim_run_sampled(Simulator *sim, const SimSampling *sampling);
+
+// Replaces the pipeline model, which is kept across loads and resets. Only
+// allowed while the pipeline is empty: before the first sim_run(), or after
+// sim_reset() or sim_fast_forward(). Returns SIM_ERR_CONFIG, and changes
+// nothing, for an out of range parameter, a pipeline in flight or a pipeline
+// trace being written, and SIM_ERR_NOMEM if the cache arrays cannot be
+// allocated.
+SimStatus sim_configure_pipeline(Simulator *sim, const SimPipelineConfig *config);
+
+// Starts recording every cycle of the pipeline modes to a binary pipeline
+// trace file, rendered offline by mips_trace_view.py as the -v 2 pipeline
+// dump or a Konata pipeline view. Any trace being written is closed first;
+// a NULL filename only closes it. The pipeline model cannot be changed while
+// a trace is written. Returns SIM_ERR_IO if the file cannot be created, or
+// the trace closed could not be written completely.
+SimStatus sim_set_pipe_trace(Simulator *sim, const char *filename);
+
+// Profiling counters, kept while enabled: executions per opcode, executions
+// and stall cycles per instruction address, the stalls of the pipeline modes
+// by cause, operands taken from each forwarding path, and the host time the
+// engines ran for, giving simulated instructions and cycles per second. Mode
+// 3 runs one instruction at a time while profiling.
+typedef enum SimProfileFormat
+{
+    SIM_PROFILE_JSON,
+    SIM_PROFILE_CSV // Rows of section,name,count,stall_cycles
+} SimProfileFormat;
+
+// Turns the profiling counters on (cleared) or off. Like the other counters
+// they restart on sim_reset(). Returns SIM_ERR_NOMEM if they cannot be
+// allocated.
+SimStatus sim_set_profiling(Simulator *sim, int enable);
+
+// Writes the profiling counters to a file. Returns SIM_ERR_CONFIG if
+// profiling is off and SIM_ERR_IO if the file cannot be written.
+SimStatus sim_write_profile(Simulator *sim, const char *filename, SimProfileFormat format);
+
+// Lock-step co-simulation of the pipeline modes: each instruction retiring
+// from WB is run again on a shadow functional simulator, which must be at
+// the same PC and write the same register or memory word. The first
+// mismatch ends the run with SIM_ERR_COSIM, after a dump of the pipeline
+// latches and of both register files. The shadow follows loads, resets,
+// checkpoints and fast-forwarding. Returns SIM_ERR_CONFIG in modes 0 and 3
+// and SIM_ERR_NOMEM if the shadow cannot be allocated.
+SimStatus sim_set_cosim(Simulator *sim, int enable);
+
+// Restores the state right after sim_load_image(): memory, registers, PC,
+// pipeline and counters. After sim_restore_checkpoint() the checkpoint is
+// restored again.
+SimStatus sim_reset(Simulator *sim);
+
+// Saves the complete simulation state, memory included, to a checkpoint file
+SimStatus sim_save_checkpoint(Simulator *sim, const char *filename);
+
+// Replaces the simulation with a checkpoint and returns its status. The
+// memory pages are mapped copy-on-write, so restoring is cheap even for a
+// large memory. Checkpoints taken in mode 0 or 3 can be restored in any mode;
+// pipeline checkpoints (modes 1 and 2) only in the same mode.
+SimStatus sim_restore_checkpoint(Simulator *sim, const char *filename);
+
+void sim_get_stats(Simulator *sim, SimStats *stats);
+int32_t sim_get_register(Simulator *sim, int reg);
+uint32_t sim_read_word(Simulator *sim, uint32_t addr);
+
+// Prints the "Simulation Summary" block with the final register and memory state
+void sim_print_summary(Simulator *sim);
+
+const char *sim_status_name(SimStatus status);
+
+#endif // MIPS_LITE_H
@@ -0,0 +1,379 @@
+#ifndef MIPS_MEMORY_H
+#define MIPS_MEMORY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Maps a whole file copy-on-write (private, writable) and returns it, or
+// NULL if it cannot be opened. Hosts without mmap read it into the heap.
+void *map_file(const char *filename, size_t *size)
+{
+#if !defined(_WIN32)
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *data = NULL;
+    if (fstat(fd, &st) == 0)
+    {
+        *size = st.st_size;
+        if (st.st_size == 0)
+        {
+            // Nothing to map, but not an open failure either
+            static char empty;
+            data = &empty;
+        }
+        else
+        {
+            data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+                data = NULL;
+        }
+    }
+    close(fd);
+    return data;
+#else
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    void *data = malloc(length > 0 ? length : 1);
+    if (data != NULL && fread(data, 1, length, file) != (size_t)length)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = length;
+    return data;
+#endif
+}
+
+void unmap_file(void *data, size_t size)
+{
+#if !defined(_WIN32)
+    if (size > 0)
+        munmap(data, size);
+#else
+    (void)size;
+    free(data);
+#endif
+}
+
+// Sparse data memory. The 32-bit byte address space is split into 4 KB
+// pages reached through a two-level page table; a page is only allocated
+// the first time it is written, so the footprint follows the touched pages
+// rather than the configured size. Reads of untouched pages return 0.
+//
+// mem_snapshot() marks the loaded image as the state mem_restore() returns
+// to. Nothing is copied up front: a page is saved only before its first
+// store after the snapshot, so a mapped image stays mapped until written.
+#define MEM_PAGE_BITS 12 // 4 KB pages
+#define MEM_PAGE_SIZE (1u << MEM_PAGE_BITS)
+#define MEM_PAGE_WORDS (MEM_PAGE_SIZE / 4)
+#define MEM_L2_BITS 10 // Pages per second-level table
+#define MEM_L2_ENTRIES (1u << MEM_L2_BITS)
+#define MEM_L1_ENTRIES (1u << (32 - MEM_PAGE_BITS - MEM_L2_BITS))
+#define MEM_ERR_NOMEM (-2) // Loader result when a page cannot be allocated; -1 is a bad file
+
+typedef struct MemPage
+{
+    uint32_t *words;                        // MEM_PAGE_WORDS words
+    uint32_t modified[MEM_PAGE_WORDS / 32]; // Bitmap of the words written by STW
+    uint32_t *initial;                      // Words at the snapshot, saved before the first store after it
+    bool mapped;                            // words points into the mapped image, not the heap
+    bool written;                           // Stored to since the snapshot
+    bool fresh;                             // Allocated after the snapshot, so all zero in it
+} MemPage;
+
+typedef struct Memory
+{
+    uint32_t size;           // Addressable bytes; LDW/STW at or past it are out of bounds
+    uint32_t last_page_num;  // One-entry translation cache for the common in-page access
+    MemPage *last_page;
+    size_t pages_allocated;
+    void *image;       // Mapped image file backing the mapped pages, if any
+    size_t image_size;
+    bool snapshot;     // mem_snapshot() taken: stores save the page first
+    MemPage **l1[MEM_L1_ENTRIES]; // l1[i][j] holds page number (i << MEM_L2_BITS) | j
+} Memory;
+
+static inline uint32_t mem_page_num(uint32_t addr)
+{
+    return addr >> MEM_PAGE_BITS;
+}
+
+static inline uint32_t mem_word_index(uint32_t addr)
+{
+    return (addr >> 2) & (MEM_PAGE_WORDS - 1);
+}
+
+void mem_init(Memory *m, uint32_t size)
+{
+    memset(m, 0, sizeof(*m));
+    m->size = size;
+}
+
+void mem_free(Memory *m)
+{
+    for (uint32_t i = 0; i < MEM_L1_ENTRIES; i++)
+    {
+        if (m->l1[i] == NULL)
+            continue;
+        for (uint32_t j = 0; j < MEM_L2_ENTRIES; j++)
+        {
+            if (m->l1[i][j] == NULL)
+                continue;
+            if (!m->l1[i][j]->mapped)
+                free(m->l1[i][j]->words);
+            free(m->l1[i][j]->initial);
+            free(m->l1[i][j]);
+        }
+        free(m->l1[i]);
+    }
+    if (m->image != NULL)
+        unmap_file(m->image, m->image_size);
+    mem_init(m, m->size);
+}
+
+// Fills a page table slot, creating the second-level table if needed.
+// Returns false if that table cannot be allocated.
+bool mem_install_page(Memory *m, uint32_t page_num, MemPage *page)
+{
+    MemPage **l2 = m->l1[page_num >> MEM_L2_BITS];
+    if (l2 == NULL)
+    {
+        l2 = calloc(MEM_L2_ENTRIES, sizeof(MemPage *));
+        if (l2 == NULL)
+            return false;
+        m->l1[page_num >> MEM_L2_BITS] = l2;
+    }
+    l2[page_num & (MEM_L2_ENTRIES - 1)] = page;
+    m->pages_allocated++;
+    return true;
+}
+
+// Page table walk; returns NULL for an untouched page unless 'allocate' is
+// set, and also when allocating it fails
+MemPage *mem_lookup_page(Memory *m, uint32_t page_num, bool allocate)
+{
+    MemPage **l2 = m->l1[page_num >> MEM_L2_BITS];
+    MemPage *page = l2 != NULL ? l2[page_num & (MEM_L2_ENTRIES - 1)] : NULL;
+    if (page == NULL && allocate)
+    {
+        page = calloc(1, sizeof(MemPage));
+        if (page != NULL)
+            page->words = calloc(MEM_PAGE_WORDS, sizeof(uint32_t));
+        if (page == NULL || page->words == NULL || !mem_install_page(m, page_num, page))
+        {
+            if (page != NULL)
+                free(page->words);
+            free(page);
+            return NULL;
+        }
+        page->fresh = m->snapshot;
+    }
+
+    if (page != NULL)
+    {
+        m->last_page_num = page_num;
+        m->last_page = page;
+    }
+    return page;
+}
+
+static inline uint32_t mem_read(Memory *m, uint32_t addr)
+{
+    MemPage *page = m->last_page;
+    if (page == NULL || mem_page_num(addr) != m->last_page_num)
+    {
+        page = mem_lookup_page(m, mem_page_num(addr), false);
+        if (page == NULL)
+            return 0;
+    }
+    return page->words[mem_word_index(addr)];
+}
+
+// Raw write, used by the image loader. Returns false if the page cannot be
+// allocated.
+static inline bool mem_write(Memory *m, uint32_t addr, uint32_t value)
+{
+    MemPage *page = m->last_page;
+    if (page == NULL || mem_page_num(addr) != m->last_page_num)
+    {
+        page = mem_lookup_page(m, mem_page_num(addr), true);
+        if (page == NULL)
+            return false;
+    }
+    page->words[mem_word_index(addr)] = value;
+    return true;
+}
+
+// Called before the first store to a page since the snapshot: keeps a copy
+// of its words for mem_restore(), unless it has one from an earlier run.
+// Returns false if the copy cannot be allocated.
+bool mem_save_page(Memory *m, MemPage *page)
+{
+    if (m->snapshot && !page->fresh && page->initial == NULL)
+    {
+        page->initial = malloc(MEM_PAGE_SIZE);
+        if (page->initial == NULL)
+            return false;
+        memcpy(page->initial, page->words, MEM_PAGE_SIZE);
+    }
+    page->written = true;
+    return true;
+}
+
+// STW: write and mark the word as modified for halt_summary(). Returns false
+// if the page cannot be allocated.
+static inline bool mem_store(Memory *m, uint32_t addr, uint32_t value)
+{
+    MemPage *page = m->last_page;
+    if (page == NULL || mem_page_num(addr) != m->last_page_num)
+    {
+        page = mem_lookup_page(m, mem_page_num(addr), true);
+        if (page == NULL)
+            return false;
+    }
+    if (!page->written && !mem_save_page(m, page))
+        return false;
+    uint32_t index = mem_word_index(addr);
+    page->words[index] = value;
+    page->modified[index / 32] |= 1u << (index % 32);
+    return true;
+}
+
+// Backs a page with MEM_PAGE_WORDS words of a mapped image, without copying.
+// Writes land in the private mapping, never in the file. Returns false if the
+// page cannot be allocated.
+bool mem_map_page(Memory *m, uint32_t page_num, uint32_t *words)
+{
+    MemPage *page = mem_lookup_page(m, page_num, false);
+    if (page != NULL)
+    {
+        // Already loaded by an earlier, overlapping segment
+        memcpy(page->words, words, MEM_PAGE_SIZE);
+        return true;
+    }
+    page = calloc(1, sizeof(MemPage));
+    if (page == NULL || !mem_install_page(m, page_num, page))
+    {
+        free(page);
+        return false;
+    }
+    page->words = words;
+    page->mapped = true;
+    return true;
+}
+
+// Removes the pages that mem_map_page() backed with the mapping at 'data',
+// for a loader that fails part way through
+void mem_unmap_pages(Memory *m, const void *data, size_t size)
+{
+    for (uint32_t i = 0; i < MEM_L1_ENTRIES; i++)
+    {
+        if (m->l1[i] == NULL)
+            continue;
+        for (uint32_t j = 0; j < MEM_L2_ENTRIES; j++)
+        {
+            MemPage *page = m->l1[i][j];
+            if (page == NULL || !page->mapped || (const char *)page->words < (const char *)data ||
+                (const char *)page->words >= (const char *)data + size)
+                continue;
+            free(page->initial);
+            free(page);
+            m->l1[i][j] = NULL;
+            m->pages_allocated--;
+        }
+    }
+    m->last_page = NULL;
+}
+
+// Makes 'dst' a heap copy of every page of 'src'. Returns false if a page
+// cannot be allocated, leaving 'dst' partly copied.
+bool mem_copy(Memory *dst, Memory *src)
+{
+    mem_free(dst);
+    dst->size = src->size;
+    for (uint32_t i = 0; i < MEM_L1_ENTRIES; i++)
+    {
+        if (src->l1[i] == NULL)
+            continue;
+        for (uint32_t j = 0; j < MEM_L2_ENTRIES; j++)
+        {
+            MemPage *page = src->l1[i][j];
+            if (page == NULL)
+                continue;
+            MemPage *copy = mem_lookup_page(dst, (i << MEM_L2_BITS) | j, true);
+            if (copy == NULL)
+                return false;
+            memcpy(copy->words, page->words, MEM_PAGE_SIZE);
+            memcpy(copy->modified, page->modified, sizeof(page->modified));
+        }
+    }
+    return true;
+}
+
+// Makes the current contents of 'm' the state mem_restore() goes back to
+void mem_snapshot(Memory *m)
+{
+    for (uint32_t i = 0; i < MEM_L1_ENTRIES; i++)
+    {
+        if (m->l1[i] == NULL)
+            continue;
+        for (uint32_t j = 0; j < MEM_L2_ENTRIES; j++)
+        {
+            MemPage *page = m->l1[i][j];
+            if (page == NULL)
+                continue;
+            free(page->initial);
+            page->initial = NULL;
+            page->written = false;
+            page->fresh = false;
+        }
+    }
+    m->snapshot = true;
+}
+
+// Puts back the words of every page stored to since mem_snapshot(). Pages
+// allocated since then are zeroed rather than freed. The loaders never mark
+// words as modified, so the snapshot has none.
+void mem_restore(Memory *m)
+{
+    for (uint32_t i = 0; i < MEM_L1_ENTRIES; i++)
+    {
+        if (m->l1[i] == NULL)
+            continue;
+        for (uint32_t j = 0; j < MEM_L2_ENTRIES; j++)
+        {
+            MemPage *page = m->l1[i][j];
+            if (page == NULL || !page->written)
+                continue;
+            if (page->fresh)
+                memset(page->words, 0, MEM_PAGE_SIZE);
+            else
+                memcpy(page->words, page->initial, MEM_PAGE_SIZE);
+            memset(page->modified, 0, sizeof(page->modified));
+            page->written = false;
+        }
+    }
+}
+
+static inline bool mem_page_modified(MemPage *page, uint32_t index)
+{
+    return (page->modified[index / 32] >> (index % 32)) & 1;
+}
+
+#endif // MIPS_MEMORY_H
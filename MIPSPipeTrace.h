@@ -0,0 +1,204 @@
+#ifndef MIPS_PIPE_TRACE_H
+#define MIPS_PIPE_TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#ifdef MIPS_LITE_ZLIB
+#include <zlib.h> // Build with -DMIPS_LITE_ZLIB -lz to compress the blocks
+#endif
+#include "MIPSDataStructure.h"
+#include "MIPSImage.h"
+
+// Binary pipeline trace, one record per cycle of the pipeline modes with what
+// print_pipeline() shows and a little more, rendered offline by
+// mips_trace_view.py. Fields are little-endian.
+//
+//   PipeTraceHeader
+//   blocks: u32 raw size, u32 stored size, then the stored bytes, zlib
+//   compressed if the header says so; records never span blocks
+//
+// Each instruction is named by its fetch number (PipelineStage.seq), so the
+// records only carry the PC and word of an instruction when it is fetched.
+//
+//   u8 kind:            PIPE_REC_* bits
+//   varint cycle:       total_cycles; minus that of the previous record except in keyframes
+//   u8 hazard:          stall cycles ID still waits for
+//   varint fetch_seq:   keyframes only, the latest fetch number
+//   u32 pc, u32 word:   PIPE_REC_FETCH only, the instruction fetched this cycle
+//   per stage, IF first:
+//     u8 bits:          PIPE_STAGE_VALID, PIPE_STAGE_STALL, frwd_flags[i] at bit i + 2
+//     varint age:       valid stages, fetch_seq minus the latch's seq
+//     u32 pc, u32 word: valid stages of keyframes
+//
+// A keyframe starts the trace, and follows any fetch the trace did not see
+// and sim_reset().
+#define PIPE_TRACE_MAGIC "MIPT"
+#define PIPE_TRACE_VERSION 1
+#define PIPE_TRACE_COMPRESSED 1 // PipeTraceHeader.flags
+#define PIPE_TRACE_BLOCK_SIZE (1 << 20)
+#define PIPE_TRACE_PACKED_SIZE (PIPE_TRACE_BLOCK_SIZE + PIPE_TRACE_BLOCK_SIZE / 1000 + 64) // zlib's worst case
+#define PIPE_TRACE_MAX_RECORD (32 + PIPELINE_MAX_DEPTH * 14)
+
+#define PIPE_REC_FETCH 1
+#define PIPE_REC_KEYFRAME 2
+
+#define PIPE_STAGE_VALID 1
+#define PIPE_STAGE_STALL 2
+
+typedef struct PipeTraceHeader
+{
+    char magic[4];     // PIPE_TRACE_MAGIC
+    uint32_t version;  // PIPE_TRACE_VERSION
+    uint32_t flags;    // PIPE_TRACE_COMPRESSED
+    uint32_t stage_id; // IF stages
+    uint32_t depth;    // Stages per record
+    uint32_t reserved[3];
+} PipeTraceHeader;
+
+typedef struct PipeTrace
+{
+    FILE *file;
+    uint8_t *buffer; // PIPE_TRACE_BLOCK_SIZE bytes of records waiting to be written
+    uint8_t *packed; // PIPE_TRACE_PACKED_SIZE bytes for compressing them, if compressed
+    size_t used;
+    uint8_t depth;
+    bool failed;        // A write failed; reported when the trace is closed
+    uint32_t fetch_seq; // Latest fetch recorded
+    int64_t cycle;      // Cycle of the latest record
+    uint64_t records;
+} PipeTrace;
+
+static inline uint8_t *pipe_trace_varint(uint8_t *p, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+static inline uint8_t *pipe_trace_u32(uint8_t *p, uint32_t value)
+{
+    value = image_le32(value);
+    memcpy(p, &value, 4);
+    return p + 4;
+}
+
+// Writes the buffered records as one block
+void pipe_trace_flush(PipeTrace *trace)
+{
+    if (trace->used == 0)
+        return;
+    const uint8_t *data = trace->buffer;
+    uint32_t stored = trace->used;
+#ifdef MIPS_LITE_ZLIB
+    uLongf packed_size = PIPE_TRACE_PACKED_SIZE;
+    if (compress2(trace->packed, &packed_size, trace->buffer, trace->used, Z_BEST_SPEED) != Z_OK)
+        trace->failed = true;
+    data = trace->packed;
+    stored = packed_size;
+#endif
+    uint32_t sizes[2] = {image_le32(trace->used), image_le32(stored)};
+    if (fwrite(sizes, sizeof(sizes), 1, trace->file) != 1 || fwrite(data, 1, stored, trace->file) != stored)
+        trace->failed = true;
+    trace->used = 0;
+}
+
+// Creates a trace of a pipeline with 'pipe's stages; NULL if the file cannot
+// be created
+PipeTrace *pipe_trace_open(const char *filename, const PipelineModel *pipe)
+{
+    PipeTrace *trace = calloc(1, sizeof(PipeTrace));
+    if (trace == NULL)
+        return NULL;
+    trace->buffer = malloc(PIPE_TRACE_BLOCK_SIZE);
+    bool allocated = trace->buffer != NULL;
+#ifdef MIPS_LITE_ZLIB
+    trace->packed = malloc(PIPE_TRACE_PACKED_SIZE);
+    allocated = allocated && trace->packed != NULL;
+#endif
+    trace->file = allocated ? fopen(filename, "wb") : NULL;
+    if (trace->file == NULL)
+    {
+        free(trace->buffer);
+        free(trace->packed);
+        free(trace);
+        return NULL;
+    }
+    trace->depth = pipe->depth;
+
+    PipeTraceHeader header = {0};
+    memcpy(header.magic, PIPE_TRACE_MAGIC, 4);
+    header.version = image_le32(PIPE_TRACE_VERSION);
+#ifdef MIPS_LITE_ZLIB
+    header.flags = image_le32(PIPE_TRACE_COMPRESSED);
+#endif
+    header.stage_id = image_le32(pipe->stage_id);
+    header.depth = image_le32(pipe->depth);
+    trace->failed = fwrite(&header, sizeof(header), 1, trace->file) != 1;
+    return trace;
+}
+
+// Flushes and closes 'trace'. Returns false if any of it could not be written.
+bool pipe_trace_close(PipeTrace *trace)
+{
+    pipe_trace_flush(trace);
+    bool ok = fclose(trace->file) == 0 && !trace->failed;
+    free(trace->buffer);
+    free(trace->packed);
+    free(trace);
+    return ok;
+}
+
+// Records the pipeline latches of the cycle just run, with 'hazard_cnt' the
+// stall cycles ID still waits for
+void pipe_trace_cycle(PipeTrace *trace, Simulator *sim, uint8_t hazard_cnt)
+{
+    if (trace->used + PIPE_TRACE_MAX_RECORD > PIPE_TRACE_BLOCK_SIZE)
+        pipe_trace_flush(trace);
+
+    uint8_t *p = trace->buffer + trace->used;
+    PipelineStage *fetched = &sim->pipeline[0];
+    bool keyframe = trace->records == 0 || sim->fetch_seq - trace->fetch_seq > 1 || sim->total_cycles < trace->cycle;
+    uint8_t kind = 0;
+    if (keyframe)
+        kind = PIPE_REC_KEYFRAME;
+    else if (sim->fetch_seq != trace->fetch_seq)
+        kind = PIPE_REC_FETCH;
+    *p++ = kind;
+    p = pipe_trace_varint(p, keyframe ? sim->total_cycles : sim->total_cycles - trace->cycle);
+    *p++ = hazard_cnt;
+    if (keyframe)
+        p = pipe_trace_varint(p, sim->fetch_seq);
+    else if (kind == PIPE_REC_FETCH)
+    {
+        p = pipe_trace_u32(p, fetched->pc);
+        p = pipe_trace_u32(p, fetched->raw.instruction);
+    }
+
+    for (int stage = 0; stage < trace->depth; stage++)
+    {
+        PipelineStage *latch = &sim->pipeline[stage];
+        *p++ = (latch->valid ? PIPE_STAGE_VALID : 0) | (latch->isStall ? PIPE_STAGE_STALL : 0) | latch->frwd_flags << 2;
+        if (!latch->valid)
+            continue;
+        p = pipe_trace_varint(p, sim->fetch_seq - latch->seq);
+        if (keyframe)
+        {
+            p = pipe_trace_u32(p, latch->pc);
+            p = pipe_trace_u32(p, latch->raw.instruction);
+        }
+    }
+
+    trace->used = p - trace->buffer;
+    trace->fetch_seq = sim->fetch_seq;
+    trace->cycle = sim->total_cycles;
+    trace->records++;
+}
+
+#endif // MIPS_PIPE_TRACE_H
@@ -0,0 +1,124 @@
+#ifndef MIPS_PROFILE_H
+#define MIPS_PROFILE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "MIPSDataStructure.h"
+
+// Counters of sim_set_profiling(), kept only while profiling so the engines
+// pay a single pointer test for them otherwise. Stall cycles are charged to
+// the instruction that waits: the one in ID for a RAW hazard, the one in EX
+// or MEM holding up the pipeline, and the branch or jump whose taken path
+// squashed younger fetches.
+typedef struct Profile
+{
+    uint32_t words;         // Words of the image covered by 'executed' and 'stall_cycles'
+    uint64_t *executed;     // Per word: times the instruction there was executed
+    uint64_t *stall_cycles; // Per word: cycles charged to it
+    uint64_t opcodes[64];   // Executed instructions per opcode
+
+    uint64_t raw_stalls;     // ID waiting for a source, see has_RAW_hazard*()
+    uint64_t ex_stalls;      // Pipeline held by a multi-cycle EX
+    uint64_t mem_stalls;     // Pipeline held by MEM: multi-cycle loads and stores, D-cache misses
+    uint64_t branch_bubbles; // Squashed fetches after a taken or mispredicted branch, not in total_stalls
+    uint64_t forwards[4];    // Operands forwarded, indexed as the FRWD_BIT()s of PipelineStage.frwd_flags
+
+    uint64_t host_ns;           // Wall-clock time spent running the engines
+    uint64_t host_instructions; // Instructions and cycles simulated in that time
+    uint64_t host_cycles;
+} Profile;
+
+static inline uint64_t profile_clock_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+void profile_free(Profile *p)
+{
+    if (p == NULL)
+        return;
+    free(p->executed);
+    free(p->stall_cycles);
+    free(p);
+}
+
+// Clears every counter
+void profile_reset(Profile *p)
+{
+    uint64_t *executed = p->executed;
+    uint64_t *stall_cycles = p->stall_cycles;
+    uint32_t words = p->words;
+    memset(p, 0, sizeof(*p));
+    p->executed = executed;
+    p->stall_cycles = stall_cycles;
+    p->words = words;
+    if (words > 0)
+    {
+        memset(executed, 0, words * sizeof(uint64_t));
+        memset(stall_cycles, 0, words * sizeof(uint64_t));
+    }
+}
+
+// Sizes the per-word counters for an image of 'words' words, clearing them
+// if the size changes. Returns false, changing nothing, if they cannot be
+// allocated.
+bool profile_resize(Profile *p, uint32_t words)
+{
+    if (words == p->words)
+        return true;
+    uint64_t *executed = calloc(words ? words : 1, sizeof(uint64_t));
+    uint64_t *stall_cycles = calloc(words ? words : 1, sizeof(uint64_t));
+    if (executed == NULL || stall_cycles == NULL)
+    {
+        free(executed);
+        free(stall_cycles);
+        return false;
+    }
+    free(p->executed);
+    free(p->stall_cycles);
+    p->executed = executed;
+    p->stall_cycles = stall_cycles;
+    p->words = words;
+    return true;
+}
+
+// Counts the instruction at 'pc' being executed
+static inline void profile_instruction(Profile *p, uint32_t pc, uint8_t opcode)
+{
+    p->opcodes[opcode & 0x3F]++;
+    if (pc / 4 < p->words)
+        p->executed[pc / 4]++;
+}
+
+// Counts the operands an instruction in EX takes from the forwarding paths:
+// EX/MEM before MEM/WB for each source, as execute_r_i_type() reads them
+static inline void profile_forwarding(Profile *p, uint8_t frwd_flags)
+{
+    if (frwd_flags & (FRWD_BIT(0) | FRWD_BIT(2)))
+        p->forwards[(frwd_flags & FRWD_BIT(0)) ? 0 : 2]++;
+    if (frwd_flags & (FRWD_BIT(1) | FRWD_BIT(3)))
+        p->forwards[(frwd_flags & FRWD_BIT(1)) ? 1 : 3]++;
+}
+
+// Charges 'cycles' stall cycles to the instruction at 'pc'
+static inline void profile_stall(Profile *p, uint32_t pc, uint64_t cycles)
+{
+    if (pc / 4 < p->words)
+        p->stall_cycles[pc / 4] += cycles;
+}
+
+// Adds an engine run that started at 'start_ns' and simulated 'instructions'
+// instructions and 'cycles' cycles
+static inline void profile_host_run(Profile *p, uint64_t start_ns, int64_t instructions, int64_t cycles)
+{
+    p->host_ns += profile_clock_ns() - start_ns;
+    p->host_instructions += instructions;
+    p->host_cycles += cycles;
+}
+
+#endif // MIPS_PROFILE_H
@@ -0,0 +1,32 @@
+#ifndef MIPS_TRACE_H
+#define MIPS_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Trace levels, from least to most verbose
+#define TRACE_OFF 0     // Only the halt_summary() block, warnings and errors
+#define TRACE_SUMMARY 1 // Plus one-off status messages (image loaded, HALT reached)
+#define TRACE_CYCLE 2   // Plus per-instruction DEBUG lines and the per-cycle pipeline dump
+
+// Highest level compiled in. Build with -DTRACE_LEVEL=0 to strip every
+// trace call from the simulator loops.
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_CYCLE
+#endif
+
+// Runtime verbosity (-v on the command line), capped by TRACE_LEVEL
+uint8_t trace_verbosity = TRACE_LEVEL;
+
+// Constant false when the level is compiled out, so the guarded code is removed
+#define TRACE_ENABLED(level) (TRACE_LEVEL >= (level) && trace_verbosity >= (level))
+
+// Writes to the output of the Simulator *sim in scope
+#define TRACE(level, ...)                      \
+    do                                         \
+    {                                          \
+        if (TRACE_ENABLED(level))              \
+            fprintf(sim->out, __VA_ARGS__);    \
+    } while (0)
+
+#endif // MIPS_TRACE_H
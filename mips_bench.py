@@ -0,0 +1,262 @@
+# mips_bench.py
+import sys
+import os
+import json
+import time
+import shutil
+import argparse
+import platform
+import subprocess
+import tempfile
+import threading
+
+from mips_lite_gcc import encode_instruction
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_BASELINE = os.path.join(SCRIPT_DIR, 'mips_bench_baseline.json')
+MEMORY = '16K'        # -m of every run: the kernels keep their data at 4096..8191
+DATA_BASE = 4096
+MAX_COUNT = 32767     # Largest ADDI/MULI immediate
+PADDING = 8           # Words after HALT, so the pipeline modes can fetch past it
+EXIT_FILLER = 16      # Instructions between the last loop branch and HALT: a HALT fetched
+                      # behind a taken branch would stop fetch in the pipeline modes
+
+# Kernels: each returns the assembly of a program running about 'target'
+# dynamic instructions. Loops count down in R1 and branch back with an
+# always-taken BEQ R0, R0; every value stays small enough not to overflow.
+
+def load_count(reg, n):
+    # reg = n, for n up to about 10^9
+    high, low = divmod(max(n, 1), MAX_COUNT)
+    return [f"ADDI R{reg}, R0, {high}",
+            f"MULI R{reg}, R{reg}, {MAX_COUNT}",
+            f"ADDI R{reg}, R{reg}, {low}"]
+
+def counted_loop(body, iterations):
+    # Runs 'body' 'iterations' times: len(body) + 3 instructions each
+    return (load_count(1, iterations) + body +
+            ["SUBI R1, R1, 1",
+             "BZ R1, 2",
+             f"BEQ R0, R0, -{len(body) + 2}"])
+
+def alu_loop(target):
+    # Long arithmetic loop of independent ALU ops
+    body = ["ADDI R2, R2, 3",
+            "ADD R3, R3, R10",
+            "SUBI R4, R4, 1",
+            "XOR R5, R5, R11",
+            "ORI R6, R6, 5",
+            "AND R7, R7, R12",
+            "MULI R8, R9, 3",
+            "XORI R9, R9, 7"]
+    init = ["ADDI R10, R0, 1", "ADDI R11, R0, 21845", "ADDI R12, R0, 4095"]
+    return init + counted_loop(body, target // (len(body) + 3))
+
+def mem_stream(target):
+    # Load/store streaming over a 4 KB array, LDW/LDW/STW per pair of words
+    inner = ["LDW R3, R4, 0",
+             "LDW R6, R4, 4",
+             "ADD R3, R3, R6",
+             "ADDI R3, R3, 1",
+             "STW R3, R4, 0",
+             "ADDI R4, R4, 8",
+             "SUBI R5, R5, 1",
+             "BZ R5, 2",
+             "BEQ R0, R0, -8"]
+    pairs = 512
+    body = [f"ADDI R4, R0, {DATA_BASE}", f"ADDI R5, R0, {pairs}"] + inner
+    per_pass = len(inner) * pairs + 2
+    return counted_loop(body, target // per_pass)
+
+def branch_heavy(target):
+    # Data-dependent branches on bits of a 15-bit linear congruential sequence
+    body = ["MULI R5, R5, 25173",
+            "ADDI R5, R5, 13849",
+            "ANDI R5, R5, 32767",
+            "ANDI R6, R5, 16384",
+            "BZ R6, 2",
+            "ADDI R7, R7, 1",
+            "ANDI R6, R5, 4096",
+            "BZ R6, 2",
+            "ADDI R8, R8, 1",
+            "ANDI R6, R5, 1024",
+            "BZ R6, 3",
+            "ADDI R9, R9, 1",
+            "SUBI R10, R10, 1"]
+    return ["ADDI R5, R0, 12345"] + counted_loop(body, target // (len(body) + 1))
+
+def dep_chain(target):
+    # Every instruction needs the previous result, through registers and
+    # through a store and the load after it
+    body = ["ADD R3, R3, R2",
+            "XOR R3, R3, R1",
+            "ANDI R3, R3, 32767",
+            "MULI R3, R3, 3",
+            "STW R3, R4, 0",
+            "LDW R5, R4, 0",
+            "ADD R3, R5, R2"]
+    init = ["ADDI R2, R0, 1", f"ADDI R4, R0, {DATA_BASE}"]
+    return init + counted_loop(body, target // (len(body) + 3))
+
+KERNELS = {
+    'alu_loop': alu_loop,
+    'mem_stream': mem_stream,
+    'branch_heavy': branch_heavy,
+    'dep_chain': dep_chain,
+}
+
+def write_kernel(name, target, directory):
+    lines = KERNELS[name](target) + ["ADDI R13, R13, 1"] * EXIT_FILLER + ["HALT"]
+    filename = os.path.join(directory, f"{name}.o")
+    with open(filename, 'w') as fout:
+        for line in lines:
+            fout.write(encode_instruction(line) + '\n')
+        fout.write('00000000\n' * PADDING)
+    return filename
+
+def build_simulator(directory):
+    binary = os.path.join(directory, 'mips_lite')
+    subprocess.run(['gcc', '-O2', '-o', binary, os.path.join(SCRIPT_DIR, 'FinalProject.c'), '-lpthread', '-lm'],
+                   check=True)
+    return binary
+
+def parse_summary(text):
+    values = {}
+    for line in text.splitlines():
+        for key, label in (('instructions', '- Total Instructions Executed:'), ('cycles', '- Total Clock Cycles:')):
+            if line.startswith(label):
+                values[key] = int(line[len(label):])
+    return values
+
+def watch_peak_rss(pid, peak, done):
+    # ru_maxrss of a forked child still counts the Python parent it was forked
+    # from, so sample the simulator's own VmHWM until it exits. The last read
+    # before the process turns into a zombie holds its final high-water mark.
+    # The interval backs off so the watcher barely competes with the run.
+    status = f"/proc/{pid}/status"
+    interval = 0.001
+    while True:
+        try:
+            with open(status) as f:
+                lines = [line for line in f if line.startswith('VmHWM:')]
+        except OSError:
+            return
+        if not lines:
+            return
+        peak[0] = int(lines[0].split()[1])
+        if done.wait(interval):
+            return
+        interval = min(interval * 2, 0.05)
+
+def run_once(binary, image, mode):
+    # Wall-clock seconds, summary values and peak resident memory of one run
+    start = time.perf_counter()
+    proc = subprocess.Popen([binary, image, str(mode), '-v', '0', '-m', MEMORY],
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    peak, done = [0], threading.Event()
+    watcher = threading.Thread(target=watch_peak_rss, args=(proc.pid, peak, done))
+    watcher.start()
+    output = proc.stdout.read()
+    seconds = time.perf_counter() - start
+    done.set()
+    watcher.join()  # Before wait4(), so the pid cannot be reused under the watcher
+    _, status, _ = os.wait4(proc.pid, 0)
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    values = parse_summary(output)
+    if 'instructions' not in values:
+        raise RuntimeError(f"{image} mode {mode}: no summary\n{output[-2000:]}")
+    values['seconds'] = seconds
+    values['max_rss_kb'] = peak[0]
+    return values
+
+def run_suite(binary, directory, target, modes, repeat):
+    results = {}
+    for name in KERNELS:
+        image = write_kernel(name, target, directory)
+        for mode in modes:
+            runs = [run_once(binary, image, mode) for _ in range(repeat)]
+            best = min(runs, key=lambda r: r['seconds'])
+            result = {
+                'instructions': best['instructions'],
+                'cycles': best.get('cycles', 0),
+                'host_mips': round(best['instructions'] / best['seconds'] / 1e6, 2),
+                'max_rss_kb': max(r['max_rss_kb'] for r in runs),
+            }
+            result['cpi'] = round(result['cycles'] / result['instructions'], 4) if result['cycles'] else 0
+            results[f"{name}/{mode}"] = result
+            cpi = f"{result['cpi']:6.3f}" if result['cycles'] else '     -'
+            print(f"{name:<14} mode {mode}  {result['instructions']:>12}  {cpi}  "
+                  f"{result['host_mips']:9.2f}  {result['max_rss_kb'] / 1024:8.1f}", flush=True)
+    return results
+
+def compare(results, baseline, tolerance):
+    # Flags slower host MIPS beyond 'tolerance', and any change in the
+    # simulated instructions or cycles, which means the model changed
+    regressions = 0
+    if baseline.get('target') != results['target']:
+        print(f"\nBaseline was measured at {baseline.get('target')} instructions, not compared.")
+        return 0
+    print(f"\nAgainst the baseline ({baseline.get('host', 'unknown host')}):")
+    for key, result in results['kernels'].items():
+        old = baseline['kernels'].get(key)
+        if old is None:
+            print(f"  {key:<16} new")
+            continue
+        notes = []
+        change = result['host_mips'] / old['host_mips'] - 1 if old['host_mips'] else 0
+        if change < -tolerance:
+            notes.append("SLOWER")
+        if result['instructions'] != old['instructions'] or result['cycles'] != old['cycles']:
+            notes.append(f"MODEL CHANGED (instructions {old['instructions']} -> {result['instructions']}, "
+                         f"cycles {old['cycles']} -> {result['cycles']})")
+        if result['max_rss_kb'] > old['max_rss_kb'] * (1 + tolerance) + 1024:
+            notes.append(f"MEMORY {old['max_rss_kb']} -> {result['max_rss_kb']} KB")
+        regressions += len(notes) > 0
+        print(f"  {key:<16} {change * 100:+6.1f}% host MIPS  {' '.join(notes)}")
+    return regressions
+
+def main():
+    parser = argparse.ArgumentParser(description="Throughput benchmark of the MIPS-lite simulator")
+    parser.add_argument('--sim', help="simulator binary (default: build FinalProject.c with gcc -O2)")
+    parser.add_argument('--instructions', type=float, default=1e7,
+                        help="dynamic instructions per kernel, 1e6 to 1e9 (default 1e7)")
+    parser.add_argument('--modes', default='0,1,2,3', help="comma-separated modes (default 0,1,2,3)")
+    parser.add_argument('--repeat', type=int, default=3, help="runs per kernel and mode, the fastest counts (default 3)")
+    parser.add_argument('--baseline', default=DEFAULT_BASELINE, help="baseline file (default mips_bench_baseline.json)")
+    parser.add_argument('--save', action='store_true', help="store the results as the new baseline")
+    parser.add_argument('--tolerance', type=float, default=0.15, help="host MIPS drop flagged (default 0.15)")
+    parser.add_argument('--keep', help="directory to keep the generated kernels in")
+    args = parser.parse_args()
+
+    target = int(args.instructions)
+    modes = [int(m) for m in args.modes.split(',')]
+    directory = args.keep or tempfile.mkdtemp(prefix='mips_bench_')
+    os.makedirs(directory, exist_ok=True)
+    try:
+        binary = args.sim or build_simulator(directory)
+        print(f"{'kernel':<14} {'mode':<6} {'instructions':>12}  {'CPI':>6}  {'host MIPS':>9}  {'max RSS MB':>8}")
+        results = {
+            'target': target,
+            'host': f"{platform.node()} {platform.machine()} {platform.processor()}".strip(),
+            'kernels': run_suite(binary, directory, target, modes, args.repeat),
+        }
+    finally:
+        if not args.keep:
+            shutil.rmtree(directory, ignore_errors=True)
+
+    if args.save:
+        with open(args.baseline, 'w') as fout:
+            json.dump(results, fout, indent=2)
+            fout.write('\n')
+        print(f"\nBaseline saved to {args.baseline}")
+        return 0
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as fin:
+            regressions = compare(results, json.load(fin), args.tolerance)
+        if regressions:
+            print(f"\n{regressions} regression(s)")
+            return 1
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,6 +1,7 @@
 # mips_lite_gcc.py
 import sys
 import os
+import struct
 
 OPCODES = {
     'ADD':  0x00, 'ADDI': 0x01,
@@ -114,11 +115,64 @@ def decode_file(input_file):
             fout.write(decoded + '\n')
     print(f"Decoded to {output_file}")
 
+# Binary image layout, see MIPSImage.h
+IMAGE_MAGIC = b'MIPL'
+IMAGE_VERSION = 1
+PAGE_SIZE = 4096
+PAGE_WORDS = PAGE_SIZE // 4
+
+def parse_hex_word(line):
+    # Same result as strtoul(line, NULL, 16) truncated to 32 bits
+    text = line.strip()
+    if text[:2].lower() == '0x':
+        text = text[2:]
+    digits = ''
+    for ch in text:
+        if ch not in '0123456789abcdefABCDEF':
+            break
+        digits += ch
+    return int(digits, 16) & 0xFFFFFFFF if digits else 0
+
+def pack_file(input_file):
+    output_file = os.path.splitext(input_file)[0] + '.bin'
+    with open(input_file, 'r') as fin:
+        words = [parse_hex_word(line) for line in fin]
+
+    # One segment per run of pages holding a non-zero word; zero pages are
+    # left out and read back as 0
+    pages = [words[i:i + PAGE_WORDS] for i in range(0, len(words), PAGE_WORDS)]
+    segments = []
+    for index, page in enumerate(pages):
+        if not any(page):
+            continue
+        if segments and segments[-1][1] == index:
+            segments[-1][1] = index + 1
+        else:
+            segments.append([index, index + 1])
+
+    header_size = 32 + 16 * len(segments)
+    offset = (header_size + PAGE_SIZE - 1) // PAGE_SIZE * PAGE_SIZE
+    table = b''
+    data = b''
+    for first, last in segments:
+        seg_words = words[first * PAGE_WORDS:last * PAGE_WORDS]
+        table += struct.pack('<4I', first * PAGE_SIZE, len(seg_words), offset + len(data), 0)
+        seg_words += [0] * ((last - first) * PAGE_WORDS - len(seg_words))
+        data += struct.pack('<%dI' % len(seg_words), *seg_words)
+
+    header = IMAGE_MAGIC + struct.pack('<7I', IMAGE_VERSION, 0, len(words), len(segments), 0, 0, 0)
+    with open(output_file, 'wb') as fout:
+        fout.write(header + table)
+        fout.write(b'\0' * (offset - header_size))
+        fout.write(data)
+    print(f"Packed to {output_file}")
+
 if __name__ == "__main__":
     if len(sys.argv) != 3:
         print("Usage:")
         print("  python3 mips_lite_gcc.py encode <filename>.s")
         print("  python3 mips_lite_gcc.py decode <filename>.o")
+        print("  python3 mips_lite_gcc.py pack <filename>.txt|.o   (hex image -> binary image <filename>.bin)")
         sys.exit(1)
 
     mode = sys.argv[1]
@@ -128,5 +182,7 @@ if __name__ == "__main__":
         encode_file(filename)
     elif mode == 'decode' and filename.endswith('.o'):
         decode_file(filename)
+    elif mode == 'pack':
+        pack_file(filename)
     else:
         print("Invalid mode or filename.")
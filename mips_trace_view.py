@@ -0,0 +1,217 @@
+# mips_trace_view.py
+import sys
+import struct
+import zlib
+
+# Binary pipeline trace layout, see MIPSPipeTrace.h
+TRACE_MAGIC = b'MIPT'
+TRACE_VERSION = 1
+TRACE_COMPRESSED = 1
+
+REC_FETCH = 1
+REC_KEYFRAME = 2
+
+STAGE_VALID = 1
+STAGE_STALL = 2
+
+INSTRUCTION_NAMES = {
+    0x00: 'ADD', 0x01: 'ADDI',
+    0x02: 'SUB', 0x03: 'SUBI',
+    0x04: 'MUL', 0x05: 'MULI',
+    0x06: 'OR',  0x07: 'ORI',
+    0x08: 'AND', 0x09: 'ANDI',
+    0x0A: 'XOR', 0x0B: 'XORI',
+    0x0C: 'LDW', 0x0D: 'STW',
+    0x0E: 'BZ',  0x0F: 'BEQ',
+    0x10: 'JR',  0x11: 'HALT',
+}
+
+R_TYPE = (0x00, 0x02, 0x04, 0x06, 0x08, 0x0A)
+
+def decode_str(word):
+    # Same text as get_decode_str() in FinalProject.c
+    opcode = (word >> 26) & 0x3F
+    rs = (word >> 21) & 0x1F
+    rt = (word >> 16) & 0x1F
+    rd = (word >> 11) & 0x1F
+    imm = word & 0xFFFF
+    if imm & 0x8000:
+        imm -= 0x10000
+    name = INSTRUCTION_NAMES.get(opcode, 'UNKNOWN')
+    if opcode in R_TYPE:
+        return f"{name} R{rd}, R{rt}, R{rs}"
+    return f"{name} R{rt}, R{rs}, {imm}"
+
+def stage_names(stage_id, depth):
+    if stage_id == 1:
+        names = ['IF']
+    else:
+        names = [f"IF{i + 1}" for i in range(stage_id)]
+    return (names + ['ID', 'EX', 'MEM', 'WB'])[:depth]
+
+def read_varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if byte < 0x80:
+            return value, pos
+
+def read_blocks(fin, compressed):
+    while True:
+        sizes = fin.read(8)
+        if len(sizes) < 8:
+            return
+        raw_size, stored_size = struct.unpack('<2I', sizes)
+        data = fin.read(stored_size)
+        if len(data) < stored_size:
+            raise ValueError("Truncated trace")
+        if compressed:
+            data = zlib.decompress(data)
+        if len(data) != raw_size:
+            raise ValueError("Corrupt trace block")
+        yield data
+
+def read_trace(filename):
+    """Yields (cycle, hazard, stages) per record, stages holding per latch
+    None when empty, else (seq, pc, word, stall, frwd_flags)."""
+    with open(filename, 'rb') as fin:
+        header = fin.read(32)
+        if len(header) < 32 or header[:4] != TRACE_MAGIC:
+            raise ValueError("Not a pipeline trace")
+        version, flags, stage_id, depth = struct.unpack('<4I', header[4:20])
+        if version != TRACE_VERSION:
+            raise ValueError(f"Unsupported trace version {version}")
+        yield stage_id, depth
+
+        fetch_seq = 0
+        cycle = 0
+        known = {} # seq -> (pc, word) of the instructions that may still be in flight
+        for data in read_blocks(fin, flags & TRACE_COMPRESSED):
+            pos = 0
+            while pos < len(data):
+                kind = data[pos]
+                delta, pos = read_varint(data, pos + 1)
+                hazard = data[pos]
+                pos += 1
+                keyframe = kind & REC_KEYFRAME
+                if keyframe:
+                    cycle = delta
+                    fetch_seq, pos = read_varint(data, pos)
+                    known = {}
+                else:
+                    cycle += delta
+                    if kind & REC_FETCH:
+                        fetch_seq += 1
+                        known[fetch_seq] = struct.unpack_from('<2I', data, pos)
+                        pos += 8
+
+                stages = []
+                for stage in range(depth):
+                    bits = data[pos]
+                    pos += 1
+                    if not bits & STAGE_VALID:
+                        stages.append(None)
+                        continue
+                    age, pos = read_varint(data, pos)
+                    seq = fetch_seq - age
+                    if keyframe:
+                        known[seq] = struct.unpack_from('<2I', data, pos)
+                        pos += 8
+                    pc, word = known.get(seq, (0, 0))
+                    stages.append((seq, pc, word, bool(bits & STAGE_STALL), (bits >> 2) & 0xF))
+
+                # Nothing older than the last stage can come back
+                if len(known) > 4 * depth:
+                    oldest = min(s[0] for s in stages if s is not None) if any(stages) else fetch_seq
+                    known = {seq: v for seq, v in known.items() if seq >= oldest}
+                yield cycle, hazard, stages
+
+def print_text(filename):
+    # The pipeline dump of -v 2, one block per cycle
+    records = read_trace(filename)
+    stage_id, depth = next(records)
+    names = stage_names(stage_id, depth)
+    out = sys.stdout
+    for cycle, hazard, stages in records:
+        out.write("DEBUG: Pipeline contents -\n")
+        for name, latch in zip(names, stages):
+            if latch is None:
+                continue
+            text = "Stall" if latch[3] else decode_str(latch[2])
+            out.write(f"{name}: {text}\n")
+        out.write("\n")
+
+def print_konata(filename):
+    # Kanata log format 0004, as read by the Konata pipeline viewer
+    records = read_trace(filename)
+    stage_id, depth = next(records)
+    names = stage_names(stage_id, depth)
+    out = sys.stdout
+    out.write("Kanata\t0004\n")
+    ids = {}      # seq -> Konata id of the instructions in flight
+    current = {}  # seq -> stage it was last seen in
+    next_id = 0
+    retired = 0
+    last_cycle = None
+    for cycle, hazard, stages in records:
+        if last_cycle is None:
+            out.write(f"C=\t{cycle}\n")
+        elif cycle > last_cycle:
+            out.write(f"C\t{cycle - last_cycle}\n")
+        last_cycle = cycle
+
+        seen = {}
+        for name, latch in zip(names, stages):
+            if latch is None or latch[3]:
+                continue
+            seq, pc, word = latch[0], latch[1], latch[2]
+            seen.setdefault(seq, name)
+            if seq not in ids:
+                ids[seq] = next_id
+                out.write(f"I\t{next_id}\t{seq}\t0\n")
+                out.write(f"L\t{next_id}\t0\t{pc:08X}: {decode_str(word)}\n")
+                next_id += 1
+
+        for seq in list(ids):
+            if seq in seen:
+                continue
+            # Left the pipeline: retired from WB, else squashed
+            if current.get(seq) == 'WB':
+                out.write(f"E\t{ids[seq]}\t0\tWB\n")
+                out.write(f"R\t{ids[seq]}\t{retired}\t0\n")
+                retired += 1
+            else:
+                if seq in current:
+                    out.write(f"E\t{ids[seq]}\t0\t{current[seq]}\n")
+                out.write(f"R\t{ids[seq]}\t{ids[seq]}\t1\n")
+            del ids[seq]
+            current.pop(seq, None)
+
+        for seq, name in seen.items():
+            if current.get(seq) == name:
+                continue
+            if seq in current:
+                out.write(f"E\t{ids[seq]}\t0\t{current[seq]}\n")
+            out.write(f"S\t{ids[seq]}\t0\t{name}\n")
+            current[seq] = name
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        print("Usage:")
+        print("  python3 mips_trace_view.py text <trace>     (pipeline dump of -v 2)")
+        print("  python3 mips_trace_view.py konata <trace>   (Konata pipeline view log)")
+        sys.exit(1)
+
+    mode = sys.argv[1]
+    filename = sys.argv[2]
+
+    if mode == 'text':
+        print_text(filename)
+    elif mode == 'konata':
+        print_konata(filename)
+    else:
+        print("Invalid mode.")